@@ -0,0 +1,868 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "uthread.h"
+#include "lib/heap.h"
+
+/**
+ * A microbenchmark suite for the `uthread` scheduler.
+ *
+ * Each benchmark case runs in its own forked child process, because the
+ * `uthread` system can only be initialized once per process. Every case prints
+ * one JSON object, and the whole run is printed as a single JSON document:
+ *
+ *     { "ncpus": 8, "quick": false, "results": [ {...}, {...} ] }
+ *
+ * Where it makes sense, a case is also run with raw `pthread`s (`"impl":
+ * "pthread"`) so that the two can be compared.
+ *
+ * Cases which are bound by scheduling latency stop early once they have run
+ * for `CASE_TIME_LIMIT_NS`; their `"ops"` is the work actually done.
+ *
+ * Usage: `bench_uthread [-q] [name-filter]`. With `-q`, smaller iteration
+ * counts are used. With a filter, only cases whose name contains the filter
+ * are run.
+ */
+
+
+/* Define benchmark parameters. **************************************************/
+
+#define CASE_TIME_LIMIT_NS      2e9
+
+// The parameters of the case that is about to be run. These are set by the
+// parent before forking, so they are visible to the child's `uthread`s.
+int _bench_kthreads;
+int _bench_uthreads;
+long _bench_iterations;
+long _bench_burn_loops;
+bool _bench_quick = false;
+
+// Shared state of the running case.
+volatile bool _bench_go;
+volatile int _bench_started;
+volatile bool _bench_stop;
+volatile int _bench_turn;
+volatile long _bench_handoffs;
+double _bench_deadline;
+volatile double _bench_sink;
+pthread_mutex_t _bench_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t _bench_cond = PTHREAD_COND_INITIALIZER;
+
+bool _bench_first_result = true;
+
+
+
+/* Define timing and reporting helpers. ******************************************/
+
+double now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+
+
+/**
+ * Does some floating point work that the compiler cannot remove.
+ */
+void burn(long loops)
+{
+	double acc = 0.0;
+	for (long i = 0; i < loops; i++) {
+		acc += (double) i * 1.000001;
+	}
+	_bench_sink = acc;
+}
+
+
+
+/**
+ * Returns the number of `burn()` loops which take roughly the given time.
+ */
+long calibrate_burn(double target_ns)
+{
+	long loops = 1000;
+	double elapsed;
+	do {
+		loops *= 2;
+		double start = now_ns();
+		burn(loops);
+		elapsed = now_ns() - start;
+	} while (elapsed < 10e6);
+	return (long) (loops * target_ns / elapsed) + 1;
+}
+
+
+
+/**
+ * Prints one result object. Must be called from the case's child process. The
+ * rates are `null` when no ops were done (or no time was measured), since JSON
+ * has no `inf` or `nan`.
+ */
+void report(const char* name, const char* impl, long ops, double elapsed_ns,
+            const char* extra)
+{
+	char ns_per_op[32] = "null";
+	char ops_per_sec[32] = "null";
+	if (ops > 0 && elapsed_ns > 0) {
+		snprintf(ns_per_op, sizeof(ns_per_op), "%.1f", elapsed_ns / ops);
+		snprintf(ops_per_sec, sizeof(ops_per_sec), "%.0f", ops / (elapsed_ns / 1e9));
+	}
+	printf("    {\"name\": \"%s\", \"impl\": \"%s\", \"kthreads\": %d, "
+	       "\"uthreads\": %d, \"ops\": %ld, \"elapsed_ns\": %.0f, "
+	       "\"ns_per_op\": %s, \"ops_per_sec\": %s%s%s}",
+	       name, impl, _bench_kthreads, _bench_uthreads, ops, elapsed_ns,
+	       ns_per_op, ops_per_sec,
+	       extra != NULL ? ", " : "", extra != NULL ? extra : "");
+	fflush(stdout);
+}
+
+
+
+/**
+ * Waits (without burning the CPU which the `kthread`s need) until `_bench_started`
+ * reaches the given count.
+ */
+void wait_for_started(int count)
+{
+	while (_bench_started < count) {
+		usleep(100);
+	}
+}
+
+
+
+/* Define the create+exit throughput cases. **************************************/
+
+void create_exit_func()
+{
+	uthread_exit();
+}
+
+
+
+void bench_create_exit_uthread()
+{
+	system_init(_bench_kthreads);
+	double start = now_ns();
+	for (long i = 0; i < _bench_iterations; i++) {
+		if (uthread_create(create_exit_func) != 0) {
+			fprintf(stderr, "uthread_create() failed\n");
+			exit(1);
+		}
+	}
+	uthread_exit();
+	report("create_exit", "uthread", _bench_iterations, now_ns() - start, NULL);
+}
+
+
+
+void* create_exit_pthread_func(void* arg)
+{
+	return arg;
+}
+
+
+
+void bench_create_exit_pthread()
+{
+	const int BATCH = 256;
+	pthread_t threads[BATCH];
+	double start = now_ns();
+	for (long i = 0; i < _bench_iterations; i += BATCH) {
+		int n = (_bench_iterations - i < BATCH) ? _bench_iterations - i : BATCH;
+		for (int j = 0; j < n; j++) {
+			pthread_create(threads + j, NULL, create_exit_pthread_func, NULL);
+		}
+		for (int j = 0; j < n; j++) {
+			pthread_join(threads[j], NULL);
+		}
+	}
+	report("create_exit", "pthread", _bench_iterations, now_ns() - start, NULL);
+}
+
+
+
+/* Define the backlog memory case. ***********************************************/
+
+/**
+ * Returns the resident set size of this process, in bytes.
+ */
+long resident_bytes()
+{
+	FILE* status = fopen("/proc/self/status", "r");
+	char line[256];
+	long kb = 0;
+	while (status != NULL && fgets(line, sizeof(line), status) != NULL) {
+		if (strncmp(line, "VmRSS:", 6) == 0) {
+			kb = atol(line + 6);
+		}
+	}
+	if (status != NULL) {
+		fclose(status);
+	}
+	return kb * 1024;
+}
+
+
+
+/**
+ * Occupies the only `kthread`, without yielding, until the backlog is made.
+ */
+void backlog_hog_func()
+{
+	__sync_fetch_and_add(&_bench_started, 1);
+	while (!_bench_go) {
+	}
+}
+
+
+
+void backlog_func(void* arg)
+{
+	(void) arg;
+}
+
+
+
+/**
+ * Creates `_bench_iterations` `uthread`s which cannot run yet, and reports
+ * how much memory each of them takes while it waits.
+ */
+void bench_create_backlog_uthread()
+{
+	system_init(1);
+	uthread_create(backlog_hog_func);
+	wait_for_started(1);
+
+	long rss_before = resident_bytes();
+	double start = now_ns();
+	for (long i = 0; i < _bench_iterations; i++) {
+		uthread_create_arg(backlog_func, NULL);
+	}
+	double elapsed = now_ns() - start;
+	long rss_after = resident_bytes();
+
+	_bench_go = true;
+	uthread_exit();
+	char extra[64];
+	snprintf(extra, sizeof(extra), "\"rss_bytes_per_uthread\": %.1f",
+	         (double) (rss_after - rss_before) / _bench_iterations);
+	report("create_backlog", "uthread", _bench_iterations, elapsed, extra);
+}
+
+
+
+/* Define the cross-thread spawn case. *******************************************/
+
+void spawn_func(void* arg)
+{
+	(void) arg;
+}
+
+
+
+void* spawn_producer_func(void* arg)
+{
+	long count = (long) arg;
+	__sync_fetch_and_add(&_bench_started, 1);
+	while (!_bench_go) {
+		sched_yield();
+	}
+	for (long i = 0; i < count; i++) {
+		if (uthread_create_arg(spawn_func, NULL) != 0) {
+			fprintf(stderr, "uthread_create_arg() failed\n");
+			exit(1);
+		}
+	}
+	return NULL;
+}
+
+
+
+/**
+ * `_bench_uthreads` plain `pthread`s (not `uthread`s) concurrently create a
+ * total of `_bench_iterations` empty `uthread`s, as an I/O layer would.
+ */
+void bench_spawn_producers_uthread()
+{
+	system_init(_bench_kthreads);
+	pthread_t* producers = malloc(_bench_uthreads * sizeof(pthread_t));
+	for (int i = 0; i < _bench_uthreads; i++) {
+		long count = _bench_iterations / _bench_uthreads;
+		pthread_create(producers + i, NULL, spawn_producer_func, (void*) count);
+	}
+	wait_for_started(_bench_uthreads);
+
+	double start = now_ns();
+	_bench_go = true;
+	for (int i = 0; i < _bench_uthreads; i++) {
+		pthread_join(producers[i], NULL);
+	}
+	uthread_exit();
+	long ops = (_bench_iterations / _bench_uthreads) * _bench_uthreads;
+	char extra[64];
+	snprintf(extra, sizeof(extra), "\"producers\": %d", _bench_uthreads);
+	report("spawn_producers", "uthread", ops, now_ns() - start, extra);
+	free(producers);
+}
+
+
+
+/* Define the yield ping-pong latency cases. *************************************/
+
+/**
+ * Two of these pass the turn back and forth until `_bench_iterations` handoffs
+ * have been made or `_bench_deadline` has passed. A `uthread` yields until it
+ * is its turn, so every handoff includes at least one real context switch.
+ */
+void pingpong_func()
+{
+	int me = __sync_fetch_and_add(&_bench_started, 1);
+	while (!_bench_go) {
+		uthread_yield();
+	}
+	while (!_bench_stop) {
+		if (_bench_turn == me) {
+			_bench_turn = 1 - me;
+			_bench_handoffs++;
+			if (_bench_handoffs >= _bench_iterations || now_ns() > _bench_deadline) {
+				_bench_stop = true;
+			}
+		} else {
+			uthread_yield();
+		}
+	}
+	uthread_exit();
+}
+
+
+
+void bench_pingpong_uthread()
+{
+	system_init(_bench_kthreads);
+	uthread_create(pingpong_func);
+	uthread_create(pingpong_func);
+	wait_for_started(2);
+	double start = now_ns();
+	_bench_deadline = start + CASE_TIME_LIMIT_NS;
+	_bench_go = true;
+	uthread_exit();
+	report("yield_pingpong", "uthread", _bench_handoffs, now_ns() - start, NULL);
+}
+
+
+
+void* pingpong_pthread_func(void* arg)
+{
+	int me = (int) (long) arg;
+	pthread_mutex_lock(&_bench_mutex);
+	while (!_bench_stop) {
+		if (_bench_turn == me) {
+			_bench_turn = 1 - me;
+			_bench_handoffs++;
+			if (_bench_handoffs >= _bench_iterations || now_ns() > _bench_deadline) {
+				_bench_stop = true;
+			}
+			pthread_cond_signal(&_bench_cond);
+		} else {
+			pthread_cond_wait(&_bench_cond, &_bench_mutex);
+		}
+	}
+	pthread_cond_signal(&_bench_cond);
+	pthread_mutex_unlock(&_bench_mutex);
+	return NULL;
+}
+
+
+
+void bench_pingpong_pthread()
+{
+	pthread_t threads[2];
+	double start = now_ns();
+	_bench_deadline = start + CASE_TIME_LIMIT_NS;
+	for (long i = 0; i < 2; i++) {
+		pthread_create(threads + i, NULL, pingpong_pthread_func, (void*) i);
+	}
+	for (int i = 0; i < 2; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	report("yield_pingpong", "pthread", _bench_handoffs, now_ns() - start, NULL);
+}
+
+
+
+/* Define the yield throughput and scaling cases. ********************************/
+
+/**
+ * Does `_bench_iterations` rounds of `_bench_burn_loops` of work followed by a yield.
+ */
+void yield_loop_func()
+{
+	__sync_fetch_and_add(&_bench_started, 1);
+	while (!_bench_go) {
+		uthread_yield();
+	}
+	for (long i = 0; i < _bench_iterations; i++) {
+		burn(_bench_burn_loops);
+		uthread_yield();
+	}
+	uthread_exit();
+}
+
+
+
+void* yield_loop_pthread_func(void* arg)
+{
+	for (long i = 0; i < _bench_iterations; i++) {
+		burn(_bench_burn_loops);
+		sched_yield();
+	}
+	return arg;
+}
+
+
+
+void run_yield_loop_uthread(const char* name)
+{
+	system_init(_bench_kthreads);
+	for (int i = 0; i < _bench_uthreads; i++) {
+		uthread_create(yield_loop_func);
+	}
+	wait_for_started(_bench_uthreads);
+	double start = now_ns();
+	_bench_go = true;
+	uthread_exit();
+	report(name, "uthread", _bench_uthreads * _bench_iterations, now_ns() - start, NULL);
+}
+
+
+
+void run_yield_loop_pthread(const char* name)
+{
+	pthread_t* threads = malloc(_bench_uthreads * sizeof(pthread_t));
+	double start = now_ns();
+	for (int i = 0; i < _bench_uthreads; i++) {
+		pthread_create(threads + i, NULL, yield_loop_pthread_func, NULL);
+	}
+	for (int i = 0; i < _bench_uthreads; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	report(name, "pthread", _bench_uthreads * _bench_iterations, now_ns() - start, NULL);
+	free(threads);
+}
+
+
+
+void bench_yield_throughput_uthread() { run_yield_loop_uthread("yield_throughput"); }
+void bench_yield_throughput_pthread() { run_yield_loop_pthread("yield_throughput"); }
+void bench_scaling_uthread() { run_yield_loop_uthread("scaling"); }
+void bench_scaling_pthread() { run_yield_loop_pthread("scaling"); }
+
+
+
+/* Define the budget-checked yield case. *****************************************/
+
+/**
+ * Calls `uthread_maybe_yield()` after each of `_bench_iterations` tiny bits of
+ * work, as a compute loop would.
+ */
+void maybe_yield_func()
+{
+	__sync_fetch_and_add(&_bench_started, 1);
+	while (!_bench_go) {
+		uthread_yield();
+	}
+	double acc = 0.0;
+	for (long i = 0; i < _bench_iterations; i++) {
+		acc += (double) i;
+		uthread_maybe_yield();
+	}
+	_bench_sink = acc;
+	uthread_exit();
+}
+
+
+
+void bench_maybe_yield_uthread()
+{
+	system_init(_bench_kthreads);
+	for (int i = 0; i < _bench_uthreads; i++) {
+		uthread_create(maybe_yield_func);
+	}
+	wait_for_started(_bench_uthreads);
+	double start = now_ns();
+	_bench_go = true;
+	uthread_exit();
+	report("maybe_yield", "uthread", _bench_uthreads * _bench_iterations, now_ns() - start, NULL);
+}
+
+
+
+/* Define the fork-join case. ****************************************************/
+
+void parallel_for_body(long begin, long end, void* ctx)
+{
+	(void) ctx;
+	for (long i = begin; i < end; i++) {
+		burn(_bench_burn_loops);
+	}
+}
+
+
+
+/**
+ * Runs `_bench_iterations` iterations of `_bench_burn_loops` of work with
+ * `uthread_parallel_for()`, called from the main thread. The grain is one
+ * iteration, so the overhead per chunk is included.
+ */
+void bench_parallel_for_uthread()
+{
+	system_init(_bench_kthreads);
+	double start = now_ns();
+	uthread_parallel_for(0, _bench_iterations, 1, parallel_for_body, NULL);
+	report("parallel_for", "uthread", _bench_iterations, now_ns() - start, NULL);
+	uthread_exit();
+}
+
+
+
+/* Define the spawn-tree cases. **************************************************/
+
+typedef struct tree_node {
+	int depth;  // Of the subtree below it.
+	bool child_first;  // Whether to use `uthread_spawn()`.
+	volatile int* pending;  // The parent's count of unfinished children.
+} tree_node_t;
+
+volatile int _bench_live;
+volatile int _bench_max_live;
+
+/**
+ * Runs one node of a binary tree of `uthread`s: it spawns its two children,
+ * waits for them, and then counts itself out of its parent's `pending`.
+ */
+void tree_func(void* arg)
+{
+	tree_node_t* node = arg;
+	int live = __atomic_add_fetch(&_bench_live, 1, __ATOMIC_RELAXED);
+	int max_live = _bench_max_live;
+	while (live > max_live && !__atomic_compare_exchange_n(&_bench_max_live, &max_live, live,
+	                                                       false, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+	if (node->depth > 0) {
+		volatile int pending = 2;
+		tree_node_t children[2];
+		for (int i = 0; i < 2; i++) {
+			children[i] = (tree_node_t) { node->depth - 1, node->child_first, &pending };
+			if (node->child_first) {
+				uthread_spawn(tree_func, &children[i]);
+			} else {
+				uthread_create_arg(tree_func, &children[i]);
+			}
+		}
+		int seen;
+		while ((seen = pending) != 0) {
+			uthread_wait(&pending, seen, NULL);
+		}
+	}
+
+	__atomic_sub_fetch(&_bench_live, 1, __ATOMIC_RELAXED);
+	if (__atomic_sub_fetch(node->pending, 1, __ATOMIC_SEQ_CST) == 0) {
+		uthread_wake(node->pending, 1);
+	}
+}
+
+
+
+/**
+ * Runs a binary tree of `uthread`s which is `_bench_iterations` deep, and
+ * reports the most `uthread`s which were alive at once. Parent-first, each
+ * level is queued before the one below it runs, while child-first, each
+ * `kthread` only holds the `uthread`s on its path down the tree.
+ */
+void bench_spawn_tree(const char* impl, bool child_first)
+{
+	system_init(_bench_kthreads);
+	volatile int pending = 1;
+	tree_node_t root = { _bench_iterations, child_first, &pending };
+	double start = now_ns();
+	uthread_create_arg(tree_func, &root);
+	uthread_exit();
+	double elapsed = now_ns() - start;
+
+	char extra[64];
+	snprintf(extra, sizeof(extra), "\"max_live_uthreads\": %d", _bench_max_live);
+	report("spawn_tree", impl, (2L << _bench_iterations) - 1, elapsed, extra);
+}
+
+
+
+void bench_spawn_tree_child_first()
+{
+	bench_spawn_tree("spawn", true);
+}
+
+
+
+void bench_spawn_tree_parent_first()
+{
+	bench_spawn_tree("create", false);
+}
+
+
+
+/* Define the arena allocation cases. ********************************************/
+
+#define ALLOCS_PER_UTHREAD      1024
+#define ALLOC_SIZE              48
+
+/**
+ * Makes `ALLOCS_PER_UTHREAD` small allocations, which all die when it exits,
+ * either from its arena or with `malloc()` (freeing them one by one). Each
+ * allocation links to the previous one, so that they can be freed.
+ */
+void arena_func(void* use_arena)
+{
+	void** prev = NULL;
+	for (int i = 0; i < ALLOCS_PER_UTHREAD; i++) {
+		void** ptr = (use_arena != NULL) ? uthread_arena_alloc(ALLOC_SIZE) : malloc(ALLOC_SIZE);
+		memset(ptr, i, ALLOC_SIZE);
+		*ptr = prev;
+		prev = ptr;
+	}
+	while (use_arena == NULL && prev != NULL) {
+		void** next = *prev;
+		free(prev);
+		prev = next;
+	}
+}
+
+
+
+/**
+ * Creates `_bench_iterations` `uthread`s which each run `arena_func()`. The
+ * cost of creating them is included in both variants.
+ */
+void bench_arena(const char* name, void* use_arena)
+{
+	system_init(_bench_kthreads);
+	double start = now_ns();
+	for (long i = 0; i < _bench_iterations; i++) {
+		uthread_create_arg(arena_func, use_arena);
+	}
+	uthread_exit();
+	report(name, "uthread", _bench_iterations * ALLOCS_PER_UTHREAD, now_ns() - start, NULL);
+}
+
+
+
+void bench_arena_alloc_uthread()
+{
+	bench_arena("arena_alloc", (void*) 1);
+}
+
+
+
+void bench_malloc_free_uthread()
+{
+	bench_arena("malloc_free", NULL);
+}
+
+
+
+/* Define the waiting-heap cost case. ********************************************/
+
+/**
+ * Stands in for a waiting `uthread`: like a `uthread_t`, it fills a cache line
+ * and is keyed by its running time.
+ */
+typedef struct heap_waiter {
+	struct timeval running_time;
+} __attribute__((aligned(64))) heap_waiter_t;
+
+/**
+ * Orders waiters like `uthread.c` orders its waiting heaps: the least running
+ * time first.
+ */
+int heap_waiter_priority(const void* key1, const void* key2)
+{
+	const struct timeval* tv1 = &(((const heap_waiter_t*) key1)->running_time);
+	const struct timeval* tv2 = &(((const heap_waiter_t*) key2)->running_time);
+	if (timercmp(tv1, tv2, <)) {
+		return 1;
+	}
+	return timercmp(tv1, tv2, >) ? -1 : 0;
+}
+
+
+
+/**
+ * Measures the waiting-heap operations which a switching `uthread_yield()`
+ * performs (an extract followed by an insert, under a mutex) with
+ * `_bench_uthreads` waiters, which have distinct running times in a scrambled
+ * order. Each extracted waiter is reinserted with some more running time, like
+ * a `uthread` which yields after running for a while.
+ */
+void bench_waiting_heap_uthread()
+{
+	int num_waiting = _bench_uthreads;
+	Heap heap = HEAPinit(heap_waiter_priority, NULL);
+	heap_waiter_t* waiters = aligned_alloc(64, num_waiting * sizeof(heap_waiter_t));
+	if (heap == NULL || waiters == NULL) {
+		fprintf(stderr, "bench_uthread: out of memory\n");
+		exit(1);
+	}
+	for (int i = 0; i < num_waiting; i++) {
+		long usec = ((long) i * 7919) % num_waiting;
+		waiters[i].running_time.tv_sec = usec / 1000000;
+		waiters[i].running_time.tv_usec = usec % 1000000;
+		HEAPinsert(heap, waiters + i);
+	}
+
+	struct timeval slice = { .tv_sec = 0, .tv_usec = num_waiting / 2 + 1 };
+	double start = now_ns();
+	for (long op = 0; op < _bench_iterations; op++) {
+		heap_waiter_t* waiter = NULL;
+		pthread_mutex_lock(&_bench_mutex);
+		HEAPextract(heap, (void **) &waiter);
+		timeradd(&(waiter->running_time), &slice, &(waiter->running_time));
+		HEAPinsert(heap, waiter);
+		pthread_mutex_unlock(&_bench_mutex);
+	}
+	double elapsed = now_ns() - start;
+
+	HEAPdestroy(heap);
+	free(waiters);
+	report("waiting_heap", "uthread", _bench_iterations, elapsed, NULL);
+}
+
+
+
+/* Define the benchmark driver. **************************************************/
+
+/**
+ * Runs the given case in a forked child process, with the given parameters.
+ */
+void run_case(const char* filter, const char* name, void (*func)(),
+              int kthreads, int uthreads, long iterations, long burn_loops)
+{
+	if (filter != NULL && strstr(name, filter) == NULL) {
+		return;
+	}
+
+	_bench_kthreads = kthreads;
+	_bench_uthreads = uthreads;
+	_bench_iterations = iterations;
+	_bench_burn_loops = burn_loops;
+
+	printf("%s\n", _bench_first_result ? "" : ",");
+	fflush(stdout);
+	_bench_first_result = false;
+
+	pid_t pid = fork();
+	if (pid == 0) {
+		func();
+		exit(0);
+	}
+
+	int status;
+	waitpid(pid, &status, 0);
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		fprintf(stderr, "bench_uthread: case `%s` (%d kthreads, %d uthreads) "
+		        "failed\n", name, kthreads, uthreads);
+		printf("    {\"name\": \"%s\", \"kthreads\": %d, \"uthreads\": %d, "
+		       "\"failed\": true}", name, kthreads, uthreads);
+	}
+}
+
+
+
+int main(int argc, char* argv[])
+{
+	const char* filter = NULL;
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-q") == 0) {
+			_bench_quick = true;
+		} else {
+			filter = argv[i];
+		}
+	}
+
+	int ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	long scale = _bench_quick ? 10 : 1;
+	long burn_20us = calibrate_burn(20000.0);
+
+	printf("{\n  \"ncpus\": %d,\n  \"quick\": %s,\n  \"results\": [",
+	       ncpus, _bench_quick ? "true" : "false");
+	fflush(stdout);
+
+	long creates = 100000 / scale;
+	run_case(filter, "create_exit", bench_create_exit_uthread, 1, creates, creates, 0);
+	run_case(filter, "create_exit", bench_create_exit_uthread, ncpus, creates, creates, 0);
+	run_case(filter, "create_exit", bench_create_exit_pthread, ncpus, creates, creates, 0);
+
+	run_case(filter, "create_backlog", bench_create_backlog_uthread, 1, 1, creates, 0);
+
+	for (int producers = 1; producers <= 4 * ncpus; producers *= 4) {
+		run_case(filter, "spawn_producers", bench_spawn_producers_uthread,
+		         ncpus, producers, creates, 0);
+	}
+
+	run_case(filter, "yield_pingpong", bench_pingpong_uthread, 1, 2, 1000000 / scale, 0);
+	run_case(filter, "yield_pingpong", bench_pingpong_pthread, 1, 2, 1000000 / scale, 0);
+
+	// One `uthread` never really yields, while two share their `kthread`.
+	run_case(filter, "maybe_yield", bench_maybe_yield_uthread, 1, 1, 100000000 / scale, 0);
+	run_case(filter, "maybe_yield", bench_maybe_yield_uthread, 1, 2, 100000000 / scale, 0);
+
+	for (int per_kthread = 1; per_kthread <= 64; per_kthread *= 8) {
+		int uthreads = per_kthread * ncpus;
+		long iterations = 200000 / scale / uthreads + 1;
+		run_case(filter, "yield_throughput", bench_yield_throughput_uthread,
+		         ncpus, uthreads, iterations, 0);
+		run_case(filter, "yield_throughput", bench_yield_throughput_pthread,
+		         ncpus, uthreads, iterations, 0);
+	}
+
+	// Scale from 1 `kthread` up to one per CPU, doubling (but always including
+	// `ncpus` itself). The total amount of work stays fixed.
+	for (int kthreads = 1; ; kthreads = (2 * kthreads < ncpus) ? 2 * kthreads : ncpus) {
+		run_case(filter, "scaling", bench_scaling_uthread,
+		         kthreads, 4 * kthreads, 2000 / scale / kthreads, burn_20us);
+		run_case(filter, "scaling", bench_scaling_pthread,
+		         kthreads, kthreads, 8000 / scale / kthreads, burn_20us);
+		run_case(filter, "parallel_for", bench_parallel_for_uthread,
+		         kthreads, 0, 8000 / scale, burn_20us);
+		if (kthreads == ncpus) {
+			break;
+		}
+	}
+
+	int tree_depth = _bench_quick ? 12 : 16;
+	run_case(filter, "spawn_tree", bench_spawn_tree_child_first, 1, 0, tree_depth, 0);
+	run_case(filter, "spawn_tree", bench_spawn_tree_child_first, ncpus, 0, tree_depth, 0);
+	run_case(filter, "spawn_tree", bench_spawn_tree_parent_first, ncpus, 0, tree_depth, 0);
+
+	run_case(filter, "arena_alloc", bench_arena_alloc_uthread, 1, 1, creates / 10, 0);
+	run_case(filter, "malloc_free", bench_malloc_free_uthread, 1, 1, creates / 10, 0);
+
+	for (int waiting = 10; waiting <= 100000; waiting *= 100) {
+		run_case(filter, "waiting_heap", bench_waiting_heap_uthread,
+		         1, waiting, 1000000 / scale, 0);
+	}
+
+	printf("\n  ]\n}\n");
+	return 0;
+}
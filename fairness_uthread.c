@@ -0,0 +1,553 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <limits.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "uthread.h"
+
+/**
+ * A regression harness for the fairness and scalability of the `uthread`
+ * scheduler, which promises that the ready `uthread` with the smallest running
+ * time runs next.
+ *
+ * Each case runs a mix of `uthread`s on some number of `kthread`s for a fixed
+ * window of time, in its own forked child process (like `bench_uthread`). The
+ * mixes are:
+ *
+ * - `cpu`: each `uthread` repeatedly burns `CPU_UNIT_NS` and then yields.
+ * - `yield`: the same, with units of `YIELD_UNIT_NS`.
+ * - `io`: each `uthread` burns `IO_UNIT_NS` and then waits (as if for I/O) for
+ *   `IO_WAIT_NS`, with `uthread_wait()`.
+ * - `spawn`: the main thread creates bursts of short-lived `uthread`s, each of
+ *   which burns `SPAWN_UNIT_NS` once.
+ *
+ * Each case prints one JSON object with its throughput (units of work per
+ * second), its scheduling delays (p50/p99/p999, in nanoseconds), and, for the
+ * mixes of long-lived `uthread`s, how evenly the work was shared: Jain's
+ * fairness index of the units done by each `uthread`, and how far the most and
+ * least served `uthread`s were from the mean. The scheduling delay is the time
+ * from yielding until running again (`cpu`, `yield`), from a wait's deadline
+ * until running again (`io`), or from creation until first running (`spawn`).
+ *
+ * A case fails if Jain's index is below `MIN_JAIN_INDEX`, or, given a baseline
+ * (the output of an earlier run), if it is worse than the baseline's matching
+ * case by more than the allowed margins. Fairness is only judged when each
+ * `uthread` did enough units for it to be meaningful; with many `uthread`s, the
+ * capped window may be too short for that, and the case then reports
+ * `"judged": false` rather than passing. The exit status is 1 if any case
+ * failed.
+ *
+ * Usage: `fairness_uthread [-q] [-b baseline.json] [-n max_uthreads] [mix]`.
+ * With `-q`, windows of at most a second and at most 1000 `uthread`s are used. With a mix
+ * name, only that mix is run.
+ */
+
+
+/* Define harness parameters. ****************************************************/
+
+#define CPU_UNIT_NS             100000.0
+#define YIELD_UNIT_NS           1000.0
+#define IO_UNIT_NS              10000.0
+#define IO_WAIT_NS              50000L
+#define SPAWN_UNIT_NS           10000.0
+#define SPAWN_BURST_GAP_US      1000
+
+#define MIN_WINDOW_NS           0.5e9
+#define MAX_WINDOW_NS           10e9
+#define QUICK_MAX_WINDOW_NS     1e9
+#define MIN_UNITS_FOR_FAIRNESS  8.0     // Per `uthread`, on average.
+#define MIN_JAIN_INDEX          0.9
+#define BASELINE_JAIN_SLACK     0.05    // How much lower the index may be.
+#define BASELINE_THROUGHPUT_RATIO  0.7  // How much lower the throughput may be.
+#define BASELINE_DELAY_RATIO    1.5     // How much higher p99 may be...
+#define BASELINE_DELAY_SLACK_NS 100000.0  // ...plus this.
+
+#define HIST_BUCKETS_PER_DOUBLING  8
+#define HIST_BUCKETS            (64 * HIST_BUCKETS_PER_DOUBLING)
+
+// The parameters of the case that is about to be run. These are set by the
+// parent before forking, so they are visible to the child's `uthread`s.
+const char* _fair_mix;
+int _fair_kthreads;
+int _fair_uthreads;
+double _fair_window_ns;
+long _fair_burn_loops_per_us;  // `burn()` loops per microsecond.
+bool _fair_quick = false;
+
+// Shared state of the running case.
+volatile int _fair_go;
+volatile int _fair_started;
+volatile bool _fair_stop;
+volatile long* _fair_units;  // Units of work done by each `uthread`.
+volatile long _fair_hist[HIST_BUCKETS];  // Scheduling delays, log-scaled.
+volatile double _fair_sink;
+
+// Baseline results, one JSON object per line.
+char** _fair_baseline = NULL;
+int _fair_baseline_len = 0;
+
+bool _fair_first_result = true;
+
+
+
+/* Define timing and statistics helpers. *****************************************/
+
+double now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+
+
+/**
+ * Does some floating point work that the compiler cannot remove.
+ */
+void burn(long loops)
+{
+	double acc = 0.0;
+	for (long i = 0; i < loops; i++) {
+		acc += (double) i * 1.000001;
+	}
+	_fair_sink = acc;
+}
+
+
+
+/**
+ * Burns the CPU for about the given time.
+ */
+void burn_ns(double ns)
+{
+	burn((long) (ns * _fair_burn_loops_per_us / 1000.0) + 1);
+}
+
+
+
+/**
+ * Returns the number of `burn()` loops which take about a microsecond.
+ */
+long calibrate_burn()
+{
+	long loops = 1000;
+	double elapsed;
+	do {
+		loops *= 2;
+		double start = now_ns();
+		burn(loops);
+		elapsed = now_ns() - start;
+	} while (elapsed < 10e6);
+	return (long) (loops * 1000.0 / elapsed) + 1;
+}
+
+
+
+/**
+ * Records one scheduling delay. The histogram's buckets are spaced evenly on
+ * a log scale, `HIST_BUCKETS_PER_DOUBLING` per doubling, so percentiles are
+ * accurate to within about 9%.
+ */
+void hist_add(double ns)
+{
+	int bucket = (ns < 1.0) ? 0 : (int) (log2(ns) * HIST_BUCKETS_PER_DOUBLING);
+	bucket = (bucket >= HIST_BUCKETS) ? HIST_BUCKETS - 1 : bucket;
+	__sync_fetch_and_add(_fair_hist + bucket, 1);
+}
+
+
+
+/**
+ * Returns the upper bound of the bucket which holds the given percentile of
+ * the recorded delays, or -1 if none were recorded.
+ */
+double hist_percentile(double percentile)
+{
+	long total = 0;
+	for (int b = 0; b < HIST_BUCKETS; b++) {
+		total += _fair_hist[b];
+	}
+	if (total == 0) {
+		return -1.0;
+	}
+	long rank = (long) ceil(total * percentile / 100.0);
+	long seen = 0;
+	for (int b = 0; b < HIST_BUCKETS; b++) {
+		seen += _fair_hist[b];
+		if (seen >= rank) {
+			return exp2((double) (b + 1) / HIST_BUCKETS_PER_DOUBLING);
+		}
+	}
+	return -1.0;
+}
+
+
+
+/**
+ * Returns the value of the given key in the given line of JSON, if it is a
+ * number, or `NAN` if it is missing (or not a number).
+ */
+double json_number(const char* line, const char* key)
+{
+	char pattern[64];
+	snprintf(pattern, sizeof(pattern), "\"%s\": ", key);
+	const char* found = strstr(line, pattern);
+	double value;
+	if (found == NULL || sscanf(found + strlen(pattern), "%lf", &value) != 1) {
+		return NAN;
+	}
+	return value;
+}
+
+
+
+/**
+ * Loads the result lines of the given earlier output. Returns whether that worked.
+ */
+bool load_baseline(const char* path)
+{
+	FILE* in = fopen(path, "r");
+	if (in == NULL) {
+		return false;
+	}
+	char buf[1024];
+	while (fgets(buf, sizeof(buf), in) != NULL) {
+		if (strstr(buf, "\"mix\": ") != NULL) {
+			_fair_baseline = realloc(_fair_baseline, (_fair_baseline_len + 1) * sizeof(char*));
+			_fair_baseline[_fair_baseline_len++] = strdup(buf);
+		}
+	}
+	fclose(in);
+	return true;
+}
+
+
+
+/**
+ * Returns the baseline's result for the case which is running, or `NULL`.
+ */
+const char* find_baseline()
+{
+	char mix[64];
+	snprintf(mix, sizeof(mix), "\"mix\": \"%s\"", _fair_mix);
+	for (int i = 0; i < _fair_baseline_len; i++) {
+		if (strstr(_fair_baseline[i], mix) != NULL
+		    && json_number(_fair_baseline[i], "kthreads") == _fair_kthreads
+		    && json_number(_fair_baseline[i], "uthreads") == _fair_uthreads) {
+			return _fair_baseline[i];
+		}
+	}
+	return NULL;
+}
+
+
+
+/**
+ * Computes the case's metrics, prints its result object, and returns whether
+ * it passed. Must be called from the case's child process.
+ */
+bool report(long total_units, double elapsed_ns, bool has_fairness)
+{
+	double throughput = total_units / (elapsed_ns / 1e9);
+	double p50 = hist_percentile(50.0);
+	double p99 = hist_percentile(99.0);
+	double p999 = hist_percentile(99.9);
+
+	// Jain's index is 1 when every `uthread` did the same work, and 1/n when
+	// one did all of it.
+	double mean = (double) total_units / _fair_uthreads;
+	bool judge_fairness = has_fairness && mean >= MIN_UNITS_FOR_FAIRNESS;
+	double jain = NAN;
+	double max_dev = NAN;
+	double min_dev = NAN;
+	if (judge_fairness) {
+		double sum_sq = 0.0;
+		long most = _fair_units[0];
+		long least = _fair_units[0];
+		for (int i = 0; i < _fair_uthreads; i++) {
+			sum_sq += (double) _fair_units[i] * _fair_units[i];
+			most = (_fair_units[i] > most) ? _fair_units[i] : most;
+			least = (_fair_units[i] < least) ? _fair_units[i] : least;
+		}
+		jain = ((double) total_units * total_units) / (_fair_uthreads * sum_sq);
+		max_dev = most / mean - 1.0;
+		min_dev = 1.0 - least / mean;
+	}
+
+	// Judge the case, against the floor and the baseline.
+	char failures[256] = "";
+	if (judge_fairness && jain < MIN_JAIN_INDEX) {
+		strcat(failures, " jain_index");
+	}
+	const char* base = find_baseline();
+	if (base != NULL) {
+		double base_jain = json_number(base, "jain_index");
+		double base_throughput = json_number(base, "units_per_sec");
+		double base_p99 = json_number(base, "delay_p99_ns");
+		if (judge_fairness && !isnan(base_jain) && jain < base_jain - BASELINE_JAIN_SLACK) {
+			strcat(failures, " jain_index_vs_baseline");
+		}
+		if (!isnan(base_throughput) && throughput < base_throughput * BASELINE_THROUGHPUT_RATIO) {
+			strcat(failures, " throughput_vs_baseline");
+		}
+		if (!isnan(base_p99) && base_p99 >= 0.0
+		    && p99 > base_p99 * BASELINE_DELAY_RATIO + BASELINE_DELAY_SLACK_NS) {
+			strcat(failures, " delay_p99_vs_baseline");
+		}
+	}
+
+	printf("    {\"mix\": \"%s\", \"kthreads\": %d, \"uthreads\": %d, "
+	       "\"units\": %ld, \"elapsed_ns\": %.0f, \"units_per_sec\": %.0f, "
+	       "\"delay_p50_ns\": %.0f, \"delay_p99_ns\": %.0f, \"delay_p999_ns\": %.0f",
+	       _fair_mix, _fair_kthreads, _fair_uthreads, total_units, elapsed_ns, throughput, p50, p99, p999);
+	if (judge_fairness) {
+		printf(", \"jain_index\": %.4f, \"max_share_dev\": %.4f, \"min_share_dev\": %.4f",
+		       jain, max_dev, min_dev);
+	}
+	// A case whose fairness could not be judged has not passed, but it only
+	// fails if it regressed against the baseline.
+	if (has_fairness) {
+		printf(", \"judged\": %s", judge_fairness ? "true" : "false");
+	}
+	if (judge_fairness || !has_fairness || failures[0] != '\0') {
+		printf(", \"passed\": %s", (failures[0] == '\0') ? "true" : "false");
+	}
+	if (failures[0] != '\0') {
+		printf(", \"failures\": \"%s\"", failures + 1);
+	}
+	printf("}");
+	if (has_fairness && !judge_fairness) {
+		fprintf(stderr, "fairness_uthread: mix `%s` (%d kthreads, %d uthreads) did %.1f units "
+		        "per uthread, too few to judge its fairness\n",
+		        _fair_mix, _fair_kthreads, _fair_uthreads, mean);
+	}
+	fflush(stdout);
+	return failures[0] == '\0';
+}
+
+
+
+/**
+ * Waits (without burning the CPU which the `kthread`s need) until `_fair_started`
+ * reaches the given count.
+ */
+void wait_for_started(int count)
+{
+	while (_fair_started < count) {
+		usleep(100);
+	}
+}
+
+
+
+/* Define the mixes of long-lived `uthread`s. ************************************/
+
+/**
+ * The body of each `uthread` of the `cpu`, `yield`, and `io` mixes. It counts
+ * the units of work which it does during the window, and records how long it
+ * waits to run again after each one.
+ */
+void long_lived_func(void* arg)
+{
+	long idx = (long) arg;
+	bool is_io = (strcmp(_fair_mix, "io") == 0);
+	double unit_ns = is_io ? IO_UNIT_NS : (strcmp(_fair_mix, "cpu") == 0) ? CPU_UNIT_NS : YIELD_UNIT_NS;
+	int io_futex = 0;
+
+	// Park until the window starts, so that every `uthread` starts it with
+	// about the same running time.
+	__sync_fetch_and_add(&_fair_started, 1);
+	while (!_fair_go) {
+		uthread_wait(&_fair_go, 0, NULL);
+	}
+	while (!_fair_stop) {
+		burn_ns(unit_ns);
+		_fair_units[idx]++;
+		if (is_io) {
+			struct timespec timeout = { 0, IO_WAIT_NS };
+			double deadline = now_ns() + IO_WAIT_NS;
+			uthread_wait(&io_futex, 0, &timeout);
+			hist_add(now_ns() - deadline);
+		} else {
+			double before = now_ns();
+			uthread_yield();
+			hist_add(now_ns() - before);
+		}
+	}
+}
+
+
+
+void run_long_lived()
+{
+	system_init(_fair_kthreads);
+	for (long i = 0; i < _fair_uthreads; i++) {
+		uthread_create_arg(long_lived_func, (void*) i);
+	}
+	wait_for_started(_fair_uthreads);
+
+	double start = now_ns();
+	_fair_go = 1;
+	uthread_wake(&_fair_go, INT_MAX);
+	while (now_ns() - start < _fair_window_ns) {
+		usleep(10000);
+	}
+	_fair_stop = true;
+	double elapsed = now_ns() - start;
+	uthread_exit();
+
+	long total_units = 0;
+	for (int i = 0; i < _fair_uthreads; i++) {
+		total_units += _fair_units[i];
+	}
+	exit(report(total_units, elapsed, true) ? 0 : 3);
+}
+
+
+
+/* Define the bursty spawn mix. **************************************************/
+
+/**
+ * The body of each short-lived `uthread`, which is given its creation time.
+ * Its unit of work is counted in `_fair_units[0]`.
+ */
+void spawned_func(void* arg)
+{
+	double created = *(double*) arg;
+	hist_add(now_ns() - created);
+	free(arg);
+	burn_ns(SPAWN_UNIT_NS);
+	__sync_fetch_and_add(_fair_units, 1);
+}
+
+
+
+void run_spawn()
+{
+	system_init(_fair_kthreads);
+	double start = now_ns();
+	long created = 0;
+	while (now_ns() - start < _fair_window_ns) {
+		// Each burst is drained before the next, so that they do not pile up.
+		for (int i = 0; i < _fair_uthreads; i++) {
+			double* created_ns = malloc(sizeof(double));
+			*created_ns = now_ns();
+			uthread_create_arg(spawned_func, created_ns);
+		}
+		created += _fair_uthreads;
+		while (_fair_units[0] < created) {
+			usleep(100);
+		}
+		usleep(SPAWN_BURST_GAP_US);
+	}
+	uthread_exit();
+	exit(report(_fair_units[0], now_ns() - start, false) ? 0 : 3);
+}
+
+
+
+/* Define the harness driver. ****************************************************/
+
+/**
+ * Runs the given case in a forked child process. Returns whether it passed.
+ */
+bool run_case(const char* filter, const char* mix, void (*func)(), int kthreads,
+              int uthreads, double unit_ns)
+{
+	if (filter != NULL && strcmp(filter, mix) != 0) {
+		return true;
+	}
+
+	// The window is long enough for each `uthread` to do enough units of work
+	// for its share to be judged, within limits.
+	_fair_mix = mix;
+	_fair_kthreads = kthreads;
+	_fair_uthreads = uthreads;
+	_fair_window_ns = 2.0 * MIN_UNITS_FOR_FAIRNESS * unit_ns * uthreads / kthreads;
+	_fair_window_ns = (_fair_window_ns < MIN_WINDOW_NS) ? MIN_WINDOW_NS : _fair_window_ns;
+	_fair_window_ns = (_fair_window_ns > MAX_WINDOW_NS) ? MAX_WINDOW_NS : _fair_window_ns;
+	_fair_window_ns = (_fair_quick && _fair_window_ns > QUICK_MAX_WINDOW_NS) ? QUICK_MAX_WINDOW_NS : _fair_window_ns;
+
+	printf("%s\n", _fair_first_result ? "" : ",");
+	fflush(stdout);
+	_fair_first_result = false;
+
+	pid_t pid = fork();
+	if (pid == 0) {
+		_fair_units = calloc(uthreads, sizeof(long));
+		func();
+		exit(0);
+	}
+
+	int status;
+	waitpid(pid, &status, 0);
+	if (WIFEXITED(status) && WEXITSTATUS(status) == 3) {
+		fprintf(stderr, "fairness_uthread: mix `%s` (%d kthreads, %d uthreads) regressed\n",
+		        mix, kthreads, uthreads);
+		return false;
+	} else if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		fprintf(stderr, "fairness_uthread: mix `%s` (%d kthreads, %d uthreads) failed\n",
+		        mix, kthreads, uthreads);
+		printf("    {\"mix\": \"%s\", \"kthreads\": %d, \"uthreads\": %d, "
+		       "\"passed\": false, \"failures\": \"crashed\"}", mix, kthreads, uthreads);
+		return false;
+	}
+	return true;
+}
+
+
+
+int main(int argc, char* argv[])
+{
+	const char* filter = NULL;
+	int max_uthreads = 100000;
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-q") == 0) {
+			_fair_quick = true;
+		} else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
+			if (!load_baseline(argv[++i])) {
+				fprintf(stderr, "fairness_uthread: cannot read baseline `%s`\n", argv[i]);
+				return 2;
+			}
+		} else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+			max_uthreads = atoi(argv[++i]);
+		} else {
+			filter = argv[i];
+		}
+	}
+	if (_fair_quick && max_uthreads > 1000) {
+		max_uthreads = 1000;
+	}
+
+	int ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	_fair_burn_loops_per_us = calibrate_burn();
+
+	printf("{\n  \"ncpus\": %d,\n  \"quick\": %s,\n  \"results\": [",
+	       ncpus, _fair_quick ? "true" : "false");
+	fflush(stdout);
+
+	// Go from 1 `kthread` up to one per CPU, doubling (but always including
+	// `ncpus` itself), and from 1 `uthread` up to `max_uthreads`, by tens.
+	bool passed = true;
+	for (int kthreads = 1; ; kthreads = (2 * kthreads < ncpus) ? 2 * kthreads : ncpus) {
+		for (int uthreads = 1; uthreads <= max_uthreads; uthreads *= 10) {
+			passed &= run_case(filter, "cpu", run_long_lived, kthreads, uthreads, CPU_UNIT_NS);
+			passed &= run_case(filter, "yield", run_long_lived, kthreads, uthreads, YIELD_UNIT_NS);
+			passed &= run_case(filter, "io", run_long_lived, kthreads, uthreads, IO_UNIT_NS + IO_WAIT_NS);
+			passed &= run_case(filter, "spawn", run_spawn, kthreads, uthreads, SPAWN_UNIT_NS);
+		}
+		if (kthreads == ncpus) {
+			break;
+		}
+	}
+
+	printf("\n  ]\n}\n");
+	return passed ? 0 : 1;
+}
@@ -1,13 +1,36 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fenv.h>
 #include <math.h>
+#include <malloc.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <pthread.h>
+#include <signal.h>
+#include <linux/filter.h>
+#include <linux/seccomp.h>
 
 #include "uthread.h"
 
+/**
+ * Before the demo below, each test case runs in its own forked child process,
+ * because the `uthread` system can only be initialized once per process. A
+ * case fails if it trips an `assert()`, or if it takes longer than
+ * `TEST_TIMEOUT_S` seconds.
+ */
+
+#define TEST_TIMEOUT_S  30
+
 int n_threads=1;
 int myid=0;
 pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
@@ -49,12 +72,1516 @@ void do_something()
     uthread_exit();
 }
 
-int main(int argc, char* argv[])
+
+
+/* Test the scheduler. */
+
+#define NUM_CONTENDERS          4
+#define NUM_CONTENDED_YIELDS    100000
+
+volatile int num_finished = 0;
+
+void yield_alone()
+{
+    // With one `uthread` per `kthread`, each yield just takes and releases the
+    // scheduler's lock.
+    for (int i = 0; i < NUM_CONTENDED_YIELDS; i++) {
+        uthread_yield();
+    }
+    __atomic_fetch_add(&num_finished, 1, __ATOMIC_SEQ_CST);
+    uthread_exit();
+}
+
+void test_lock_contention()
+{
+    // The `kthread`s contend for the scheduler's lock, so each one waiting
+    // for it must be woken when another releases it.
+    system_init(NUM_CONTENDERS);
+    for (int i = 0; i < NUM_CONTENDERS; i++) {
+        uthread_create(yield_alone);
+    }
+    uthread_exit();
+    assert(num_finished == NUM_CONTENDERS);
+}
+
+#define NUM_YIELDERS            8
+#define NUM_YIELDS              20000
+
+volatile long num_yields_done = 0;
+
+void yield_in_turn()
 {
+    // `i` lives on this `uthread`'s stack, so it only counts up correctly if
+    // every switch resumes the context which was saved last.
     int i;
+    for (i = 0; i < NUM_YIELDS; i++) {
+        uthread_yield();
+    }
+    __atomic_fetch_add(&num_yields_done, i, __ATOMIC_SEQ_CST);
+    __atomic_fetch_add(&num_finished, 1, __ATOMIC_SEQ_CST);
+    uthread_exit();
+}
+
+void test_yield_between_kthreads()
+{
+    // With more `uthread`s than `kthread`s, a `uthread` which one `kthread`
+    // yields may be resumed by the other.
+    system_init(2);
+    for (int i = 0; i < NUM_YIELDERS; i++) {
+        uthread_create(yield_in_turn);
+    }
+    uthread_exit();
+    assert(num_finished == NUM_YIELDERS);
+    assert(num_yields_done == (long) NUM_YIELDERS * NUM_YIELDS);
+}
+
+#define NUM_CHURNED             2000
+
+volatile int num_churn_created = 1;
+volatile int num_churn_ran = 0;
+
+void churn()
+{
+    // Each `uthread` creates up to two more and exits, so `uthread`s exit
+    // both while others are waiting and when none are left for the `kthread`.
+    __atomic_fetch_add(&num_churn_ran, 1, __ATOMIC_SEQ_CST);
+    for (int i = 0; i < 2; i++) {
+        if (__atomic_fetch_add(&num_churn_created, 1, __ATOMIC_SEQ_CST) < NUM_CHURNED) {
+            uthread_create(churn);
+        } else {
+            __atomic_fetch_sub(&num_churn_created, 1, __ATOMIC_SEQ_CST);
+        }
+    }
+    uthread_exit();
+}
+
+void test_exit_churn()
+{
+    // Freed memory is scribbled over, so an exiting `uthread` which kept
+    // running on its freed stack would crash.
+    mallopt(M_PERTURB, 0xa5);
+    system_init(2);
+    uthread_create(churn);
+    uthread_exit();
+    assert(num_churn_ran == NUM_CHURNED);
+}
+
+#define NUM_SPIN_STEPS  1000000
+
+volatile long spin_steps[2];
+
+void spin_with_maybe_yield(void* arg)
+{
+    // Neither `uthread` can finish until both have made progress, which on
+    // one `kthread` needs `uthread_maybe_yield()` to switch between them.
+    long me = (long) arg;
+    while (spin_steps[0] < NUM_SPIN_STEPS || spin_steps[1] < NUM_SPIN_STEPS) {
+        spin_steps[me]++;
+        uthread_maybe_yield();
+    }
+}
+
+void test_maybe_yield()
+{
     system_init(1);
-    setbuf(stdout,NULL);
-    int pid = uthread_create(do_something);
-	uthread_exit();
+    uthread_create_arg(spin_with_maybe_yield, (void*) 0L);
+    uthread_create_arg(spin_with_maybe_yield, (void*) 1L);
+    uthread_exit();
+    assert(spin_steps[0] >= NUM_SPIN_STEPS && spin_steps[1] >= NUM_SPIN_STEPS);
+}
+
+
+
+/* Test `uthread`-specific data. */
+
+uthread_key_t key1, key2;
+volatile int num_destructed = 0;
+void* volatile last_destructed = NULL;
+
+void count_destructor(void* value)
+{
+    num_destructed++;
+    last_destructed = value;
+}
+
+void set_key1(void* value)
+{
+    assert(uthread_getspecific(key1) == NULL);
+    uthread_setspecific(key1, value);
+    assert(uthread_getspecific(key1) == value);
+}
+
+void set_key1_then_null(void* value)
+{
+    uthread_setspecific(key1, value);
+    uthread_setspecific(key1, NULL);
+}
+
+void test_key_destructors()
+{
+    system_init(1);
+    assert(uthread_key_create(&key1, count_destructor) == 0);
+    static int value;
+    uthread_create_arg(set_key1, &value);
+    uthread_create_arg(set_key1_then_null, &value);
+    uthread_create_arg(set_key1, NULL);
+    uthread_exit();
+
+    // Only the `uthread` whose value was still non-`NULL` has it destructed.
+    assert(num_destructed == 1);
+    assert(last_destructed == &value);
+}
+
+void reset_key1(void* value)
+{
+    num_destructed++;
+    uthread_setspecific(key1, value);
+}
+
+void set_key2_from_destructor(void* value)
+{
+    uthread_setspecific(key2, value);
+}
+
+void test_key_destructor_loop()
+{
+    system_init(1);
+
+    // A destructor which sets its own key again is not called forever.
+    assert(uthread_key_create(&key1, reset_key1) == 0);
+    static int value;
+    uthread_create_arg(set_key1, &value);
+    uthread_exit();
+    assert(num_destructed >= 2 && num_destructed <= 8);
+}
+
+void test_key_set_by_destructor()
+{
+    system_init(1);
+
+    // A value set by another key's destructor is destructed in a later pass,
+    // even though its key comes later.
+    assert(uthread_key_create(&key1, set_key2_from_destructor) == 0);
+    assert(uthread_key_create(&key2, count_destructor) == 0);
+    static int value;
+    uthread_create_arg(set_key1, &value);
+    uthread_exit();
+    assert(num_destructed == 1);
+    assert(last_destructed == &value);
+}
+
+volatile int key_phase = 0;
+
+void hold_deleted_key(void* value)
+{
+    uthread_setspecific(key1, value);
+    key_phase = 1;
+    while (key_phase != 2) {
+        uthread_yield();
+    }
+
+    // `key2` reuses the index of the deleted `key1`, but not its value.
+    assert(key2 == key1);
+    assert(uthread_getspecific(key2) == NULL);
+}
+
+void delete_key1(void* ignored)
+{
+    while (key_phase != 1) {
+        uthread_yield();
+    }
+    assert(uthread_key_delete(key1) == 0);
+    assert(uthread_key_delete(key1) == -1);
+    assert(uthread_key_create(&key2, count_destructor) == 0);
+    key_phase = 2;
+}
+
+void test_key_delete_reuse()
+{
+    system_init(1);
+    assert(uthread_key_create(&key1, count_destructor) == 0);
+    static int value;
+    uthread_create_arg(hold_deleted_key, &value);
+    uthread_create_arg(delete_key1, NULL);
+    uthread_exit();
+
+    // The value set under the deleted key is never destructed.
+    assert(num_destructed == 0);
+}
+
+
+
+/* Test parallel loops. */
+
+#define PARALLEL_N  10007
+
+const long parallel_grains[] = { 0, 1, 7, 100, PARALLEL_N + 1 };
+volatile int parallel_hits[PARALLEL_N];
+
+void count_hits(long begin, long end, void* ctx)
+{
+    for (long i = begin; i < end; i++) {
+        __atomic_fetch_add(parallel_hits + i, 1, __ATOMIC_RELAXED);
+    }
+}
+
+void parallel_for_each_grain(void* ignored)
+{
+    for (int g = 0; g < sizeof(parallel_grains) / sizeof(long); g++) {
+        for (int i = 0; i < PARALLEL_N; i++) {
+            parallel_hits[i] = 0;
+        }
+        uthread_parallel_for(0, PARALLEL_N, parallel_grains[g], count_hits, NULL);
+        for (int i = 0; i < PARALLEL_N; i++) {
+            assert(parallel_hits[i] == 1);
+        }
+    }
+}
+
+void test_parallel_for()
+{
+    // From a thread which is not a `uthread`, and then from a `uthread` (not
+    // both at once, since they share `parallel_hits`).
+    system_init(4);
+    parallel_for_each_grain(NULL);
+    uthread_create_arg(parallel_for_each_grain, NULL);
+    uthread_exit();
+}
+
+/**
+ * A summary of a range which catches an index that is skipped or counted
+ * twice, however the range is split: its combine is associative, and its
+ * result does not depend on the order of the partials.
+ */
+typedef struct {
+    long count;
+    long sum;
+    unsigned long hash_xor;
+    long min;
+    long max;
+} summary_t;
+
+void summarize_one(summary_t* s, long i)
+{
+    s->count++;
+    s->sum += i * i;
+    s->hash_xor ^= (unsigned long) i * 0x9e3779b97f4a7c15UL;
+    s->min = (i < s->min) ? i : s->min;
+    s->max = (i > s->max) ? i : s->max;
+}
+
+void summarize(long begin, long end, void* partial, void* ctx)
+{
+    for (long i = begin; i < end; i++) {
+        summarize_one(partial, i);
+    }
+}
+
+void combine_summaries(void* result, const void* partial, void* ctx)
+{
+    summary_t* r = result;
+    const summary_t* p = partial;
+    r->count += p->count;
+    r->sum += p->sum;
+    r->hash_xor ^= p->hash_xor;
+    r->min = (p->min < r->min) ? p->min : r->min;
+    r->max = (p->max > r->max) ? p->max : r->max;
+}
+
+void test_parallel_reduce()
+{
+    system_init(4);
+    const summary_t identity = { 0, 0, 0, PARALLEL_N, -1 };
+    summary_t serial = identity;
+    for (long i = 0; i < PARALLEL_N; i++) {
+        summarize_one(&serial, i);
+    }
+
+    for (int g = 0; g < sizeof(parallel_grains) / sizeof(long); g++) {
+        summary_t result = identity;
+        uthread_parallel_reduce(0, PARALLEL_N, parallel_grains[g], &result, sizeof(result),
+                                summarize, combine_summaries, NULL);
+        assert(result.count == serial.count);
+        assert(result.sum == serial.sum);
+        assert(result.hash_xor == serial.hash_xor);
+        assert(result.min == serial.min && result.max == serial.max);
+    }
+    uthread_exit();
+}
+
+
+
+/* Test waiting on addresses. */
+
+volatile int wait_word = 0;
+volatile int num_arrived = 0;
+volatile int num_woken = 0;
+volatile int wake_order[4];
+
+void wait_on_word(void* arg)
+{
+    num_arrived++;
+    assert(uthread_wait(&wait_word, 0, NULL) == UTHREAD_WAIT_WOKEN);
+    wake_order[num_woken++] = (int) (long) arg;
+}
+
+void wake_one_then_all(void* ignored)
+{
+    // With one `kthread`, each waiter has parked once it has arrived.
+    while (num_arrived < 4) {
+        uthread_yield();
+    }
+    // Yielding only switches to a `uthread` which has run for less time, so
+    // keep yielding until the woken waiter has run. The others stay parked.
+    wait_word = 1;
+    assert(uthread_wake(&wait_word, 1) == 1);
+    while (num_woken == 0) {
+        uthread_yield();
+    }
+    for (int i = 0; i < 10; i++) {
+        uthread_yield();
+    }
+    assert(num_woken == 1);
+    assert(wake_order[0] == 0);  // Waiters are woken in the order they waited.
+
+    assert(uthread_wake(&wait_word, 1000) == 3);
+    while (num_woken < 4) {
+        uthread_yield();
+    }
+    assert(uthread_wake(&wait_word, 1000) == 0);
+}
+
+void test_wake_one_vs_all()
+{
+    system_init(1);
+    for (long i = 0; i < 4; i++) {
+        uthread_create_arg(wait_on_word, (void*) i);
+    }
+    uthread_create_arg(wake_one_then_all, NULL);
+    uthread_exit();
+    assert(num_woken == 4);
+}
+
+long elapsed_ns(const struct timespec* start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000000000L + (now.tv_nsec - start->tv_nsec);
+}
+
+void wait_for_deadline(void* ignored)
+{
+    struct timespec start;
+    struct timespec timeout = { .tv_sec = 0, .tv_nsec = 20000000 };
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    assert(uthread_wait(&wait_word, 0, &timeout) == UTHREAD_WAIT_TIMED_OUT);
+    assert(elapsed_ns(&start) >= 20000000);
+    num_woken++;
+}
+
+void test_wait_deadline()
+{
+    // Both while the `kthread` idles, and while another `uthread` keeps it busy.
+    system_init(1);
+    uthread_create_arg(wait_for_deadline, NULL);
+    uthread_create_arg(wait_for_deadline, NULL);
+    uthread_create_arg(wait_for_deadline, NULL);
+    uthread_exit();
+    assert(num_woken == 3);
+    assert(uthread_wake(&wait_word, 1) == 0);
+}
+
+#define RACE_ROUNDS  2000
+
+volatile int race_ready = -1;
+volatile int race_done = -1;
+volatile int race_wake_result;
+int race_outcomes[3];
+
+void race_waiter(void* ignored)
+{
+    for (int round = 0; round < RACE_ROUNDS; round++) {
+        wait_word = 2 * round;
+        race_ready = round;
+        struct timespec timeout = { .tv_sec = 0, .tv_nsec = (round % 50) * 1000 };
+        int result = uthread_wait(&wait_word, 2 * round, &timeout);
+        while (race_done != round) {
+            uthread_yield();
+        }
+
+        // The waker counted this waiter if and only if it saw itself woken.
+        assert(race_wake_result == (result == UTHREAD_WAIT_WOKEN));
+        race_outcomes[result]++;
+    }
+}
+
+void race_waker(void* ignored)
+{
+    for (int round = 0; round < RACE_ROUNDS; round++) {
+        while (race_ready != round) {
+            uthread_yield();
+        }
+        for (volatile int i = 0; i < (round * 7919) % 20000; i++) {
+        }
+        wait_word = 2 * round + 1;
+        race_wake_result = uthread_wake(&wait_word, 1);
+        race_done = round;
+    }
+}
+
+void test_wake_races_deadline()
+{
+    system_init(2);
+    uthread_create_arg(race_waiter, NULL);
+    uthread_create_arg(race_waker, NULL);
+    uthread_exit();
+    assert(race_outcomes[UTHREAD_WAIT_WOKEN] + race_outcomes[UTHREAD_WAIT_CHANGED]
+           + race_outcomes[UTHREAD_WAIT_TIMED_OUT] == RACE_ROUNDS);
+}
+
+#define RING_SIZE    8
+#define RING_PASSES  20000
+
+volatile int ring_turns[RING_SIZE];
+volatile int ring_passes = 0;
+
+/**
+ * Waits for its turn, and then passes it to the next `uthread` in the ring. A
+ * wake which is lost between parking and switching off hangs the ring.
+ */
+void pass_ring(void* arg)
+{
+    int idx = (int) (long) arg;
+    int next = (idx + 1) % RING_SIZE;
+    for (int pass = 0; pass < RING_PASSES / RING_SIZE; pass++) {
+        while (ring_turns[idx] == 0) {
+            uthread_wait(ring_turns + idx, 0, NULL);
+        }
+        ring_turns[idx] = 0;
+        __atomic_fetch_add(&ring_passes, 1, __ATOMIC_RELAXED);
+        __atomic_store_n(ring_turns + next, 1, __ATOMIC_SEQ_CST);
+        uthread_wake(ring_turns + next, 1);
+    }
+}
+
+void test_wait_handoff()
+{
+    system_init(4);
+    ring_turns[0] = 1;
+    for (long i = 0; i < RING_SIZE; i++) {
+        uthread_create_arg(pass_ring, (void*) i);
+    }
+    uthread_exit();
+    assert(ring_passes == RING_PASSES);
+}
+
+
+
+/* Test RCU. */
+
+#define RCU_READ_NS  100000000L
+
+volatile int rcu_readers_in = 0;
+volatile int rcu_readers_out = 0;
+
+/**
+ * Moves to the `kthread` named by `arg`, and then stays in a read-side critical
+ * section for `RCU_READ_NS`.
+ */
+void read_for_a_while(void* arg)
+{
+    uthread_set_affinity(uthread_self(), 1UL << (long) arg);
+    uthread_yield();
+
+    uthread_rcu_read_lock();
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    __atomic_add_fetch(&rcu_readers_in, 1, __ATOMIC_SEQ_CST);
+    while (elapsed_ns(&start) < RCU_READ_NS) {
+    }
+    __atomic_add_fetch(&rcu_readers_out, 1, __ATOMIC_SEQ_CST);
+    uthread_rcu_read_unlock();
+}
+
+void* synchronize_with_readers(void* ignored)
+{
+    while (__atomic_load_n(&rcu_readers_in, __ATOMIC_SEQ_CST) < 2) {
+        usleep(1000);
+    }
+    uthread_synchronize_rcu();
+    assert(__atomic_load_n(&rcu_readers_out, __ATOMIC_SEQ_CST) == 2);
+    return NULL;
+}
+
+void test_rcu_grace_period()
+{
+    system_init(2);
+    uthread_create_arg(read_for_a_while, (void*) 0L);
+    uthread_create_arg(read_for_a_while, (void*) 1L);
+    pthread_t syncer;
+    pthread_create(&syncer, NULL, synchronize_with_readers, NULL);
+    uthread_exit();
+    pthread_join(syncer, NULL);
+}
+
+typedef struct {
+    uthread_rcu_head_t head;
+    int value;
+} rcu_object_t;
+
+rcu_object_t rcu_old = { .value = 1 };
+rcu_object_t rcu_new = { .value = 2 };
+rcu_object_t* volatile rcu_current = &rcu_old;
+volatile int rcu_holding = 0;
+volatile int rcu_updated = 0;
+volatile int rcu_unlocked = 0;
+volatile int rcu_synced = 0;
+volatile int rcu_retired = 0;
+
+void retire_object(uthread_rcu_head_t* head)
+{
+    assert(rcu_unlocked);
+    rcu_object_t* object = (rcu_object_t*) head;
+    object->value = -1;
+    rcu_retired++;
+}
+
+void hold_old_object(void* ignored)
+{
+    uthread_rcu_read_lock();
+    rcu_object_t* object = rcu_current;
+    rcu_holding = 1;
+    while (!rcu_updated) {
+        assert(object->value == 1);
+    }
+
+    // Hold the old object well past the callbacks' batching period.
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (elapsed_ns(&start) < RCU_READ_NS) {
+        assert(object->value == 1);
+        assert(!rcu_synced && !rcu_retired);
+    }
+    rcu_unlocked = 1;
+    uthread_rcu_read_unlock();
+
+    uthread_yield();
+    while (!rcu_synced || !rcu_retired) {
+        uthread_yield();
+    }
+    assert(rcu_current == &rcu_new && object->value == -1);
+}
+
+void* replace_object(void* ignored)
+{
+    while (!rcu_holding) {
+        usleep(1000);
+    }
+    rcu_current = &rcu_new;
+    uthread_call_rcu(&rcu_old.head, retire_object);
+    rcu_updated = 1;
+    uthread_synchronize_rcu();
+    assert(rcu_unlocked);
+    rcu_synced = 1;
+    return NULL;
+}
+
+void test_rcu_reader_holds_old()
+{
+    system_init(1);
+    uthread_create_arg(hold_old_object, NULL);
+    pthread_t updater;
+    pthread_create(&updater, NULL, replace_object, NULL);
+    uthread_exit();
+    pthread_join(updater, NULL);
+}
+
+#define RCU_NUM_DEFERRED  10
+
+uthread_rcu_head_t rcu_deferred[RCU_NUM_DEFERRED];
+volatile int rcu_num_run = 0;
+
+void count_callback(uthread_rcu_head_t* head)
+{
+    rcu_num_run++;
+}
+
+void defer_and_exit(void* ignored)
+{
+    for (int i = 0; i < RCU_NUM_DEFERRED; i++) {
+        uthread_call_rcu(rcu_deferred + i, count_callback);
+    }
+}
+
+void test_rcu_drain_on_shutdown()
+{
+    // The callbacks are still waiting for their batch when the system shuts down.
+    system_init(1);
+    uthread_create_arg(defer_and_exit, NULL);
+    uthread_exit();
+    assert(rcu_num_run == RCU_NUM_DEFERRED);
+}
+
+
+
+/* Test spawning. */
+
+#define SPAWN_SPIN_NS  200000000L
+
+volatile int spawn_child_done = 0;
+volatile long spawn_parent_tid = 0;
+
+long thread_id()
+{
+    return syscall(SYS_gettid);
+}
+
+void spin_for(long ns)
+{
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (elapsed_ns(&start) < ns) {
+    }
+}
+
+void spin_until_parent_moves(void* ignored)
+{
+    // The parent must be resumed elsewhere, since this never yields.
+    long tid = thread_id();
+    while (spawn_parent_tid == 0) {
+    }
+    assert(spawn_parent_tid != tid);
+    spawn_child_done = 1;
+}
+
+void spawn_and_get_stolen(void* ignored)
+{
+    long locals[16];
+    for (int i = 0; i < 16; i++) {
+        locals[i] = i * 7919;
+    }
+    long tid = thread_id();
+    uthread_spawn(spin_until_parent_moves, NULL);
+
+    // Resumed by another `kthread`, with its frame intact, while the child runs.
+    assert(thread_id() != tid);
+    assert(!spawn_child_done);
+    for (int i = 0; i < 16; i++) {
+        assert(locals[i] == i * 7919);
+    }
+    spawn_parent_tid = thread_id();
+}
+
+void test_spawn_stolen()
+{
+    system_init(2);
+    uthread_create_arg(spawn_and_get_stolen, NULL);
+    uthread_exit();
+    assert(spawn_child_done);
+}
+
+#define SPAWN_CHILDREN  64
+
+int spawn_squares[SPAWN_CHILDREN];
+volatile int spawn_num_running = 0;
+
+void store_square(void* arg)
+{
+    long i = (long) arg;
+    spawn_squares[i] = i * i;
+    if (__atomic_sub_fetch(&spawn_num_running, 1, __ATOMIC_RELEASE) == 0) {
+        uthread_wake(&spawn_num_running, 1);
+    }
+}
+
+void spawn_and_join(void* ignored)
+{
+    spawn_num_running = SPAWN_CHILDREN;
+    for (long i = 0; i < SPAWN_CHILDREN; i++) {
+        uthread_spawn(store_square, (void*) i);
+    }
+    int num_running;
+    while ((num_running = __atomic_load_n(&spawn_num_running, __ATOMIC_ACQUIRE)) > 0) {
+        uthread_wait(&spawn_num_running, num_running, NULL);
+    }
+    for (int i = 0; i < SPAWN_CHILDREN; i++) {
+        assert(spawn_squares[i] == i * i);
+    }
+}
+
+void test_spawn_join()
+{
+    system_init(4);
+    uthread_create_arg(spawn_and_join, NULL);
+    uthread_exit();
+}
+
+long cpu_ns(clockid_t clock)
+{
+    struct timespec now;
+    clock_gettime(clock, &now);
+    return now.tv_sec * 1000000000L + now.tv_nsec;
+}
+
+void spin_while_parent_pinned(void* ignored)
+{
+    long process_start = cpu_ns(CLOCK_PROCESS_CPUTIME_ID);
+    long thread_start = cpu_ns(CLOCK_THREAD_CPUTIME_ID);
+    spin_for(SPAWN_SPIN_NS);
+    long thread_ns = cpu_ns(CLOCK_THREAD_CPUTIME_ID) - thread_start;
+    long process_ns = cpu_ns(CLOCK_PROCESS_CPUTIME_ID) - process_start;
+
+    // Only this `kthread` has anything to do: the other must not spin on the
+    // parent, which it may not run. (This does not depend on the number of
+    // CPUs, or on other processes.)
+    assert(process_ns - thread_ns < SPAWN_SPIN_NS / 4);
+    spawn_child_done = 1;
+}
+
+void spawn_pinned(void* ignored)
+{
+    uthread_set_affinity(uthread_self(), 1UL << 0);
+    uthread_yield();
+    spin_for(SPAWN_SPIN_NS / 4);  // Let the other `kthread` go idle.
+    uthread_spawn(spin_while_parent_pinned, NULL);
+    assert(spawn_child_done);
+}
+
+void start_kthread(void* ignored)
+{
+}
+
+void test_spawn_unstealable()
+{
+    system_init(2);
+    uthread_create_arg(spawn_pinned, NULL);
+    uthread_create_arg(start_kthread, NULL);
+    uthread_exit();
+    assert(spawn_child_done);
+}
+
+
+
+/* Test arenas. */
+
+#define ARENA_BIG_SIZE  (4 << 20)
+
+void* arena_first_alloc = NULL;
+size_t arena_mmapped = 0;
+
+void fill_arena(void* ignored)
+{
+    char* small = uthread_arena_alloc(100);
+    assert(small != NULL && ((uintptr_t) small) % 16 == 0);
+    memset(small, 1, 100);
+    arena_first_alloc = small;
+
+    // Too big to be in a chunk from the cache, so it is allocated on its own.
+    char* big = uthread_arena_alloc(ARENA_BIG_SIZE);
+    assert(big != NULL);
+    memset(big, 1, ARENA_BIG_SIZE);
+    arena_mmapped = mallinfo2().hblkhd;
+    assert(arena_mmapped >= ARENA_BIG_SIZE);
+}
+
+void reuse_arena(void* ignored)
+{
+    // The previous `uthread`'s arena was released when it exited: its big
+    // allocation was freed, and its chunk went to this `kthread`'s cache.
+    assert(mallinfo2().hblkhd <= arena_mmapped - ARENA_BIG_SIZE);
+    assert(uthread_arena_alloc(100) == arena_first_alloc);
+}
+
+void test_arena_release()
+{
+    system_init(1);
+    uthread_create_arg(fill_arena, NULL);
+    uthread_create_arg(reuse_arena, NULL);
+    uthread_exit();
+    assert(arena_first_alloc != NULL);
+}
+
+void alloc_too_much(void* ignored)
+{
+    assert(uthread_arena_alloc(SIZE_MAX) == NULL);
+    assert(uthread_arena_alloc(SIZE_MAX - 16) == NULL);
+    assert(uthread_arena_alloc(SIZE_MAX / 2) == NULL);  // Fails in `malloc()`.
+    assert(uthread_arena_alloc(16) != NULL);
+}
+
+void test_arena_too_big()
+{
+    system_init(1);
+    uthread_create_arg(alloc_too_much, NULL);
+    uthread_exit();
+}
+
+
+
+/* Test affinity. */
+
+#define AFFINITY_LOAD    12
+#define AFFINITY_ROUNDS  2000
+
+volatile int affinity_done = 0;
+
+void sleep_briefly(long ns)
+{
+    static const int never_changed = 0;
+    struct timespec timeout = { .tv_sec = 0, .tv_nsec = ns };
+    uthread_wait(&never_changed, 0, &timeout);
+}
+
+/**
+ * Keeps the `kthread`s busy, but unevenly: each `uthread` sometimes sleeps, so
+ * `kthread`s go idle and steal from one another.
+ */
+void load_kthreads(void* arg)
+{
+    long i = (long) arg;
+    while (!affinity_done) {
+        spin_for(1000 * (i % 4 + 1));
+        if (++i % 10 == 0) {
+            sleep_briefly(20000);
+        } else {
+            uthread_yield();
+        }
+    }
+}
+
+void run_pinned(void* ignored)
+{
+    // The mask takes effect once it has been switched from.
+    uthread_set_affinity(uthread_self(), 1UL << 1);
+    uthread_stats_t stats;
+    uthread_get_stats(uthread_self(), &stats);
+    unsigned long num_switches = stats.num_switches;
+    do {
+        uthread_yield();
+        uthread_get_stats(uthread_self(), &stats);
+    } while (stats.num_switches == num_switches);
+
+    long tid = thread_id();
+    for (int round = 0; round < AFFINITY_ROUNDS; round++) {
+        spin_for(1000);
+        if (round % 10 == 0) {
+            sleep_briefly(10000);
+        } else {
+            uthread_yield();
+        }
+        assert(thread_id() == tid);
+    }
+    affinity_done = 1;
+}
+
+void test_affinity_under_stealing()
+{
+    system_init(4);
+    for (long i = 0; i < AFFINITY_LOAD; i++) {
+        uthread_create_arg(load_kthreads, (void*) i);
+    }
+    uthread_create_arg(run_pinned, NULL);
+    uthread_exit();
+    assert(affinity_done);
+}
+
+
+
+/* Test the watchdog. */
+
+#define WATCHDOG_THRESHOLD_NS  50000000L
+#define WATCHDOG_SPIN_NS       400000000L
+
+volatile int app_signals = 0;
+volatile int watchdog_reports = 0;
+volatile long watchdog_running_ns = 0;
+volatile int hog_started = 0;
+
+void count_app_signal(int sig)
+{
+    app_signals++;
+}
+
+void record_report(const uthread_watchdog_report_t* report, void* ctx)
+{
+    if (watchdog_reports++ == 0) {
+        watchdog_running_ns = report->running_ns;
+    }
+}
+
+void hog_kthread(void* ignored)
+{
+    hog_started = 1;
+    spin_for(WATCHDOG_SPIN_NS);
+}
+
+void test_watchdog()
+{
+    // The application's own `SIGURG` handler.
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = count_app_signal;
+    sigemptyset(&(sa.sa_mask));
+    sigaction(SIGURG, &sa, NULL);
+
+    // The `uthread` has been running for a while when the watchdog starts, and
+    // is reported with the time since it was switched to.
+    system_init(1);
+    uthread_create_arg(hog_kthread, NULL);
+    while (!hog_started) {
+        usleep(1000);
+    }
+    usleep(2 * WATCHDOG_THRESHOLD_NS / 1000);
+    assert(uthread_watchdog_start(WATCHDOG_THRESHOLD_NS, record_report, NULL) == 0);
+
+    // The application's handler still gets every `SIGURG` but the watchdog's.
+    raise(SIGURG);
+    assert(app_signals == 1);
+    uthread_exit();
+    assert(watchdog_reports == 1);
+    assert(watchdog_running_ns >= 2 * WATCHDOG_THRESHOLD_NS);
+    assert(app_signals == 1);
+
+    // It gets its handler back when the watchdog stops.
+    struct sigaction cur;
+    sigaction(SIGURG, NULL, &cur);
+    assert(!(cur.sa_flags & SA_SIGINFO) && cur.sa_handler == count_app_signal);
+    raise(SIGURG);
+    assert(app_signals == 2);
+}
+
+
+
+/* Test blocking calls. */
+
+void* fail_with_errno(void* arg)
+{
+    errno = (int) (long) arg;
+    return (void*) -1L;
+}
+
+void block_and_fail(void* ignored)
+{
+    errno = 0;
+    assert(uthread_blocking(fail_with_errno, (void*) (long) ENOSPC) == (void*) -1L);
+    assert(errno == ENOSPC);
+
+    char buf[1];
+    assert(uthread_read(-1, buf, 1) == -1);
+    assert(errno == EBADF);
+    assert(uthread_open("/nonexistent/file", O_RDONLY, 0) == -1);
+    assert(errno == ENOENT);
+    int fd = uthread_open("/dev/null", O_RDONLY, 0);
+    assert(fd >= 0);
+    assert(uthread_read(fd, buf, 1) == 0);
+    assert(uthread_close(fd) == 0);
+}
+
+void test_blocking_errors()
+{
+    // The errors come back the same way to a thread which is not a `uthread`.
+    system_init(2);
+    uthread_create_arg(block_and_fail, NULL);
+    uthread_create_arg(block_and_fail, NULL);
+    block_and_fail(NULL);
+    uthread_exit();
+}
+
+#define NUM_PROGRESS_YIELDS  1000
+
+int pipe_fds[2];
+volatile int reader_started = 0;
+volatile char byte_read = 0;
+volatile int num_progress_yields = 0;
+
+void read_pipe_raw(void* ignored)
+{
+    // A plain `read()`, which does not go through `uthread_blocking()`.
+    reader_started = 1;
+    char c;
+    assert(read(pipe_fds[0], &c, 1) == 1);
+    byte_read = c;
+}
+
+void make_progress(void* ignored)
+{
+    for (int i = 0; i < NUM_PROGRESS_YIELDS; i++) {
+        num_progress_yields++;
+        uthread_yield();
+    }
+}
+
+void test_monitor_replaces_blocked()
+{
+    // The reader blocks the only `kthread`, so the other `uthread` only runs
+    // once the monitor has stood another `kthread` in for it.
+    assert(pipe(pipe_fds) == 0);
+    system_init(1);
+    uthread_create_arg(read_pipe_raw, NULL);
+    while (!reader_started) {
+        usleep(1000);
+    }
+    uthread_create_arg(make_progress, NULL);
+    while (num_progress_yields < NUM_PROGRESS_YIELDS) {
+        usleep(1000);
+    }
+    assert(byte_read == 0);
+
+    // Then the reader finishes too, once there is something to read.
+    assert(write(pipe_fds[1], "x", 1) == 1);
+    uthread_exit();
+    assert(byte_read == 'x');
+}
+
+
+
+/* Test thread-local storage. */
+
+#define NUM_TLS_KTHREADS        4
+#define NUM_TLS_ALLOCATIONS     200000
+
+int* volatile errno_addresses[NUM_TLS_KTHREADS];
+volatile int num_tls_arrived = 0;
+
+void allocate_on_own_kthread(void* arg)
+{
+    // Each `uthread` holds its `kthread` until all of them have arrived, so
+    // each one runs on a different `kthread`.
+    errno_addresses[(long) arg] = &errno;
+    __atomic_fetch_add(&num_tls_arrived, 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&num_tls_arrived, __ATOMIC_SEQ_CST) < NUM_TLS_KTHREADS) {
+    }
+
+    // libc's per-thread malloc cache is not locked.
+    for (int i = 0; i < NUM_TLS_ALLOCATIONS; i++) {
+        size_t size = 16 + (i % 64) * 16;
+        char* block = malloc(size);
+        memset(block, i, size);
+        free(block);
+    }
+}
+
+void test_thread_local_storage()
+{
+    uthread_system_init(NUM_TLS_KTHREADS);
+    for (long i = 0; i < NUM_TLS_KTHREADS; i++) {
+        uthread_create_arg(allocate_on_own_kthread, (void*) i);
+    }
+    uthread_exit();
+
+    // Each `kthread` has an `errno` of its own, as does this thread.
+    for (int i = 0; i < NUM_TLS_KTHREADS; i++) {
+        assert(errno_addresses[i] != &errno);
+        for (int j = 0; j < i; j++) {
+            assert(errno_addresses[i] != errno_addresses[j]);
+        }
+    }
+}
+
+
+
+/* Test running `uthread`s on the main thread. */
+
+#define NUM_MAIN_UTHREADS  64
+
+volatile long main_tid = 0;
+volatile int ran_on_main = 0;
+
+void wait_for_main(void* ignored)
+{
+    // Each `uthread` keeps yielding until one has run on the main thread, so
+    // they cannot all finish on the other `kthread`.
+    while (!ran_on_main) {
+        if (thread_id() == main_tid) {
+            ran_on_main = 1;
+        }
+        uthread_yield();
+    }
+    __atomic_fetch_add(&num_finished, 1, __ATOMIC_SEQ_CST);
+}
+
+void test_run_main()
+{
+    main_tid = thread_id();
+    system_init(1);
+    for (int i = 0; i < NUM_MAIN_UTHREADS; i++) {
+        uthread_create_arg(wait_for_main, NULL);
+    }
+
+    // It returns once all of them have finished.
+    uthread_run_main();
+    assert(ran_on_main);
+    assert(num_finished == NUM_MAIN_UTHREADS);
+}
+
+
+
+/* Test the profiler. */
+
+#define PROFILER_FREQUENCY  1000
+#define PROFILER_SPIN_NS    300000000L
+
+volatile unsigned long profiled_id = 0;
+
+void spin_profiled(void* ignored)
+{
+    uthread_stats_t stats;
+    uthread_get_stats(uthread_self(), &stats);
+    profiled_id = stats.id;
+    spin_for(PROFILER_SPIN_NS);
+}
+
+void test_profiler()
+{
+    system_init(1);
+    assert(uthread_profiler_start(PROFILER_FREQUENCY) == 0);
+    uthread_create_arg(spin_profiled, NULL);
+    uthread_exit();
+
+    char* folded;
+    size_t size;
+    FILE* out = open_memstream(&folded, &size);
+    assert(out != NULL);
+    uthread_profiler_dump(out);
+    fclose(out);
+
+    // Some stack under the spinning `uthread` was sampled.
+    char prefix[64];
+    snprintf(prefix, sizeof(prefix), "uthread-%lu;", profiled_id);
+    long num_samples = 0;
+    char* save;
+    for (char* line = strtok_r(folded, "\n", &save); line != NULL; line = strtok_r(NULL, "\n", &save)) {
+        char* count = strrchr(line, ' ');
+        assert(count != NULL);
+        if (strncmp(line, prefix, strlen(prefix)) == 0) {
+            num_samples += strtol(count + 1, NULL, 10);
+        }
+    }
+    assert(num_samples > 0);
+    free(folded);
+}
+
+
+
+/* Test `uthread` statistics. */
+
+#define NUM_STATS_YIELDS  100
+
+volatile int stats_done = 0;
+uthread_stats_t stats_before;
+uthread_stats_t stats_after;
+
+void yield_until_stats_done(void* ignored)
+{
+    while (!stats_done) {
+        uthread_yield();
+    }
+}
+
+void yield_and_count(void* ignored)
+{
+    // Some of the yields switch to the other `uthread` and back: those made
+    // once this one has used more CPU time than it.
+    uthread_get_stats(uthread_self(), &stats_before);
+    for (int i = 0; i < NUM_STATS_YIELDS; i++) {
+        uthread_yield();
+    }
+    uthread_get_stats(uthread_self(), &stats_after);
+    stats_done = 1;
+}
+
+/**
+ * Makes `perf_event_open()` fail with `ENOSYS` in this process from now on.
+ */
+void forbid_perf_event_open()
+{
+    struct sock_filter filter[] = {
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(struct seccomp_data, nr)),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, SYS_perf_event_open, 0, 1),
+        BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ERRNO | ENOSYS),
+        BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW),
+    };
+    struct sock_fprog prog = { sizeof(filter) / sizeof(filter[0]), filter };
+    assert(prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0) == 0);
+    assert(prctl(PR_SET_SECCOMP, SECCOMP_MODE_FILTER, &prog) == 0);
+}
+
+void test_stats()
+{
+    forbid_perf_event_open();
+    system_init(1);
+    assert(uthread_perf_counters_start() == -1);
+    uthread_create_arg(yield_until_stats_done, NULL);
+    uthread_create_arg(yield_and_count, NULL);
+    uthread_exit();
+
+    assert(stats_after.id == stats_before.id);
+    assert(stats_after.num_switches > stats_before.num_switches);
+
+    // No counter could be opened.
+    assert(stats_after.instructions == -1);
+    assert(stats_after.cycles == -1);
+    assert(stats_after.llc_misses == -1);
+    assert(stats_after.branch_misses == -1);
+}
+
+
+
+/* Test waking parked `kthread`s. */
+
+#define PARK_SETTLE_US  20000
+#define NUM_PARK_ROUNDS 20
+#define NUM_DRAINED     8
+
+volatile int num_drained = 0;
+volatile int woken_ran = 0;
+
+void drain(void* ignored)
+{
+    __atomic_fetch_add(&num_drained, 1, __ATOMIC_SEQ_CST);
+}
+
+void mark_woken(void* ignored)
+{
+    woken_ran = 1;
+}
+
+/**
+ * Runs a batch of `uthread`s to completion, and then gives the `kthread`s time
+ * to stop spinning and park.
+ */
+void drain_and_park()
+{
+    num_drained = 0;
+    for (int i = 0; i < NUM_DRAINED; i++) {
+        uthread_create_arg(drain, NULL);
+    }
+    while (num_drained < NUM_DRAINED) {
+        usleep(1000);
+    }
+    usleep(PARK_SETTLE_US);
+}
+
+void test_wake_after_drain()
+{
+    // Nothing but a parked `kthread` can run the new `uthread`, since this
+    // thread is not one and does not wait for it in `uthread_exit()`.
+    system_init(2);
+    for (int round = 0; round < NUM_PARK_ROUNDS; round++) {
+        drain_and_park();
+        woken_ran = 0;
+        uthread_create_arg(mark_woken, NULL);
+        while (!woken_ran) {
+            usleep(1000);
+        }
+    }
+    uthread_exit();
+}
+
+#define NUM_SUBMITTERS      4
+#define NUM_SUBMITTED_EACH  2000
+
+volatile int times_ran[NUM_SUBMITTERS * NUM_SUBMITTED_EACH];
+pthread_barrier_t submit_barrier;
+
+void count_run(void* arg)
+{
+    __atomic_fetch_add(times_ran + (long) arg, 1, __ATOMIC_SEQ_CST);
+}
+
+void* submit_batch(void* arg)
+{
+    long first = (long) arg * NUM_SUBMITTED_EACH;
+    pthread_barrier_wait(&submit_barrier);
+    for (long i = first; i < first + NUM_SUBMITTED_EACH; i++) {
+        uthread_create_arg(count_run, (void*) i);
+    }
+    return NULL;
+}
+
+void test_concurrent_submitters()
+{
+    // Plain `pthread`s, which are not `kthread`s, all create `uthread`s at
+    // once while the `kthread`s are parked.
+    system_init(2);
+    drain_and_park();
+    pthread_t submitters[NUM_SUBMITTERS];
+    pthread_barrier_init(&submit_barrier, NULL, NUM_SUBMITTERS);
+    for (long i = 0; i < NUM_SUBMITTERS; i++) {
+        assert(pthread_create(submitters + i, NULL, submit_batch, (void*) i) == 0);
+    }
+    for (int i = 0; i < NUM_SUBMITTERS; i++) {
+        pthread_join(submitters[i], NULL);
+    }
+    uthread_exit();
+
+    // Each `uthread` ran exactly once.
+    for (int i = 0; i < NUM_SUBMITTERS * NUM_SUBMITTED_EACH; i++) {
+        assert(times_ran[i] == 1);
+    }
+}
+
+
+
+/* Test lazily started `uthread`s. */
+
+#define NUM_LAZY  100000
+
+volatile int lazy_times_ran[NUM_LAZY];
+volatile int num_lazy_without_arg = 0;
+
+void run_lazy(void* arg)
+{
+    // Each one gets a usable stack of its own when it first runs.
+    char on_stack[1024];
+    memset(on_stack, (int) (long) arg, sizeof(on_stack));
+    assert(on_stack[sizeof(on_stack) - 1] == (char) (long) arg);
+    lazy_times_ran[(long) arg]++;
+}
+
+void run_lazy_without_arg()
+{
+    num_lazy_without_arg++;
+    uthread_exit();
+}
+
+void queue_lazy(void* ignored)
+{
+    // None of them can run until this returns, since there is one `kthread`.
+    for (long i = 0; i < NUM_LAZY; i++) {
+        uthread_create_arg(run_lazy, (void*) i);
+        uthread_create(run_lazy_without_arg);
+    }
+    for (int i = 0; i < NUM_LAZY; i++) {
+        assert(lazy_times_ran[i] == 0);
+    }
+    assert(num_lazy_without_arg == 0);
+}
+
+void test_lazy_queue()
+{
+    system_init(1);
+    uthread_create_arg(queue_lazy, NULL);
+    uthread_exit();
+    for (int i = 0; i < NUM_LAZY; i++) {
+        assert(lazy_times_ran[i] == 1);
+    }
+    assert(num_lazy_without_arg == NUM_LAZY);
+}
+
+
+
+/* Test floating-point state. */
+
+#define NUM_FP_ROUNDS  2000
+
+const int fp_modes[] = { FE_UPWARD, FE_DOWNWARD, FE_TONEAREST };
+volatile double fp_one = 1.0;
+volatile double fp_three = 3.0;
+volatile long last_fp_runner = -1;
+volatile int num_fp_handoffs = 0;
+
+void keep_rounding_mode(void* arg)
+{
+    // The last one never sets its mode, so it must see the default.
+    long me = (long) arg;
+    int mode = fp_modes[me];
+    if (mode != FE_TONEAREST) {
+        assert(fesetround(mode) == 0);
+    }
+    double third = fp_one / fp_three;
+
+    for (int i = 0; i < NUM_FP_ROUNDS; i++) {
+        if (last_fp_runner != me) {
+            last_fp_runner = me;
+            num_fp_handoffs++;
+        }
+        uthread_yield();
+        assert(fegetround() == mode);
+        assert(fp_one / fp_three == third);
+    }
+}
+
+void test_rounding_mode()
+{
+    system_init(1);
+    for (long i = 0; i < 3; i++) {
+        uthread_create_arg(keep_rounding_mode, (void*) i);
+    }
+    uthread_exit();
+    assert(num_fp_handoffs > 3);
+}
+
+
+
+/* Run the test cases and then the demo. */
+
+/**
+ * Runs the given test case in a forked child process, and returns whether it
+ * passed.
+ */
+bool run_test(const char* name, void (*test)())
+{
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        alarm(TEST_TIMEOUT_S);
+        test();
+        exit(0);
+    }
+
+    int status;
+    waitpid(pid, &status, 0);
+    bool passed = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    printf("%s: %s\n", name, passed ? "ok" : "FAILED");
+    return passed;
+}
+
+int main(int argc, char* argv[])
+{
+    int num_failed = 0;
+    setbuf(stdout,NULL);
+    num_failed += !run_test("lock_contention", test_lock_contention);
+    num_failed += !run_test("yield_between_kthreads", test_yield_between_kthreads);
+    num_failed += !run_test("exit_churn", test_exit_churn);
+    num_failed += !run_test("maybe_yield", test_maybe_yield);
+    num_failed += !run_test("key_destructors", test_key_destructors);
+    num_failed += !run_test("key_destructor_loop", test_key_destructor_loop);
+    num_failed += !run_test("key_set_by_destructor", test_key_set_by_destructor);
+    num_failed += !run_test("key_delete_reuse", test_key_delete_reuse);
+    num_failed += !run_test("parallel_for", test_parallel_for);
+    num_failed += !run_test("parallel_reduce", test_parallel_reduce);
+    num_failed += !run_test("wake_one_vs_all", test_wake_one_vs_all);
+    num_failed += !run_test("wait_deadline", test_wait_deadline);
+    num_failed += !run_test("wake_races_deadline", test_wake_races_deadline);
+    num_failed += !run_test("wait_handoff", test_wait_handoff);
+    num_failed += !run_test("rcu_grace_period", test_rcu_grace_period);
+    num_failed += !run_test("rcu_reader_holds_old", test_rcu_reader_holds_old);
+    num_failed += !run_test("rcu_drain_on_shutdown", test_rcu_drain_on_shutdown);
+    num_failed += !run_test("spawn_stolen", test_spawn_stolen);
+    num_failed += !run_test("spawn_join", test_spawn_join);
+    num_failed += !run_test("spawn_unstealable", test_spawn_unstealable);
+    num_failed += !run_test("arena_release", test_arena_release);
+    num_failed += !run_test("arena_too_big", test_arena_too_big);
+    num_failed += !run_test("affinity_under_stealing", test_affinity_under_stealing);
+    num_failed += !run_test("watchdog", test_watchdog);
+    num_failed += !run_test("blocking_errors", test_blocking_errors);
+    num_failed += !run_test("monitor_replaces_blocked", test_monitor_replaces_blocked);
+    num_failed += !run_test("thread_local_storage", test_thread_local_storage);
+    num_failed += !run_test("run_main", test_run_main);
+    num_failed += !run_test("profiler", test_profiler);
+    num_failed += !run_test("stats", test_stats);
+    num_failed += !run_test("wake_after_drain", test_wake_after_drain);
+    num_failed += !run_test("concurrent_submitters", test_concurrent_submitters);
+    num_failed += !run_test("lazy_queue", test_lazy_queue);
+    num_failed += !run_test("rounding_mode", test_rounding_mode);
+
+    system_init(1);
+    int pid = uthread_create(do_something);
+	uthread_exit();
+    if (num_failed > 0) {
+        printf("%d test cases failed.\n", num_failed);
+        return 1;
+    }
 	puts("Ending test program.\n");
 }
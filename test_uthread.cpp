@@ -0,0 +1,183 @@
+#include <array>
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "uthread.hpp"
+
+/**
+ * Tests of the C++ layer in `uthread.hpp`. As in `test_uthread.c`, each test
+ * case runs in its own forked child process, because the `uthread` system can
+ * only be initialized once per process.
+ */
+
+#define TEST_TIMEOUT_S  30
+
+
+
+/* Test spawning and joining. */
+
+#define NUM_CHILDREN  100
+
+int shared_value = 0;
+
+void spawn_children()
+{
+    std::vector<uthread::task<long>> tasks;
+    for (long i = 0; i < NUM_CHILDREN; i++) {
+        tasks.push_back(uthread::spawn([i] { return i * i; }));
+    }
+    long sum = 0;
+    for (auto& task : tasks) {
+        sum += task.join();
+        assert(!task.joinable());
+    }
+    assert(sum == (long) (NUM_CHILDREN - 1) * NUM_CHILDREN * (2 * NUM_CHILDREN - 1) / 6);
+
+    // A closure too big to be stored inline in the stack.
+    std::array<long, 64> big;
+    for (int i = 0; i < 64; i++) {
+        big[i] = i;
+    }
+    auto big_task = uthread::spawn([big] {
+        long total = 0;
+        for (long x : big) {
+            total += x;
+        }
+        return total;
+    });
+    assert(big_task.join() == 63 * 64 / 2);
+
+    // A reference result refers to the very same object.
+    auto ref_task = uthread::spawn([]() -> int& { return shared_value; });
+    int& ref = ref_task.join();
+    assert(&ref == &shared_value);
+
+    // A detached `uthread` still runs.
+    uthread::spawn([] { shared_value = 1; }).detach();
+}
+
+void test_spawn_join()
+{
+    // From a `uthread`, and from a thread which is not one.
+    uthread_system_init(4);
+    uthread::task<void> parent = uthread::spawn(spawn_children);
+    parent.join();
+    spawn_children();
+    uthread_exit();
+    assert(shared_value == 1);
+}
+
+
+
+/* Test exceptions. */
+
+void test_exceptions()
+{
+    uthread_system_init(2);
+    auto thrower = uthread::spawn([]() -> std::string { throw std::runtime_error("thrown"); });
+    auto void_thrower = uthread::spawn([] { throw 42; });
+    auto fine = uthread::spawn([] { return std::string("fine"); });
+
+    bool caught = false;
+    try {
+        thrower.join();
+    } catch (const std::runtime_error& e) {
+        caught = (std::string(e.what()) == "thrown");
+    }
+    assert(caught);
+
+    caught = false;
+    try {
+        void_thrower.join();
+    } catch (int e) {
+        caught = (e == 42);
+    }
+    assert(caught);
+
+    assert(fine.join() == "fine");
+    uthread_exit();
+}
+
+
+
+/* Test `uthread::mutex`. */
+
+#define NUM_LOCKERS      8
+#define NUM_INCREMENTS   20000
+
+uthread::mutex counter_mutex;
+long counter = 0;
+
+void increment_counter()
+{
+    for (int i = 0; i < NUM_INCREMENTS; i++) {
+        uthread::lock_guard guard(counter_mutex);
+        long seen = counter;
+        if (i % 64 == 0 && uthread_self() != nullptr) {
+            uthread::yield();  // Park any others behind the lock.
+        }
+        counter = seen + 1;
+    }
+}
+
+void test_mutex_contention()
+{
+    // The main thread contends too, without being a `uthread`.
+    uthread_system_init(4);
+    std::vector<uthread::task<void>> tasks;
+    for (int i = 0; i < NUM_LOCKERS; i++) {
+        tasks.push_back(uthread::spawn(increment_counter));
+    }
+    increment_counter();
+    for (auto& task : tasks) {
+        task.join();
+    }
+    assert(counter == (long) (NUM_LOCKERS + 1) * NUM_INCREMENTS);
+    uthread_exit();
+}
+
+
+
+/* Run the test cases. */
+
+/**
+ * Runs the given test case in a forked child process, and returns whether it
+ * passed.
+ */
+bool run_test(const char* name, void (*test)())
+{
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        alarm(TEST_TIMEOUT_S);
+        test();
+        exit(0);
+    }
+
+    int status;
+    waitpid(pid, &status, 0);
+    bool passed = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    printf("%s: %s\n", name, passed ? "ok" : "FAILED");
+    return passed;
+}
+
+int main(int argc, char* argv[])
+{
+    int num_failed = 0;
+    setbuf(stdout, NULL);
+    num_failed += !run_test("spawn_join", test_spawn_join);
+    num_failed += !run_test("exceptions", test_exceptions);
+    num_failed += !run_test("mutex_contention", test_mutex_contention);
+    if (num_failed > 0) {
+        printf("%d test cases failed.\n", num_failed);
+        return 1;
+    }
+    puts("All test cases passed.");
+}
@@ -1,6 +1,8 @@
 #define _GNU_SOURCE
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <limits.h>
 #include <ucontext.h>
 #include <assert.h>
 #include <sys/time.h>
@@ -9,6 +11,21 @@
 #include <sched.h>
 #include <unistd.h>
 #include <sys/syscall.h>
+#include <time.h>
+#include <linux/futex.h>
+#include <signal.h>
+#include <string.h>
+#include <stdio.h>
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <linux/perf_event.h>
+#if defined(__x86_64__)
+#include <x86intrin.h>
+#else
+#include <fenv.h>
+#endif
 
 #include "lib/heap.h"
 
@@ -17,11 +34,62 @@
 
 /* Define private directives. ****************************************************/
 
-#define UCONTEXT_STACK_SIZE     16384
-#define CLONE_STACK_SIZE        16384
+#define UCONTEXT_STACK_SIZE     16384   // Must be a power of two.
+#define STACK_HEADER_SIZE       256
+#define UTHREAD_KEYS_INLINE     8
+#define UTHREAD_DESTRUCTOR_ITERATIONS  4
+#define CACHE_LINE_SIZE         64
+#define PARALLEL_CHUNKS_PER_WORKER  8   // Used to pick a default grain.
+#define WAIT_TABLE_SIZE         256     // Must be a power of two.
+#define BLOCKING_POOL_SIZE      4       // Threads which run `uthread_blocking()` calls.
+#define MONITOR_PERIOD_NS       10000000L  // How often to look for blocked `kthread`s.
+#define DEFAULT_MIGRATION_MARGIN  2     // See `uthread_set_migration_margin()`.
+#define DEFAULT_IDLE_SPIN_MIN_NS  1000L  // See `uthread_set_idle_spin()`.
+#define DEFAULT_IDLE_SPIN_MAX_NS  50000L
+#define DEFAULT_SLICE_NS        1000000L  // See `uthread_set_default_slice()`.
+#define CYCLE_CALIBRATION_NS    1000000L
+#define NUM_PERF_COUNTERS       4       // See `_perf_configs`.
+#define UTHREAD_SLAB_SIZE       64      // Control blocks allocated at once.
+#define STACK_CACHE_MAX         64      // Stacks cached by each `kthread`.
+#define ARENA_CHUNK_SIZE        16384   // See `uthread_arena_alloc()`.
+#define ARENA_ALIGN             16
+#define ARENA_CACHE_MAX         64      // Chunks cached by each `kthread`.
+#define RCU_BATCH_SIZE          128     // Callbacks which start a grace period at once.
+#define RCU_BATCH_PERIOD_NS     10000000L  // How long callbacks wait for a full batch.
+#define RCU_POLL_MIN_NS         10000L  // How often a grace period is checked, at first.
+#define RCU_POLL_MAX_NS         1000000L
+#define RCU_OFFLINE             ULONG_MAX  // The `rcu_gp` of a `kthread` which is not running `uthread`s.
 #define MAX_NUM_UTHREADS        1000
 #define gettid()                (syscall(SYS_gettid))
-#define tgkill(tgid, tid, sig)  (syscall(SYS_tgkill, tgid, tid, sig))
+#define futex(uaddr, op, val)   (syscall(SYS_futex, uaddr, op, val, NULL, NULL, 0))
+#define futex_timed(uaddr, op, val, timeout) \
+                                (syscall(SYS_futex, uaddr, op, val, timeout, NULL, 0))
+#define PROFILER_MAX_SAMPLES    8192
+#define PROFILER_MAX_DEPTH      32
+#define PROFILER_SIGNAL         SIGPROF
+#define WATCHDOG_SIGNAL         SIGURG  // Ignored by default, so a stray one is harmless.
+#define WATCHDOG_MIN_PERIOD_NS  1000000L
+#define WATCHDOG_STACK_TIMEOUT_NS  10000000L  // How long to wait for a stack trace.
+#define DEFAULT_MXCSR           0x1f80  // The SSE control/status word, sans flags.
+#define MXCSR_FLAGS             0x3f
+#define DEFAULT_FPU_CW          0x037f  // The x87 control word.
+#define uthread_header(ut)      ((stack_header_t*) (ut)->stack)
+#if defined(__x86_64__)
+#define cycle_count()           (__rdtsc())
+#else
+#define cycle_count()           (monotonic_ns())
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax()             __builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define cpu_relax()             __asm__ volatile ("yield" ::: "memory")
+#else
+#define cpu_relax()             __asm__ volatile ("" ::: "memory")  // Just a compiler barrier.
+#endif
+
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id  _sigev_un._tid
+#endif
 
 /* Define custom data structures. ************************************************/
 
@@ -30,52 +98,429 @@ typedef struct {
 	void* snd;
 } ptrpair_t;
 
+/**
+ * A `uthread`'s control block. It only holds what the scheduler touches when
+ * comparing, queueing, and switching `uthread`s, all in one cache line, so that
+ * the waiting heap stays cache-resident even with many `uthread`s waiting. The
+ * rest lives in the `uthread`'s `stack_header_t`, and its registers are saved
+ * on its stack.
+ *
+ * A new `uthread` is lazy: until it first runs, it has no stack, and the
+ * control block holds what it will run instead (see `uthread_materialize()`),
+ * so that a backlog of `uthread`s which have yet to run costs little memory.
+ */
+typedef struct uthread_control_block {
+	struct timeval running_time;  // The priority key (see `uthread_priority()`).
+	union {
+		void* sp;  // The saved stack pointer, while not running.
+		void (*lazy_func)();  // What it will run, while lazy.
+	};
+	union {
+		void* stack;  // The base of the stack, where the `stack_header_t` is.
+		void* lazy_arg;  // The argument of `lazy_func`, while lazy.
+	};
+	unsigned long id;
+	unsigned long affinity;  // A mask of `kthread` slots; zero means any.
+	struct uthread_control_block* next;  // The next in a `kthread`'s inbox.
+	int home;  // The `kthread` slot which last ran it, or -1.
+	unsigned char state;
+	bool has_fp_env;  // Whether its FP control words are not the defaults.
+	bool is_lazy;  // Whether it has yet to be given a stack.
+	bool lazy_has_arg;  // Whether `lazy_func` takes `lazy_arg`.
+} __attribute__((aligned(CACHE_LINE_SIZE))) uthread_t;
+
+_Static_assert(sizeof(uthread_t) == CACHE_LINE_SIZE, "uthread_t must fit in a cache line");
+
+enum { UTHREAD_CREATED, UTHREAD_READY, UTHREAD_RUNNING, UTHREAD_PARKED };
+
+/**
+ * A chunk of memory which `uthread_arena_alloc()` carves allocations out of,
+ * just after this header. Chunks of `ARENA_CHUNK_SIZE` bytes are recycled
+ * through the `kthread`s' caches, while bigger ones (each holding one big
+ * allocation) are freed.
+ */
+typedef struct arena_chunk {
+	struct arena_chunk* next;
+	size_t size;  // Including this header.
+} __attribute__((aligned(ARENA_ALIGN))) arena_chunk_t;
+
+/**
+ * A `uthread`'s value for a key, and the `_key_seqs` entry of the key when it
+ * was set. The value only counts while the key still has that sequence number,
+ * so that a deleted key's values are not seen through a key which reuses it.
+ */
 typedef struct {
-	ucontext_t ucontext;
-	struct timeval running_time;
-} uthread_t;
+	void* value;
+	unsigned int seq;
+} key_slot_t;
 
+/**
+ * Every `uthread` stack is `UCONTEXT_STACK_SIZE`-aligned and starts with one of
+ * these (below the part which is used as the stack), so that the running
+ * `uthread` can be found from the stack pointer alone. It also holds the
+ * `uthread`'s colder state.
+ */
 typedef struct {
-	int tid;
-	struct timeval utime_timestamp;
-	struct timeval stime_timestamp;
-	void* stack;
+	uthread_t* uthread;
+	unsigned long slice_start;  // The `cycle_count()` when its time slice started.
+	unsigned long slice_cycles;  // Its own time slice, or zero for `_slice_cycles`.
+	void (*run_func)();
+	void (*run_arg_func)(void*);  // Used instead of `run_func` if not `NULL`.
+	void* arg;
+	key_slot_t* specific_overflow;  // Values of the other keys, allocated lazily.
+	key_slot_t specific[UTHREAD_KEYS_INLINE];  // Values of the first keys.
+#if defined(__x86_64__)
+	unsigned int mxcsr;  // Only saved if `has_fp_env`.
+	unsigned short fpu_cw;  // Only saved if `has_fp_env`.
+#else
+	int fp_rounding;  // Only saved if `has_fp_env`.
+#endif
+	unsigned short rcu_nesting;  // Its depth of `uthread_rcu_read_lock()`s.
+	unsigned long num_switches;  // Times it has been switched to.
+	unsigned long long perf_counts[NUM_PERF_COUNTERS];  // Totals while it ran.
+	arena_chunk_t* arena;  // The chunks of its arena, which it owns.
+	char* arena_next;  // The free part of the chunk being bump-allocated from.
+	char* arena_end;
+} stack_header_t;
+
+_Static_assert(sizeof(stack_header_t) <= STACK_HEADER_SIZE, "stack header too big");
+
+typedef struct {
+	unsigned long uthread_id;  // Zero if no `uthread` was running.
+	int depth;
+	void* pcs[PROFILER_MAX_DEPTH];  // The innermost frame is first.
+} profiler_sample_t;
+
+typedef struct {
+	profiler_sample_t* samples;
+	volatile int num_samples;
+	volatile long num_dropped_samples;
+} profiler_buffer_t;
+
+typedef struct {
+	char* line;
+	int count;
+} folded_stack_t;
+
+/**
+ * The stack trace which the watchdog asked the `kthread` with id `tid` to take
+ * of itself (see `watchdog_take_stack()`).
+ */
+typedef struct {
+	volatile int tid;
+	volatile int done;
+	unsigned long uthread_id;
+	int depth;
+	void* pcs[PROFILER_MAX_DEPTH];
+} watchdog_stack_t;
+
+typedef struct kthread {
+	uthread_t* inbox __attribute__((aligned(CACHE_LINE_SIZE)));  // See `kthread_push_inbox()`.
+	volatile int tid __attribute__((aligned(CACHE_LINE_SIZE)));
+	struct timeval cpu_timestamp;  // The thread's CPU time, at the last `kthread_update_timestamps()`.
+	void* stack_lo;  // The bounds of its thread's own stack (not a `uthread`'s), for
+	void* stack_hi;  // `walk_stack()`, or `NULL` while no thread is running on the slot.
+	void* sp;  // The saved stack pointer of `kthread_runner()`, while it is not running.
+	Heap waiting;  // The ready `uthread`s which prefer this `kthread`.
+	uthread_t* continuations;  // Parents suspended by `uthread_spawn()`, newest first.
+	bool is_active;  // Whether a kernel thread is running on this slot.
+	bool is_idle;  // Whether it is parked in `kthread_idle()`.
+	volatile int park_futex;  // Set (and woken) to unpark it.
+	struct kthread* next_idle;  // The next in `_idle_kthreads`.
+	long spin_ns;  // How long it currently polls for work before parking.
 	uthread_t* running;
+	uthread_t* zombie;
+	volatile int* switch_lock;  // A spin lock to release once switched off of `running`.
+	unsigned long num_schedules;  // Times it has entered the scheduler (so far).
+	unsigned long run_start;  // The `cycle_count()` when it last did (see `kthread_switch()`).
+	unsigned long rcu_gp;  // `_rcu_gp` at its last quiescent state, or `RCU_OFFLINE`. Atomic.
+	unsigned long monitor_num_schedules;  // `num_schedules` at the last monitor check.
+	bool is_blocked;  // Whether the monitor has replaced this `kthread`.
+	bool has_profiler_timer;
+	timer_t profiler_timer;
+	int perf_fd;  // The group leader of its hardware counters, or -1.
+	int perf_num_counters;  // The number in the group.
+	int perf_counters[NUM_PERF_COUNTERS];  // Which counter each group member is.
+	unsigned long long perf_last[NUM_PERF_COUNTERS];  // The group's values at the last switch.
+	void* stack_cache;  // Recycled `uthread` stacks, linked through their first word. Guarded by `_mutex`.
+	int stack_cache_len;
+	arena_chunk_t* arena_cache;  // Recycled arena chunks. Only touched by this `kthread`.
+	int arena_cache_len;
+	unsigned long watchdog_num_schedules;  // `num_schedules` when the watchdog last saw it change.
+	bool watchdog_reported;  // Whether the watchdog reported the current stretch.
 } kthread_t;
 
 
 
+/**
+ * One participant in a `uthread_parallel_for()` or `uthread_parallel_reduce()`.
+ * Each worker owns the range `[lo, hi)` of iterations which it has yet to
+ * claim. The owner claims chunks from the bottom, while thieves steal halves
+ * from the top. Either must hold `lock`.
+ */
+typedef struct {
+	volatile int lock;
+	long lo;
+	long hi;
+	void* partial;  // This worker's partial result (for a reduce).
+	struct parallel_job* job;
+} __attribute__((aligned(CACHE_LINE_SIZE))) parallel_worker_t;
+
+typedef struct parallel_job {
+	long grain;
+	void (*for_body)(long begin, long end, void* ctx);
+	void (*reduce_body)(long begin, long end, void* partial, void* ctx);
+	void* ctx;
+	char* partials;  // One result per worker (for a reduce), `partial_stride` apart.
+	size_t partial_stride;  // A whole number of cache lines, so workers do not share them.
+	int num_workers;
+	parallel_worker_t* workers;
+	volatile int num_running_helpers;
+} parallel_job_t;
+
+
+
+/**
+ * A `uthread` parked in `uthread_wait()`. It lives on the parked `uthread`'s
+ * stack, and is linked into the wait queue of its address' bucket, and (if it
+ * has a deadline) into `_timed_waiters`.
+ *
+ * Whoever moves `state` away from `WAITER_PARKED` (a waker, or the expiry of
+ * the deadline) owns making the `uthread` ready again.
+ */
+typedef struct waiter {
+	struct waiter* next;
+	struct waiter* prev;
+	struct waiter* timed_next;
+	struct waiter* timed_prev;
+	const volatile int* addr;
+	uthread_t* uthread;
+	volatile int state;
+	bool has_deadline;
+	struct timespec deadline;  // On `CLOCK_MONOTONIC`.
+} waiter_t;
+
+enum { WAITER_PARKED, WAITER_WOKEN, WAITER_TIMED_OUT };
+
+/**
+ * One shard of the table of wait queues, which is indexed by a hash of the
+ * address waited on. Waiters on different addresses may share a bucket.
+ */
+typedef struct {
+	volatile int lock;
+	volatile int num_thread_waiters;  // Threads which are not `uthread`s.
+	waiter_t* head;
+	waiter_t* tail;
+} __attribute__((aligned(CACHE_LINE_SIZE))) wait_bucket_t;
+
+
+
+/**
+ * A call shipped to the blocking-call pool by `uthread_blocking()`. It lives on
+ * the calling `uthread`'s stack, which is parked until `done` is set.
+ */
+typedef struct blocking_call {
+	struct blocking_call* next;
+	void* (*func)(void*);
+	void* arg;
+	void* result;
+	int error;  // `errno` after `func` returned.
+	volatile int done;
+} blocking_call_t;
+
+/**
+ * The arguments of a system call shipped to the blocking-call pool.
+ */
+typedef struct {
+	long number;
+	long args[4];
+} blocking_syscall_t;
+
+/**
+ * The arguments of a `getaddrinfo()` shipped to the blocking-call pool.
+ */
+typedef struct {
+	const char* node;
+	const char* service;
+	const struct addrinfo* hints;
+	struct addrinfo** res;
+} blocking_getaddrinfo_t;
+
+
+
 /* Declare private helper functions. *********************************************/
 
 int uthread_priority(const void* key1, const void* key2);
+uthread_t* uthread_alloc();
+void uthread_free(uthread_t* ut);
 void uthread_init(uthread_t* ut, void (*run_func)());
-void uthread_destroy(uthread_t* ut);
-int kthread_runner(void* ptr);
+void uthread_init_lazy(uthread_t* ut, void (*run_func)(), void* arg, bool has_arg);
+void uthread_materialize(uthread_t* ut, void* stack);
+void uthread_init_frame(uthread_t* ut, void** top);
+stack_header_t* uthread_current_header();
+void uthread_destroy(uthread_t* ut, kthread_t* kt);
+void uthread_start();
+int uthread_schedule_new(uthread_t* ut);
+uthread_t* uthread_current();
+void uthread_run_destructors(uthread_t* ut);
+void* kthread_runner(void* ptr);
+void kthread_run(kthread_t* kt);
+void kthread_enter(kthread_t* kt, void* stack_lo, void* stack_hi);
+void kthread_leave(kthread_t* kt);
+bool kthread_should_stop(const kthread_t* kt);
 void kthread_init(kthread_t* kt);
 void kthread_destroy(kthread_t* kt);
+void kthread_join(kthread_t* kt);
+void kthread_finish_switch(kthread_t* kt);
+void kthread_clean_up_switch(kthread_t* kt);
+void uthread_make_ready(uthread_t* ut);
+void uthread_submit(uthread_t* ut);
+kthread_t* find_inbox_for(const uthread_t* ut);
+void kthread_push_inbox(kthread_t* kt, uthread_t* ut);
+void kthread_drain_inbox(kthread_t* kt);
+void kthread_drain_inboxes(kthread_t* kt);
+void kthread_idle(kthread_t* kt);
+bool kthread_spin(kthread_t* kt);
+void kthread_unpark(kthread_t* kt);
+void expire_timed_waiters();
+void timed_waiters_remove(waiter_t* w);
+wait_bucket_t* wait_bucket(const volatile int* addr);
+void wait_bucket_remove(wait_bucket_t* bucket, waiter_t* w);
+int thread_wait(const volatile int* addr, int expected, const struct timespec* timeout);
+void* blocking_pool_runner(void* ignored);
+long blocking_syscall(long number, long arg0, long arg1, long arg2, long arg3);
+void* blocking_syscall_run(void* call);
+void* blocking_getaddrinfo_run(void* call);
+void* monitor_runner(void* ignored);
+bool thread_is_blocked(int tid);
+ssize_t read_file(const char* path, char* buf, size_t size);
+void kthread_replace_blocked();
 void transfer_elapsed_time(kthread_t* kt, uthread_t* ut);
 void kthread_update_timestamps(kthread_t* kt);
-void get_thread_rusage(struct rusage* ru);
-int kthread_create(kthread_t* kt, uthread_t* ut);
-void kthread_handoff(uthread_t* load_from, uthread_t* save_to);
+void kthread_rcu_quiescent(kthread_t* kt);
+void kthread_rcu_offline(kthread_t* kt);
+void rcu_wait_for_readers();
+void* rcu_runner(void* ignored);
+void* arena_alloc_slow(stack_header_t* header, size_t size);
+void arena_recycle(kthread_t* kt, stack_header_t* header);
+void* kthread_take_stack(kthread_t* kt);
+void kthread_release_stack(kthread_t* kt, void* stack);
+void kthread_create(kthread_t* kt, uthread_t* ut);
+void kthread_switch(kthread_t* kt, uthread_t* from, uthread_t* to);
+void uthread_context_switch(void** save_sp, void* load_sp);
+bool uthread_save_fp_env(uthread_t* ut);
+void uthread_load_fp_env(const stack_header_t* header);
 kthread_t* kthread_self();
 kthread_t* find_inactive_kthread();
-bool waiting_uthread_has_priority_over(uthread_t* ut);
+Heap kthread_next_heap(kthread_t* kt);
+uthread_t* kthread_next_uthread(kthread_t* kt);
+uthread_t* kthread_steal_continuation(kthread_t* kt);
+uthread_t** kthread_find_continuation(kthread_t* kt);
+void uthread_enqueue(uthread_t* ut);
+bool uthread_may_run_on(const uthread_t* ut, const kthread_t* kt);
+kthread_t* find_inactive_kthread_for(const uthread_t* ut);
 void uthread_print(const void* key);
 void uthread_system_shutdown();
+void thread_stack_bounds(void** lo, void** hi);
+unsigned long monotonic_ns();
+double calibrate_cycles_per_ns();
+void spin_lock(volatile int* lock);
+void spin_unlock(volatile int* lock);
+void parallel_run(parallel_job_t* job, long begin, long end);
+void parallel_helper(void* worker);
+void parallel_work(parallel_worker_t* self);
+bool parallel_steal(parallel_worker_t* self);
+void kthread_start_profiler_timer(kthread_t* kt);
+void kthread_stop_profiler_timer(kthread_t* kt);
+void profiler_signal_handler(int sig, siginfo_t* info, void* ucontext);
+int walk_stack(const kthread_t* kt, const uthread_t* running, const void* ucontext,
+               void** pcs, int max_depth);
+int profiler_sample_cmp(const void* sample1, const void* sample2);
+void profiler_print_frame(FILE* out, void* pc);
+int folded_stack_cmp(const void* stack1, const void* stack2);
+void* watchdog_runner(void* ignored);
+void watchdog_take_stack(int tid, watchdog_stack_t* stack);
+void watchdog_signal_handler(int sig, siginfo_t* info, void* ucontext);
+void watchdog_print(const uthread_watchdog_report_t* report, void* ignored);
+void watchdog_stop();
+void kthread_open_perf_counters(kthread_t* kt);
+void kthread_close_perf_counters(kthread_t* kt);
+bool kthread_read_perf_counters(kthread_t* kt, unsigned long long* values);
+void kthread_charge_perf_counters(kthread_t* kt, uthread_t* ut);
+int perf_event_open(struct perf_event_attr* attr, pid_t pid, int cpu, int group_fd);
 
 
 
 /* Define file-global variables. *************************************************/
 
 bool _shutdown = false;
-Heap _waiting_uthreads = NULL;
+int _num_waiting_uthreads = 0;  // In all of the `kthread`s' heaps.
+int _num_inbox_uthreads = 0;  // In all of the `kthread`s' inboxes. Atomic.
+int _num_continuations = 0;  // In all of the `kthread`s' continuation stacks. Atomic.
+unsigned int _next_inbox = 0;  // Spreads new `uthread`s over the inboxes. Atomic.
+int _migration_margin = DEFAULT_MIGRATION_MARGIN;
 int _num_kthreads;
+int _num_idle_kthreads = 0;  // Parked ones.
+kthread_t* _idle_kthreads = NULL;  // A stack of the parked `kthread`s.
+int _num_spinning_kthreads = 0;
+long _idle_spin_min_ns = DEFAULT_IDLE_SPIN_MIN_NS;
+long _idle_spin_max_ns = DEFAULT_IDLE_SPIN_MAX_NS;
+double _cycles_per_ns = 1.0;  // Of `cycle_count()`.
+long _slice_ns = DEFAULT_SLICE_NS;  // The default time slice.
+unsigned long _slice_cycles;  // The same, in cycles.
+int _num_uthreads = 0;  // Including parked `uthread`s. Atomic.
 int _max_num_kthreads;
+int _num_blocked_kthreads = 0;  // Running `kthread`s which the monitor has replaced.
+int _num_kthread_slots;  // Twice the maximum, leaving room for replacements.
 kthread_t* _kthreads;
+volatile int _uthread_pool_lock = 0;
+uthread_t* _uthread_pool = NULL;  // Free control blocks, linked by `next`. Guarded by `_uthread_pool_lock`.
+uthread_t* _uthread_slabs = NULL;  // Each slab's first block links to the next slab. Likewise guarded.
+kthread_t* _main_kthread = NULL;  // The slot of the thread in `uthread_run_main()`.
 pthread_mutex_t _mutex = PTHREAD_MUTEX_INITIALIZER;
 pthread_mutex_t _shutdown_mutex = PTHREAD_MUTEX_INITIALIZER;
-ucontext_t _system_initializer_context;
+unsigned long _next_uthread_id = 1;  // Atomic.
+volatile unsigned int _num_keys = 0;  // One more than the highest key ever made.
+unsigned int _key_seqs[UTHREAD_KEYS_MAX];  // Odd while a key exists. Atomic.
+void (*_key_destructors[UTHREAD_KEYS_MAX])(void*);
+long _profiler_period_ns = 0;  // Zero when the profiler is not running.
+profiler_buffer_t* _profiler_buffers = NULL;  // One per `kthread` slot.
+wait_bucket_t _wait_table[WAIT_TABLE_SIZE];
+waiter_t* _timed_waiters = NULL;  // Guarded by `_mutex`.
+pthread_t _blocking_pool[BLOCKING_POOL_SIZE];
+volatile int _blocking_lock = 0;  // Guards the queue of blocking calls.
+blocking_call_t* _blocking_head = NULL;
+blocking_call_t* _blocking_tail = NULL;
+int _num_idle_blocking_threads = 0;
+volatile int _blocking_futex = 0;  // Bumped (and woken) when a call is queued.
+pthread_t _monitor;
+volatile int _monitor_futex = 0;  // Set (and woken) to stop the monitor.
+pthread_t _watchdog;
+bool _watchdog_running = false;  // Guarded by `_watchdog_mutex`.
+pthread_mutex_t _watchdog_mutex = PTHREAD_MUTEX_INITIALIZER;
+volatile int _watchdog_futex = 0;  // Set (and woken) to stop the watchdog.
+long _watchdog_threshold_ns;
+void (*_watchdog_callback)(const uthread_watchdog_report_t* report, void* ctx);
+void* _watchdog_ctx;
+watchdog_stack_t _watchdog_stack;  // Only used by the watchdog thread.
+struct sigaction _watchdog_old_action;  // The application's, chained to for other signals.
+pthread_t _rcu_thread;
+unsigned long _rcu_gp = 1;  // The latest grace period to have started. Atomic.
+uthread_rcu_head_t* _rcu_pending = NULL;  // A stack of callbacks awaiting a batch. Atomic.
+int _rcu_num_pending = 0;  // Atomic.
+volatile int _rcu_futex = 0;  // Bumped (and woken) when a batch starts or fills, or to stop.
+bool _rcu_stopping = false;  // Atomic.
+bool _perf_enabled = false;  // Whether every `kthread` should count events.
+int _perf_available = 0;  // A mask of the counters which could be opened.
+
+// The hardware counters which are attributed to `uthread`s, in the order of
+// the fields of `uthread_stats_t`.
+const unsigned long _perf_configs[NUM_PERF_COUNTERS] = {
+	PERF_COUNT_HW_INSTRUCTIONS,
+	PERF_COUNT_HW_CPU_CYCLES,
+	PERF_COUNT_HW_CACHE_MISSES,  // Usually last-level cache misses.
+	PERF_COUNT_HW_BRANCH_MISSES,
+};
 
 
 
@@ -97,27 +542,35 @@ void uthread_system_init(int max_num_kthreads)
 {
 	assert(_shutdown == false);
 	assert(1 <= max_num_kthreads && max_num_kthreads <= MAX_NUM_UTHREADS);
-	assert(_waiting_uthreads == NULL);  // Function must only be called once.
+	assert(_kthreads == NULL);  // Function must only be called once.
+
+	// Time slices are measured with the cycle counter, which is read far more
+	// cheaply than a clock.
+	_cycles_per_ns = calibrate_cycles_per_ns();
+	_slice_cycles = _slice_ns * _cycles_per_ns;
 
 	// Initialize some globals.
 	_num_kthreads = 0;
 	_max_num_kthreads = max_num_kthreads;
-	getcontext(&_system_initializer_context);
-
-	// The highest priority uthread record (i.e. the on with the lowest running
-	// time) will be at top of the `heap`. Thus, the heap is bottom-heavy w.r.t.
-	// running time.
-	_waiting_uthreads = HEAPinit(uthread_priority, NULL);
+	_num_kthread_slots = 2 * max_num_kthreads;
 
 	// Allocate memory for each `kthread_t` and mark each as inactive (i.e. not
-	// running).
-	_kthreads = malloc(max_num_kthreads * sizeof(kthread_t));
+	// running). Each has its own heap of waiting `uthread`s.
+	_kthreads = aligned_alloc(CACHE_LINE_SIZE, _num_kthread_slots * sizeof(kthread_t));
 	assert(_kthreads != NULL);
 
-	for (kthread_t* kt = _kthreads; kt < _kthreads + _max_num_kthreads; kt++) {
+	for (kthread_t* kt = _kthreads; kt < _kthreads + _num_kthread_slots; kt++) {
 		kthread_init(kt);
 	}
 
+	// Start the threads which run blocking calls for `uthread`s, and the
+	// monitor which replaces `kthread`s that block anyway. These are `pthread`s,
+	// since they never run `uthread`s.
+	for (int idx = 0; idx < BLOCKING_POOL_SIZE; idx++) {
+		pthread_create(_blocking_pool + idx, NULL, blocking_pool_runner, NULL);
+	}
+	pthread_create(&_monitor, NULL, monitor_runner, NULL);
+	pthread_create(&_rcu_thread, NULL, rcu_runner, NULL);
 }
 
 
@@ -127,43 +580,123 @@ void uthread_system_init(int max_num_kthreads)
  */
 int uthread_create(void (*run_func)())
 {
-	int rv;
+	assert(run_func != NULL);
 
-	pthread_mutex_lock(&_mutex);
-	assert(_shutdown == false);
+	uthread_t* uthread = uthread_alloc();
+	uthread_init_lazy(uthread, run_func, NULL, false);
+	return uthread_schedule_new(uthread);
+}
 
-	// Lock the system from shutting down while there is a uthread running.
-	if (_num_kthreads == 0) {
-		pthread_mutex_lock(&_shutdown_mutex);
+
+
+/**
+ * See `uthread.h`.
+ */
+int uthread_create_arg(void (*run_func)(void*), void* arg)
+{
+	assert(run_func != NULL);
+
+	uthread_t* uthread = uthread_alloc();
+	uthread_init_lazy(uthread, (void (*)()) run_func, arg, true);
+	return uthread_schedule_new(uthread);
+}
+
+
+
+/**
+ * See `uthread.h`.
+ */
+int uthread_spawn(void (*run_func)(void*), void* arg)
+{
+	assert(run_func != NULL);
+
+	kthread_t* self = kthread_self();
+	if (self == NULL) {
+		// There is no continuation to offer, so spawn parent-first.
+		return uthread_create_arg(run_func, arg);
 	}
 
-	uthread_t* uthread = malloc(sizeof(uthread_t));
-	assert (uthread != NULL);
-	uthread_init(uthread, run_func);
+	uthread_t* child = uthread_alloc();
+	uthread_init_lazy(child, (void (*)()) run_func, arg, true);
+	child->state = UTHREAD_READY;
+	child->id = __atomic_fetch_add(&_next_uthread_id, 1, __ATOMIC_RELAXED);
+
+	// The caller is counted, so this cannot be the first `uthread`.
+	__atomic_fetch_add(&_num_uthreads, 1, __ATOMIC_SEQ_CST);
 
-	if (_num_kthreads == _max_num_kthreads)
+	pthread_mutex_lock(&_mutex);
+	assert(_shutdown == false);
+
+	uthread_t* cur = self->running;
+	transfer_elapsed_time(self, cur);
+	cur->state = UTHREAD_READY;
+
+	if (_num_idle_kthreads == 0 && _num_spinning_kthreads == 0
+	    && _num_kthreads < _max_num_kthreads + _num_blocked_kthreads)
 	{
-		// Add the new `uthread` to the heap.
-		HEAPinsert(_waiting_uthreads, (const void *) uthread);
+		// Rather than waiting to be stolen, the continuation gets a `kthread` of
+		// its own. It cannot be resumed before it has been saved below, since
+		// the new `kthread` must first lock `_mutex`.
+		kthread_t* kthread = find_inactive_kthread_for(cur);
+		assert(kthread != NULL);
+		kthread_create(kthread, cur);
+		_num_kthreads += 1;
 	}
 	else
 	{
-		// Make a new `kthread` to run this new `uthread` immediately.
+		// Push the continuation for this `kthread` to resume once `child` exits
+		// or parks, unless another steals it first.
+		cur->next = self->continuations;
+		self->continuations = cur;
+		__atomic_fetch_add(&_num_continuations, 1, __ATOMIC_RELAXED);
+		if (_idle_kthreads != NULL && _num_spinning_kthreads == 0) {
+			kthread_unpark(_idle_kthreads);
+		}
+	}
 
-		assert(HEAPsize(_waiting_uthreads) == 0);  // There must not be waiting
-												   // uthreads if `_num_kthreads` is
-												   // less than `_max_num_kthreads`.
+	// As in `uthread_yield()`, `_mutex` is released by whichever `kthread`
+	// resumes `cur`.
+	self->running = child;
+	kthread_switch(self, cur, child);
+	kthread_finish_switch(kthread_self());
+	return 0;
+}
 
-		kthread_t* kthread = find_inactive_kthread();
-		assert(kthread != NULL);  // There must be an inactive `kthread` if
-								  // `_num_kthreads` is less than `_max_num_kthreads`.
 
-		rv = kthread_create(kthread, uthread);
-		_num_kthreads += 1;
-	}
 
-	pthread_mutex_unlock(&_mutex);
-	return rv;
+/**
+ * See `uthread.h`.
+ */
+void* uthread_prepare_arg(void (*run_func)(void*), size_t size)
+{
+	assert(run_func != NULL);
+	assert(size <= UTHREAD_INLINE_ARG_MAX);
+
+	// The argument is stored in the stack, so this `uthread` is not lazy.
+	uthread_t* uthread = uthread_alloc();
+	uthread_init(uthread, uthread_exit);
+
+	// Move the initial frame down below the reserved bytes.
+	size_t reserved = (size + CACHE_LINE_SIZE - 1) & ~((size_t) CACHE_LINE_SIZE - 1);
+	void* arg = uthread->stack + UCONTEXT_STACK_SIZE - reserved;
+	uthread_init_frame(uthread, arg);
+	uthread_header(uthread)->run_arg_func = run_func;
+	uthread_header(uthread)->arg = arg;
+	return arg;
+}
+
+
+
+/**
+ * See `uthread.h`.
+ */
+int uthread_start_prepared(void* arg)
+{
+	// The argument is in the `uthread`'s own stack, so its header can be found
+	// just as `uthread_current()` finds it.
+	stack_header_t* header = (stack_header_t*) ((uintptr_t) arg & ~((uintptr_t) UCONTEXT_STACK_SIZE - 1));
+	assert(header->arg == arg);
+	return uthread_schedule_new(header->uthread);
 }
 
 
@@ -182,33 +715,92 @@ void uthread_yield()
 
 	uthread_t* cur = self->running;
 	transfer_elapsed_time(self, cur);
+	if (_timed_waiters != NULL) {
+		expire_timed_waiters();
+	}
 
-	//HEAPprint(_waiting_uthreads, uthread_print);
+	//HEAPprint(self->waiting, uthread_print);
 
-	// Yield this `kthread` to the highest-priority waiting `uthread` if it has
-	// a higher priority than the currently-running `uthread`.
-	if (waiting_uthread_has_priority_over(cur))
+	// Yield this `kthread` to the highest-priority `uthread` waiting for it if
+	// it has a higher priority than the currently-running `uthread`.
+	Heap heap = kthread_next_heap(self);
+	if (heap != NULL && uthread_priority(cur, HEAPpeek(heap)) < 0)
 	{
 		// Get another `uthread` from the heap to be run.
 		uthread_t* next = NULL;
-		HEAPextract(_waiting_uthreads, (void **) &next);
+		HEAPextract(heap, (void **) &next);
+		_num_waiting_uthreads--;
 		self->running = next;
 
-		// Save the current `uthread` to the heap.
-		HEAPinsert(_waiting_uthreads, (void *) cur);
+		// Save the current `uthread` to a heap, usually this `kthread`'s own.
+		cur->state = UTHREAD_READY;
+		uthread_enqueue(cur);
 
-		// TODO: consider possibility of race conditions!
-		pthread_mutex_unlock(&_mutex);
-		kthread_handoff(cur, next);
+		// `_mutex` stays locked across the handoff, so that no other `kthread`
+		// can extract and resume `cur` before its context has been saved. The
+		// lock is released by whichever `kthread` resumes `cur` (possibly not
+		// this one).
+		kthread_switch(self, cur, next);
+		kthread_finish_switch(kthread_self());
 	}
 	else
 	{
+		self->num_schedules++;
+		self->run_start = cycle_count();
+		kthread_rcu_quiescent(self);
 		pthread_mutex_unlock(&_mutex);
 	}
 }
 
 
 
+/**
+ * See `uthread.h`.
+ */
+void uthread_maybe_yield()
+{
+	stack_header_t* header = uthread_current_header();
+	unsigned long now = cycle_count();
+	unsigned long slice = (header->slice_cycles != 0) ? header->slice_cycles : _slice_cycles;
+	if (now - header->slice_start < slice || header->rcu_nesting != 0) {
+		return;
+	}
+
+	// Only pay for a real yield when some `uthread` is waiting to run.
+	if (__atomic_load_n(&_num_waiting_uthreads, __ATOMIC_RELAXED) > 0
+	    || __atomic_load_n(&_num_inbox_uthreads, __ATOMIC_RELAXED) > 0) {
+		uthread_yield();
+	}
+	header->slice_start = cycle_count();
+}
+
+
+
+/**
+ * See `uthread.h`.
+ */
+void uthread_set_default_slice(long slice_ns)
+{
+	assert(slice_ns > 0);
+	_slice_ns = slice_ns;
+	_slice_cycles = slice_ns * _cycles_per_ns;
+}
+
+
+
+/**
+ * See `uthread.h`.
+ */
+void uthread_set_slice(uthread_handle_t handle, long slice_ns)
+{
+	assert(handle != NULL);
+	assert(slice_ns >= 0);
+	unsigned long slice_cycles = slice_ns * _cycles_per_ns;
+	uthread_header(handle)->slice_cycles = (slice_ns > 0 && slice_cycles == 0) ? 1 : slice_cycles;
+}
+
+
+
 /**
  * See `uthread.h`.
  */
@@ -216,8 +808,6 @@ void uthread_exit()
 {
 	pthread_mutex_lock(&_mutex);
 	kthread_t* self = kthread_self();
-	int self_tid;
-	int self_tgid;
 	pthread_mutex_unlock(&_mutex);
 
 	// If the calling thread is not a `kthread` created by the system, block on a
@@ -229,352 +819,3717 @@ void uthread_exit()
 		return;
 	}
 
+	// The destructors are user code, so they must run before `_mutex` is locked.
+	// They may still use the arena, which is recycled after them.
+	uthread_t* cur = uthread_current();
+	uthread_run_destructors(cur);
+	arena_recycle(_kthreads + cur->home, uthread_header(cur));
+
 	pthread_mutex_lock(&_mutex);
 	assert(_shutdown == false);
 
 	self = kthread_self();
-	uthread_t* prev = self->running;
-	uthread_t* next = NULL;
 
-	// TODO: print prev->running_time for debug.
+	// If this was the last `uthread`, then the system-shutdown mutex is unlocked.
+	if (__atomic_sub_fetch(&_num_uthreads, 1, __ATOMIC_SEQ_CST) == 0) {
+		pthread_mutex_unlock(&_shutdown_mutex);
+		if (_main_kthread != NULL && _main_kthread->is_idle) {
+			kthread_unpark(_main_kthread);
+		}
+	}
+	if (_timed_waiters != NULL) {
+		expire_timed_waiters();
+	}
 
-	// Stop running the `prev` `uthread`, and clean up any references to it.
-	self->running = NULL;
-	uthread_destroy(prev);
-	free(prev);
+	// Stop running the `prev` `uthread`. It cannot be freed yet, because its
+	// stack is still in use; it will be freed by `kthread_finish_switch()` once
+	// this `kthread` has switched off of it.
+	assert(self->zombie == NULL);
+	self->zombie = self->running;
 
 	// Check if a `uthread` can use this kthread.
-	if (HEAPsize(_waiting_uthreads) > 0)
+	uthread_t* next = kthread_next_uthread(self);
+	if (next != NULL)
 	{
 		// Use this `kthread` to run a different `uthread`.
-		uthread_t* next = NULL;
-		HEAPextract(_waiting_uthreads, (void **) &next);
-		assert(next != NULL);
 		self->running = next;
 
 		kthread_update_timestamps(self);
 
-		// TODO: consider possibility of race conditions.
-		pthread_mutex_unlock(&_mutex);
-		setcontext(&(next->ucontext));
+		// `_mutex` is released once `next` has been resumed.
+		kthread_switch(self, self->zombie, next);
 	}
 	else
 	{
-		// There are no `uthread`s that might use `self`. Kill `self`.
-		// Find out more about `self` first.
-		self_tid = self->tid;
-		self_tgid = getpid();
+		// There are no `uthread`s that might use `self`. Return to
+		// `kthread_runner()`, where `self` idles or terminates.
+		self->running = NULL;
+		kthread_switch(self, self->zombie, NULL);
+	}
+
+	assert(false);  // Control should never reach here.
+}
 
-		// Clean up `kthread`-associated system data structures.
-		_num_kthreads--;
 
-		// If this was the last `kthread`, then the system-shutdown mutex is unlocked.
-		// Free lock and kill self.
-		if (_num_kthreads == 0) {
-			pthread_mutex_unlock(&_shutdown_mutex);
-		}
 
-		pthread_mutex_unlock(&_mutex);
-		tgkill(self_tid, self_tgid, SIGKILL);
-		assert(false);  // Control should never reach here.
+/**
+ * See `uthread.h`.
+ */
+void uthread_run_main()
+{
+	// Find the bounds of this thread's stack, for `walk_stack()`. This may
+	// allocate, so it is done before taking `_mutex`.
+	void* stack_lo;
+	void* stack_hi;
+	thread_stack_bounds(&stack_lo, &stack_hi);
+
+	pthread_mutex_lock(&_mutex);
+	assert(_kthreads != NULL);  // The system must be initialized.
+	assert(kthread_self() == NULL);  // Only a thread which is not a `kthread` may join.
+	assert(_main_kthread == NULL);
+
+	// Take over an unused slot, as `kthread_create()` would for a new thread.
+	kthread_t* kt = find_inactive_kthread();
+	if (kt != NULL) {
+		kt->is_active = true;
+		_main_kthread = kt;
+		_num_kthreads += 1;
+		kthread_enter(kt, stack_lo, stack_hi);
+		kthread_run(kt);
+		kthread_leave(kt);
+		_main_kthread = NULL;
 	}
-}
+	pthread_mutex_unlock(&_mutex);
 
+	// No `uthread`s are left, unless other threads are still making them.
+	uthread_exit();
+}
 
 
-/* Define primary helper functions. **********************************************/
 
 /**
- * Makes the current `kthread` stop running the `prev` `uthread` and start running
- * the `next` `uthread`. Progress on the `prev` `uthread` is saved.
+ * See `uthread.h`.
  */
-void kthread_handoff(uthread_t* prev, uthread_t* next)
+uthread_handle_t uthread_self()
 {
-	assert(prev != NULL);
-	assert(next != NULL);
-
-	swapcontext(&(prev->ucontext), &(next->ucontext));
+	kthread_t* self = kthread_self();
+	return (self != NULL) ? uthread_current() : NULL;
 }
 
 
 
 /**
- * Free any uthread system resources. If this has already been called, then nothing
- * is done.
+ * See `uthread.h`.
  */
-void uthread_system_shutdown()
+int uthread_set_affinity(uthread_handle_t handle, unsigned long kthread_mask)
 {
-	if (_shutdown != true)
-	{
-		_shutdown = true;
-
-		HEAPdestroy(_waiting_uthreads);
-		_waiting_uthreads = NULL;
-		
-		for (kthread_t* kt = _kthreads; kt < _kthreads + _max_num_kthreads; kt++) {
-			kthread_destroy(kt);
-		}
-		free(_kthreads);
-		_kthreads = NULL;
+	assert(handle != NULL);
 
-		// Note that there is nothing to free from _system_initializer_context,
-		// because its stack was never allocated.
+	pthread_mutex_lock(&_mutex);
+	unsigned long valid_mask = (_max_num_kthreads >= UTHREAD_AFFINITY_BITS)
+	                           ? ~0UL : (1UL << _max_num_kthreads) - 1;
+	if (kthread_mask != 0 && (kthread_mask & valid_mask) == 0) {
+		pthread_mutex_unlock(&_mutex);
+		return -1;
 	}
-	// Otherwise, this function was already called, so there's nothing to do.
+
+	// A waiting `uthread` is not moved; the mask applies from its next switch.
+	handle->affinity = kthread_mask & valid_mask;
+	pthread_mutex_unlock(&_mutex);
+	return 0;
 }
 
 
 
 /**
- * Initializes `uthread`, such that it is ready to be run. When the `uthread` is
- * started running on a `kthread`, it will start by running the given `run_func()`.
+ * See `uthread.h`.
  */
-void uthread_init(uthread_t* uthread, void (*run_func)())
+void uthread_set_migration_margin(int margin)
 {
-	assert(uthread != NULL);
-	assert(run_func != NULL);
-
-	// Initialize the `ucontext`.
-	ucontext_t* uc = &(uthread->ucontext);
-	*uc = _system_initializer_context;
-	uc->uc_stack.ss_sp = malloc(UCONTEXT_STACK_SIZE);
-	uc->uc_stack.ss_size = UCONTEXT_STACK_SIZE;
-	makecontext(uc, run_func, 0);
+	assert(margin >= 0);
 
-	// Initialize the running time.
-	struct timeval tv = { .tv_sec = 0, .tv_usec = 0 };
-	uthread->running_time = tv;
+	pthread_mutex_lock(&_mutex);
+	_migration_margin = margin;
+	pthread_mutex_unlock(&_mutex);
 }
 
 
 
 /**
- * Frees any resources used by the given `uthread_t`.
+ * See `uthread.h`.
  */
-void uthread_destroy(uthread_t* ut)
+void uthread_set_idle_spin(long min_ns, long max_ns)
 {
-	assert(ut != NULL);
-	free(ut->ucontext.uc_stack.ss_sp);
+	assert(0 <= min_ns && min_ns <= max_ns);
+
+	pthread_mutex_lock(&_mutex);
+	_idle_spin_min_ns = min_ns;
+	_idle_spin_max_ns = max_ns;
+	pthread_mutex_unlock(&_mutex);
 }
 
 
 
 /**
- * This function is expected to be a `start_routine` for `clone()`
- *
- * The function interprets the given void pointer as a pointer to a `kthread_t`.
- * The `running` field of that `kthread_t` must already be set to the `uthread`
- * that is to be started on the new `kthread`.
+ * See `uthread.h`.
  */
-int kthread_runner(void* ptr)
+int uthread_wait(const volatile int* addr, int expected, const struct timespec* timeout)
 {
-	kthread_t* kt = ptr;
-	assert(kt != NULL);
-	assert(kt->running != NULL);
+	assert(addr != NULL);
 
-	kt->tid = gettid();
-	kthread_update_timestamps(kt);
+	// Only the calling thread's own `kthread` slot is looked at, and it does
+	// not change while the thread is running, so `_mutex` is not needed.
+	kthread_t* self = kthread_self();
+	if (self == NULL) {
+		return thread_wait(addr, expected, timeout);
+	}
+
+	waiter_t w = {
+		.addr = addr,
+		.uthread = self->running,
+		.state = WAITER_PARKED,
+		.has_deadline = (timeout != NULL),
+	};
+	if (timeout != NULL) {
+		clock_gettime(CLOCK_MONOTONIC, &(w.deadline));
+		w.deadline.tv_sec += timeout->tv_sec;
+		w.deadline.tv_nsec += timeout->tv_nsec;
+		if (w.deadline.tv_nsec >= 1000000000L) {
+			w.deadline.tv_sec += 1;
+			w.deadline.tv_nsec -= 1000000000L;
+		}
+	}
 
-	// Switch to running the `uthread`.
-	setcontext(&(kt->running->ucontext));
+	// Once the bucket is locked, no waker can miss `w`: a waker changes `*addr`
+	// before it locks the bucket to look for waiters.
+	wait_bucket_t* bucket = wait_bucket(addr);
+	spin_lock(&(bucket->lock));
+	if (*addr != expected) {
+		spin_unlock(&(bucket->lock));
+		return UTHREAD_WAIT_CHANGED;
+	}
 
-	assert(false);  // Execution should never reach here.
-}
+	w.prev = bucket->tail;
+	w.next = NULL;
+	if (bucket->tail != NULL) {
+		bucket->tail->next = &w;
+	} else {
+		bucket->head = &w;
+	}
+	bucket->tail = &w;
 
+	pthread_mutex_lock(&_mutex);
+	assert(_shutdown == false);
+	self = kthread_self();
+	uthread_t* cur = self->running;
+	transfer_elapsed_time(self, cur);
 
+	if (w.has_deadline) {
+		w.timed_prev = NULL;
+		w.timed_next = _timed_waiters;
+		if (_timed_waiters != NULL) {
+			_timed_waiters->timed_prev = &w;
+		}
+		_timed_waiters = &w;
+	}
 
-/**
- * Returns a pointer to the `kthread_t` that is executing the function. If the
- * thread which is calling the function is not a `kthread` created by by this
- * system, then `NULL` is returned.
- */
-kthread_t* kthread_self()
-{
-	kthread_t* cur = _kthreads;
-	kthread_t* end = _kthreads + _max_num_kthreads;
-	int self_tid = gettid();
-	while (cur < end)
+	// Like a yield, except that `cur` is not put in the heap. The bucket lock
+	// (as well as `_mutex`) is held until the switch off of `cur` is complete,
+	// so that `cur` cannot be made ready before its context has been saved.
+	self->switch_lock = &(bucket->lock);
+	cur->state = UTHREAD_PARKED;
+	uthread_t* next = kthread_next_uthread(self);
+	if (next != NULL)
 	{
-		if (cur->tid == self_tid) {
-			assert(cur->running != NULL);  // TODO: make this more robust
-			return cur;
-		}
-		cur++;
+		self->running = next;
+		kthread_switch(self, cur, next);
 	}
-	return NULL;
+	else
+	{
+		// There is nothing else to run, so go back to `kthread_runner()`.
+		self->running = NULL;
+		kthread_switch(self, cur, NULL);
+	}
+	kthread_finish_switch(kthread_self());
+
+	// A timed-out waiter is still in its bucket, so it must remove itself.
+	if (w.state == WAITER_TIMED_OUT) {
+		spin_lock(&(bucket->lock));
+		wait_bucket_remove(bucket, &w);
+		spin_unlock(&(bucket->lock));
+		return UTHREAD_WAIT_TIMED_OUT;
+	}
+
+	assert(w.state == WAITER_WOKEN);
+	return UTHREAD_WAIT_WOKEN;
 }
 
 
 
 /**
- * Run the given user thread on the given kernel thread. The kernel thread must
- * not already be active.
+ * See `uthread.h`.
  */
-int kthread_create(kthread_t* kt, uthread_t* ut)
+int uthread_wake(const volatile int* addr, int n)
 {
-	// TODO: everything!
-	assert(kt->running == NULL);
-	kt->running = ut;
+	assert(addr != NULL);
+
+	wait_bucket_t* bucket = wait_bucket(addr);
+	waiter_t* woken = NULL;
+	int num_woken = 0;
+
+	// Claim up to `n` parked waiters on `addr`, in FIFO order.
+	spin_lock(&(bucket->lock));
+	waiter_t* w = bucket->head;
+	while (w != NULL && num_woken < n) {
+		waiter_t* next = w->next;
+		if (w->addr == addr
+		    && __sync_bool_compare_and_swap(&(w->state), WAITER_PARKED, WAITER_WOKEN))
+		{
+			wait_bucket_remove(bucket, w);
+			w->next = woken;
+			woken = w;
+			num_woken++;
+		}
+		w = next;
+	}
+	spin_unlock(&(bucket->lock));
+
+	// A claimed waiter stays parked (so `w` stays valid) until it is made ready.
+	// Only waiters with deadlines need `_mutex`, to leave `_timed_waiters`.
+	while (woken != NULL) {
+		waiter_t* next = woken->next;
+		if (woken->has_deadline) {
+			pthread_mutex_lock(&_mutex);
+			timed_waiters_remove(woken);
+			uthread_make_ready(woken->uthread);
+			pthread_mutex_unlock(&_mutex);
+		} else {
+			uthread_submit(woken->uthread);
+		}
+		woken = next;
+	}
+
+	// Also wake any threads which are not `uthread`s.
+	__sync_synchronize();
+	if (num_woken < n && bucket->num_thread_waiters > 0) {
+		num_woken += futex(addr, FUTEX_WAKE, n - num_woken);
+	}
+
+	return num_woken;
+}
+
+
+
+/**
+ * See `uthread.h`.
+ */
+void* uthread_blocking(void* (*func)(void*), void* arg)
+{
+	assert(func != NULL);
+
+	// A thread which is not a `uthread` does not hold up any `uthread`s.
+	if (kthread_self() == NULL) {
+		return func(arg);
+	}
+
+	blocking_call_t call = {
+		.next = NULL,
+		.func = func,
+		.arg = arg,
+		.done = 0,
+	};
+
+	spin_lock(&_blocking_lock);
+	if (_blocking_tail != NULL) {
+		_blocking_tail->next = &call;
+	} else {
+		_blocking_head = &call;
+	}
+	_blocking_tail = &call;
+	if (_num_idle_blocking_threads > 0) {
+		_blocking_futex++;
+		futex(&_blocking_futex, FUTEX_WAKE, 1);
+	}
+	spin_unlock(&_blocking_lock);
+
+	while (__atomic_load_n(&(call.done), __ATOMIC_ACQUIRE) == 0) {
+		uthread_wait(&(call.done), 0, NULL);
+	}
+
+	errno = call.error;
+	return call.result;
+}
+
+
+
+/**
+ * See `uthread.h`.
+ */
+ssize_t uthread_read(int fd, void* buf, size_t count)
+{
+	return blocking_syscall(SYS_read, fd, (long) buf, count, 0);
+}
+
+
+
+/**
+ * See `uthread.h`.
+ */
+ssize_t uthread_write(int fd, const void* buf, size_t count)
+{
+	return blocking_syscall(SYS_write, fd, (long) buf, count, 0);
+}
+
+
+
+/**
+ * See `uthread.h`.
+ */
+ssize_t uthread_pread(int fd, void* buf, size_t count, off_t offset)
+{
+	return blocking_syscall(SYS_pread64, fd, (long) buf, count, offset);
+}
+
+
+
+/**
+ * See `uthread.h`.
+ */
+ssize_t uthread_pwrite(int fd, const void* buf, size_t count, off_t offset)
+{
+	return blocking_syscall(SYS_pwrite64, fd, (long) buf, count, offset);
+}
+
+
+
+/**
+ * See `uthread.h`.
+ */
+int uthread_open(const char* path, int flags, mode_t mode)
+{
+	return blocking_syscall(SYS_openat, AT_FDCWD, (long) path, flags, mode);
+}
+
+
+
+/**
+ * See `uthread.h`.
+ */
+int uthread_close(int fd)
+{
+	return blocking_syscall(SYS_close, fd, 0, 0, 0);
+}
+
+
+
+/**
+ * See `uthread.h`.
+ */
+int uthread_fsync(int fd)
+{
+	return blocking_syscall(SYS_fsync, fd, 0, 0, 0);
+}
+
+
+
+/**
+ * See `uthread.h`.
+ */
+int uthread_fdatasync(int fd)
+{
+	return blocking_syscall(SYS_fdatasync, fd, 0, 0, 0);
+}
+
+
+
+/**
+ * See `uthread.h`.
+ */
+int uthread_getaddrinfo(const char* node, const char* service,
+                        const struct addrinfo* hints, struct addrinfo** res)
+{
+	blocking_getaddrinfo_t call = {
+		.node = node,
+		.service = service,
+		.hints = hints,
+		.res = res,
+	};
+	return (int) (intptr_t) uthread_blocking(blocking_getaddrinfo_run, &call);
+}
+
+
+
+/**
+ * See `uthread.h`.
+ */
+int uthread_key_create(uthread_key_t* key, void (*destructor)(void*))
+{
+	assert(key != NULL);
+
+	// Claim the first free key, by making its sequence number odd.
+	for (unsigned int new_key = 0; new_key < UTHREAD_KEYS_MAX; new_key++) {
+		unsigned int seq = __atomic_load_n(_key_seqs + new_key, __ATOMIC_RELAXED);
+		if (seq % 2 != 0 || !__atomic_compare_exchange_n(_key_seqs + new_key, &seq, seq + 1, false,
+		                                                 __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+			continue;
+		}
+
+		__atomic_store_n(_key_destructors + new_key, destructor, __ATOMIC_RELEASE);
+		unsigned int num_keys = __atomic_load_n(&_num_keys, __ATOMIC_RELAXED);
+		while (num_keys <= new_key
+		       && !__atomic_compare_exchange_n(&_num_keys, &num_keys, new_key + 1, false,
+		                                       __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+		}
+		*key = new_key;
+		return 0;
+	}
+	return -1;
+}
+
+
+
+/**
+ * See `uthread.h`.
+ */
+int uthread_key_delete(uthread_key_t key)
+{
+	assert(key < UTHREAD_KEYS_MAX);
+
+	unsigned int seq = __atomic_load_n(_key_seqs + key, __ATOMIC_RELAXED);
+	if (seq % 2 == 0) {
+		return -1;
+	}
+	__atomic_store_n(_key_destructors + key, NULL, __ATOMIC_RELEASE);
+	return __atomic_compare_exchange_n(_key_seqs + key, &seq, seq + 1, false,
+	                                   __ATOMIC_ACQ_REL, __ATOMIC_RELAXED) ? 0 : -1;
+}
+
+
+
+/**
+ * See `uthread.h`.
+ */
+void* uthread_getspecific(uthread_key_t key)
+{
+	assert(key < UTHREAD_KEYS_MAX);
+
+	stack_header_t* self = uthread_header(uthread_current());
+	const key_slot_t* slot;
+	if (key < UTHREAD_KEYS_INLINE) {
+		slot = self->specific + key;
+	} else if (self->specific_overflow != NULL) {
+		slot = self->specific_overflow + (key - UTHREAD_KEYS_INLINE);
+	} else {
+		return NULL;
+	}
+	return (slot->seq == __atomic_load_n(_key_seqs + key, __ATOMIC_RELAXED)) ? slot->value : NULL;
+}
+
+
+
+/**
+ * See `uthread.h`.
+ */
+int uthread_setspecific(uthread_key_t key, const void* value)
+{
+	assert(key < UTHREAD_KEYS_MAX);
+
+	stack_header_t* self = uthread_header(uthread_current());
+	key_slot_t* slot;
+	if (key < UTHREAD_KEYS_INLINE) {
+		slot = self->specific + key;
+	} else {
+		if (self->specific_overflow == NULL) {
+			self->specific_overflow = calloc(UTHREAD_KEYS_MAX - UTHREAD_KEYS_INLINE,
+			                                 sizeof(key_slot_t));
+			if (self->specific_overflow == NULL) {
+				return -1;
+			}
+		}
+		slot = self->specific_overflow + (key - UTHREAD_KEYS_INLINE);
+	}
+	slot->value = (void*) value;
+	slot->seq = __atomic_load_n(_key_seqs + key, __ATOMIC_RELAXED);
+	return 0;
+}
+
+
+
+/**
+ * See `uthread.h`.
+ */
+void uthread_parallel_for(long begin, long end, long grain,
+                          void (*body)(long begin, long end, void* ctx), void* ctx)
+{
+	assert(body != NULL);
+
+	parallel_job_t job = {
+		.grain = grain,
+		.for_body = body,
+		.reduce_body = NULL,
+		.ctx = ctx,
+		.partials = NULL,
+		.partial_stride = 0,
+	};
+	parallel_run(&job, begin, end);
+	free(job.workers);
+}
+
+
+
+/**
+ * See `uthread.h`.
+ */
+void uthread_parallel_reduce(long begin, long end, long grain,
+                             void* result, size_t result_size,
+                             void (*body)(long begin, long end, void* partial, void* ctx),
+                             void (*combine)(void* result, const void* partial, void* ctx),
+                             void* ctx)
+{
+	assert(body != NULL);
+	assert(combine != NULL);
+	assert(result != NULL);
+
+	parallel_job_t job = {
+		.grain = grain,
+		.for_body = NULL,
+		.reduce_body = body,
+		.ctx = ctx,
+		.partials = NULL,
+		.partial_stride = (result_size + CACHE_LINE_SIZE - 1) & ~((size_t) CACHE_LINE_SIZE - 1),
+	};
+
+	// Every worker starts with a copy of the identity, which is given in `result`.
+	// Each worker's copy is in cache lines of its own, since workers update them
+	// as they go.
+	assert(result_size > 0);
+	int max_workers = _max_num_kthreads + 1;
+	job.partials = aligned_alloc(CACHE_LINE_SIZE, max_workers * job.partial_stride);
+	assert(job.partials != NULL);
+	for (int w = 0; w < max_workers; w++) {
+		memcpy(job.partials + w * job.partial_stride, result, result_size);
+	}
+
+	parallel_run(&job, begin, end);
+
+	for (int w = 0; w < job.num_workers; w++) {
+		combine(result, job.workers[w].partial, ctx);
+	}
+	free(job.workers);
+	free(job.partials);
+}
+
+
+/**
+ * See `uthread.h`.
+ */
+void uthread_rcu_read_lock()
+{
+	uthread_current_header()->rcu_nesting++;
+}
+
+
+
+/**
+ * See `uthread.h`.
+ */
+void uthread_rcu_read_unlock()
+{
+	stack_header_t* header = uthread_current_header();
+	assert(header->rcu_nesting > 0);
+	header->rcu_nesting--;
+}
+
+
+
+/**
+ * See `uthread.h`.
+ */
+void uthread_call_rcu(uthread_rcu_head_t* head, void (*func)(uthread_rcu_head_t* head))
+{
+	head->func = func;
+	uthread_rcu_head_t* top = __atomic_load_n(&_rcu_pending, __ATOMIC_RELAXED);
+	do {
+		head->next = top;
+	} while (!__atomic_compare_exchange_n(&_rcu_pending, &top, head, true,
+	                                      __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+	// The RCU thread is woken by the first callback of a batch, and then by the
+	// one which fills it (see `rcu_runner()`).
+	int num_pending = __atomic_add_fetch(&_rcu_num_pending, 1, __ATOMIC_RELAXED);
+	if (num_pending == 1 || num_pending == RCU_BATCH_SIZE) {
+		__atomic_add_fetch(&_rcu_futex, 1, __ATOMIC_RELEASE);
+		futex(&_rcu_futex, FUTEX_WAKE, 1);
+	}
+}
+
+
+
+/**
+ * See `uthread.h`.
+ */
+void uthread_synchronize_rcu()
+{
+	assert(_kthreads != NULL);
+	assert(kthread_self() == NULL || uthread_current_header()->rcu_nesting == 0);
+	rcu_wait_for_readers();
+}
+
+
+
+/**
+ * See `uthread.h`.
+ */
+void* uthread_arena_alloc(size_t size)
+{
+	stack_header_t* header = uthread_current_header();
+	if (size > SIZE_MAX - ARENA_ALIGN - sizeof(arena_chunk_t)) {
+		return NULL;  // Rounding it up, or adding a chunk header, would overflow.
+	}
+	size = (size + ARENA_ALIGN - 1 + (size == 0)) & ~((size_t) ARENA_ALIGN - 1);
+	if ((size_t) (header->arena_end - header->arena_next) < size) {
+		return arena_alloc_slow(header, size);
+	}
+	void* ptr = header->arena_next;
+	header->arena_next += size;
+	return ptr;
+}
+
+
+
+
+/**
+ * See `uthread.h`.
+ */
+int uthread_profiler_start(int frequency)
+{
+	assert(frequency > 0);
+
+	pthread_mutex_lock(&_mutex);
+	assert(_kthreads != NULL);  // The system must be initialized.
+
+	if (_profiler_period_ns != 0) {
+		pthread_mutex_unlock(&_mutex);
+		return -1;
+	}
+
+	// Each `kthread` slot keeps its own samples, so that the signal handler
+	// never needs to synchronize with other `kthread`s. The buffers outlive the
+	// system, so that they can be dumped after the final `uthread_exit()`.
+	if (_profiler_buffers == NULL) {
+		_profiler_buffers = calloc(_num_kthread_slots, sizeof(profiler_buffer_t));
+		if (_profiler_buffers == NULL) {
+			pthread_mutex_unlock(&_mutex);
+			return -1;
+		}
+	}
+	for (int idx = 0; idx < _num_kthread_slots; idx++) {
+		profiler_buffer_t* buf = _profiler_buffers + idx;
+		if (buf->samples == NULL) {
+			buf->samples = malloc(PROFILER_MAX_SAMPLES * sizeof(profiler_sample_t));
+			if (buf->samples == NULL) {
+				pthread_mutex_unlock(&_mutex);
+				return -1;
+			}
+		}
+		buf->num_samples = 0;
+		buf->num_dropped_samples = 0;
+	}
+
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_sigaction = profiler_signal_handler;
+	sa.sa_flags = SA_SIGINFO | SA_RESTART;
+	sigemptyset(&(sa.sa_mask));
+	sigaction(PROFILER_SIGNAL, &sa, NULL);
+
+	// Start timers on the `kthread`s which are already running. `kthread`s
+	// which are started later (or have yet to set their `tid`) start their own
+	// timers in `kthread_run()`.
+	_profiler_period_ns = 1000000000L / frequency;
+	for (kthread_t* kt = _kthreads; kt < _kthreads + _num_kthread_slots; kt++) {
+		if (kt->is_active && kt->tid != 0) {
+			kthread_start_profiler_timer(kt);
+		}
+	}
+
+	pthread_mutex_unlock(&_mutex);
+	return 0;
+}
+
+
+
+/**
+ * See `uthread.h`.
+ */
+void uthread_profiler_stop()
+{
+	pthread_mutex_lock(&_mutex);
+	_profiler_period_ns = 0;
+	if (_kthreads != NULL) {  // Otherwise, the system has already shut down.
+		for (kthread_t* kt = _kthreads; kt < _kthreads + _num_kthread_slots; kt++) {
+			kthread_stop_profiler_timer(kt);
+		}
+	}
+	pthread_mutex_unlock(&_mutex);
+}
+
+
+
+/**
+ * See `uthread.h`.
+ */
+void uthread_profiler_dump(FILE* out)
+{
+	pthread_mutex_lock(&_mutex);
+	assert(_profiler_period_ns == 0);  // The profiler must be stopped.
+	if (_profiler_buffers == NULL) {
+		pthread_mutex_unlock(&_mutex);
+		return;  // The profiler was never started.
+	}
+
+	// Gather the samples of all `kthread`s, and sort them so that identical
+	// stacks of the same `uthread` are adjacent.
+	int num_samples = 0;
+	long num_dropped_samples = 0;
+	profiler_buffer_t* bufs_end = _profiler_buffers + _num_kthread_slots;
+	for (profiler_buffer_t* buf = _profiler_buffers; buf < bufs_end; buf++) {
+		num_samples += buf->num_samples;
+		num_dropped_samples += buf->num_dropped_samples;
+	}
+
+	profiler_sample_t** samples = malloc(num_samples * sizeof(profiler_sample_t*));
+	assert(samples != NULL || num_samples == 0);
+	int idx = 0;
+	for (profiler_buffer_t* buf = _profiler_buffers; buf < bufs_end; buf++) {
+		for (int i = 0; i < buf->num_samples; i++) {
+			samples[idx++] = buf->samples + i;
+		}
+	}
+	qsort(samples, num_samples, sizeof(profiler_sample_t*), profiler_sample_cmp);
+
+	// Make one folded stack per run of identical samples: the root frame names
+	// the `uthread`, and the other frames are listed outermost first.
+	folded_stack_t* stacks = malloc(num_samples * sizeof(folded_stack_t));
+	assert(stacks != NULL || num_samples == 0);
+	int num_stacks = 0;
+	for (int start = 0, end; start < num_samples; start = end) {
+		end = start + 1;
+		while (end < num_samples && profiler_sample_cmp(samples + start, samples + end) == 0) {
+			end++;
+		}
+
+		char* line;
+		size_t line_size;
+		FILE* line_stream = open_memstream(&line, &line_size);
+		assert(line_stream != NULL);
+		const profiler_sample_t* sample = samples[start];
+		if (sample->uthread_id != 0) {
+			fprintf(line_stream, "uthread-%lu", sample->uthread_id);
+		} else {
+			fprintf(line_stream, "kthread");
+		}
+		for (int depth = sample->depth - 1; depth >= 0; depth--) {
+			fputc(';', line_stream);
+			profiler_print_frame(line_stream, sample->pcs[depth]);
+		}
+		fclose(line_stream);
+
+		stacks[num_stacks].line = line;
+		stacks[num_stacks].count = end - start;
+		num_stacks++;
+	}
+
+	// Different code addresses can belong to the same functions, so merge the
+	// stacks which print the same.
+	qsort(stacks, num_stacks, sizeof(folded_stack_t), folded_stack_cmp);
+	for (int start = 0, end; start < num_stacks; start = end) {
+		int count = 0;
+		for (end = start; end < num_stacks && folded_stack_cmp(stacks + start, stacks + end) == 0; end++) {
+			count += stacks[end].count;
+		}
+		fprintf(out, "%s %d\n", stacks[start].line, count);
+	}
+
+	for (int i = 0; i < num_stacks; i++) {
+		free(stacks[i].line);
+	}
+	free(stacks);
+
+	if (num_dropped_samples > 0) {
+		fprintf(stderr, "uthread: the profiler dropped %ld samples\n",
+		        num_dropped_samples);
+	}
+
+	free(samples);
+	pthread_mutex_unlock(&_mutex);
+}
+
+
+
+/**
+ * See `uthread.h`.
+ */
+int uthread_perf_counters_start()
+{
+	pthread_mutex_lock(&_mutex);
+	assert(_kthreads != NULL);  // The system must be initialized.
+	if (_perf_enabled) {
+		pthread_mutex_unlock(&_mutex);
+		return 0;
+	}
+
+	// Find out which counters this process may open (e.g. `perf_event_paranoid`
+	// may forbid them all, or the CPU may not have some), by opening them for
+	// the calling thread.
+	_perf_available = 0;
+	for (int idx = 0; idx < NUM_PERF_COUNTERS; idx++) {
+		struct perf_event_attr attr;
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = PERF_TYPE_HARDWARE;
+		attr.config = _perf_configs[idx];
+		attr.disabled = 1;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		int fd = perf_event_open(&attr, 0, -1, -1);
+		if (fd >= 0) {
+			_perf_available |= 1 << idx;
+			close(fd);
+		}
+	}
+	if (_perf_available == 0) {
+		pthread_mutex_unlock(&_mutex);
+		return -1;
+	}
+
+	// `kthread`s which are started later open their own counters in
+	// `kthread_runner()`.
+	_perf_enabled = true;
+	for (kthread_t* kt = _kthreads; kt < _kthreads + _num_kthread_slots; kt++) {
+		if (kt->is_active && kt->tid != 0) {
+			kthread_open_perf_counters(kt);
+		}
+	}
+	pthread_mutex_unlock(&_mutex);
+	return 0;
+}
+
+
+
+/**
+ * See `uthread.h`.
+ */
+void uthread_perf_counters_stop()
+{
+	pthread_mutex_lock(&_mutex);
+	_perf_enabled = false;
+	if (_kthreads != NULL) {  // Otherwise, the system has already shut down.
+		for (kthread_t* kt = _kthreads; kt < _kthreads + _num_kthread_slots; kt++) {
+			if (kt->perf_fd >= 0) {
+				kthread_charge_perf_counters(kt, kt->running);
+			}
+			kthread_close_perf_counters(kt);
+		}
+	}
+	pthread_mutex_unlock(&_mutex);
+}
+
+
+
+/**
+ * See `uthread.h`.
+ */
+void uthread_get_stats(uthread_handle_t handle, uthread_stats_t* stats)
+{
+	assert(handle != NULL);
+	assert(stats != NULL);
+
+	pthread_mutex_lock(&_mutex);
+	stack_header_t* header = uthread_header(handle);
+	stats->id = handle->id;
+	stats->running_ns = handle->running_time.tv_sec * 1000000000L
+	                    + handle->running_time.tv_usec * 1000L;
+	stats->num_switches = header->num_switches;
+
+	// The counts of a running `uthread` only include what it has done since it
+	// was last switched to if it is asking about itself.
+	kthread_t* self = kthread_self();
+	if (self != NULL && self->running == handle && self->perf_fd >= 0) {
+		kthread_charge_perf_counters(self, handle);
+	}
+	long long* counts[NUM_PERF_COUNTERS] = {
+		&(stats->instructions), &(stats->cycles), &(stats->llc_misses), &(stats->branch_misses),
+	};
+	for (int idx = 0; idx < NUM_PERF_COUNTERS; idx++) {
+		*(counts[idx]) = (_perf_available & (1 << idx)) ? (long long) header->perf_counts[idx] : -1;
+	}
+	pthread_mutex_unlock(&_mutex);
+}
+
+
+
+/**
+ * See `uthread.h`.
+ */
+int uthread_watchdog_start(long threshold_ns,
+                           void (*callback)(const uthread_watchdog_report_t* report, void* ctx),
+                           void* ctx)
+{
+	assert(threshold_ns > 0);
+	assert(_kthreads != NULL);  // The system must be initialized.
+
+	pthread_mutex_lock(&_watchdog_mutex);
+	if (_watchdog_running) {
+		pthread_mutex_unlock(&_watchdog_mutex);
+		return -1;
+	}
+
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_sigaction = watchdog_signal_handler;
+	sa.sa_flags = SA_SIGINFO | SA_RESTART;
+	sigemptyset(&(sa.sa_mask));
+	sigaction(WATCHDOG_SIGNAL, &sa, &_watchdog_old_action);
+
+	_watchdog_threshold_ns = threshold_ns;
+	_watchdog_callback = (callback != NULL) ? callback : watchdog_print;
+	_watchdog_ctx = ctx;
+	_watchdog_futex = 0;
+	if (pthread_create(&_watchdog, NULL, watchdog_runner, NULL) != 0) {
+		pthread_mutex_unlock(&_watchdog_mutex);
+		return -1;
+	}
+	_watchdog_running = true;
+	pthread_mutex_unlock(&_watchdog_mutex);
+	return 0;
+}
+
+
+
+/**
+ * See `uthread.h`.
+ */
+void uthread_watchdog_stop()
+{
+	watchdog_stop();
+}
+
+
+
+/* Define primary helper functions. **********************************************/
+
+/**
+ * Gives the given newly-initialized `uthread` an id and either runs it
+ * immediately on a new `kthread` or (if the current number of running `kthread`s
+ * is already at the maximum) adds it to the heap of waiting `uthread`s.
+ */
+int uthread_schedule_new(uthread_t* uthread)
+{
+	int rv = 0;
+	assert(_shutdown == false);
+
+	// Lock the system from shutting down while there is a uthread.
+	if (__atomic_fetch_add(&_num_uthreads, 1, __ATOMIC_SEQ_CST) == 0) {
+		pthread_mutex_lock(&_shutdown_mutex);
+	}
+
+	uthread->id = __atomic_fetch_add(&_next_uthread_id, 1, __ATOMIC_RELAXED);
+	uthread_submit(uthread);
+	return rv;
+}
+
+
+
+/**
+ * Makes the given `uthread` (which is new, or was parked) ready to run, like
+ * `uthread_make_ready()`, but without `_mutex` (which must not be held) where
+ * possible.
+ *
+ * When no `kthread` is idle and no more can be started, the `uthread` is just
+ * pushed into the inbox of a running `kthread` (preferably the one which last
+ * ran it), which drains it under `_mutex` at its next scheduling point. If the
+ * chosen `kthread` parked or terminated in the meantime, it is rescued under
+ * `_mutex`. Otherwise, `_mutex` is taken to start or wake a `kthread`.
+ */
+void uthread_submit(uthread_t* ut)
+{
+	bool must_wake = __atomic_load_n(&_num_idle_kthreads, __ATOMIC_RELAXED) > 0
+	                 && __atomic_load_n(&_num_spinning_kthreads, __ATOMIC_RELAXED) == 0;
+	bool can_start = __atomic_load_n(&_num_kthreads, __ATOMIC_RELAXED)
+	                 < _max_num_kthreads + __atomic_load_n(&_num_blocked_kthreads, __ATOMIC_RELAXED);
+	kthread_t* kt = (must_wake || can_start) ? NULL : find_inbox_for(ut);
+	if (kt == NULL) {
+		pthread_mutex_lock(&_mutex);
+		uthread_make_ready(ut);
+		pthread_mutex_unlock(&_mutex);
+		return;
+	}
+
+	assert(ut->state == UTHREAD_CREATED || ut->state == UTHREAD_PARKED);
+	ut->state = UTHREAD_READY;
+	kthread_push_inbox(kt, ut);
+
+	// Pairs with the fence in `kthread_idle()`: either `kt` sees the pushed
+	// `uthread` before it parks, or this sees that `kt` has parked.
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&(kt->is_idle), __ATOMIC_RELAXED)
+	    || !__atomic_load_n(&(kt->is_active), __ATOMIC_RELAXED)) {
+		pthread_mutex_lock(&_mutex);
+		kthread_drain_inbox(kt);
+		pthread_mutex_unlock(&_mutex);
+	}
+}
+
+
+
+/**
+ * Makes the given `uthread` (which is new, or was parked) ready to run.
+ * `_mutex` must be held.
+ *
+ * If no `kthread` is idle (parked or spinning) and the current number of `kthread`s is not yet at
+ * the maximum, a new `kthread` is made to run it immediately (on its previous
+ * `kthread` slot, if possible). Otherwise, it is added to the heap of a
+ * running `kthread` (see `uthread_enqueue()`).
+ */
+void uthread_make_ready(uthread_t* ut)
+{
+	assert(ut->state == UTHREAD_CREATED || ut->state == UTHREAD_PARKED);
+	ut->state = UTHREAD_READY;
+
+	if (_num_idle_kthreads == 0 && _num_spinning_kthreads == 0
+	    && _num_kthreads < _max_num_kthreads + _num_blocked_kthreads)
+	{
+		// Make a new `kthread` to run this `uthread` immediately.
+		kthread_t* kthread = find_inactive_kthread_for(ut);
+		assert(kthread != NULL);  // There must be an inactive `kthread` if
+								  // `_num_kthreads` is less than its limit.
+
+		kthread_create(kthread, ut);
+		_num_kthreads += 1;
+	}
+	else
+	{
+		uthread_enqueue(ut);
+	}
+}
+
+
+
+/**
+ * Adds the given ready `uthread` to the heap of a running `kthread`. It stays
+ * with the `kthread` which last ran it, unless that `kthread`'s heap holds more
+ * than `_migration_margin` more `uthread`s than the least-loaded allowed one,
+ * in which case it migrates there. `kthread`s outside of its affinity mask are
+ * only used if none within it are running. `_mutex` must be held, and some
+ * `kthread` must be running.
+ *
+ * At most one parked `kthread` is woken: the chosen one if it is parked, or
+ * otherwise any parked one (which may steal the `uthread`), unless there is
+ * already a `kthread` spinning that will find it.
+ */
+void uthread_enqueue(uthread_t* ut)
+{
+	kthread_t* home = (ut->home >= 0) ? _kthreads + ut->home : NULL;
+	kthread_t* least_loaded = NULL;
+	kthread_t* any = NULL;
+	for (kthread_t* kt = _kthreads; kt < _kthreads + _num_kthread_slots; kt++) {
+		if (!kt->is_active) {
+			continue;
+		}
+		if (any == NULL || HEAPsize(kt->waiting) < HEAPsize(any->waiting)) {
+			any = kt;
+		}
+		if (uthread_may_run_on(ut, kt)
+		    && (least_loaded == NULL || HEAPsize(kt->waiting) < HEAPsize(least_loaded->waiting))) {
+			least_loaded = kt;
+		}
+	}
+
+	kthread_t* target;
+	if (home != NULL && home->is_active && uthread_may_run_on(ut, home)
+	    && HEAPsize(home->waiting) <= HEAPsize(least_loaded->waiting) + _migration_margin) {
+		target = home;
+	} else if (least_loaded != NULL) {
+		target = least_loaded;
+	} else {
+		target = any;
+	}
+	assert(target != NULL);
+
+	HEAPinsert(target->waiting, (const void *) ut);
+	_num_waiting_uthreads++;
+
+	if (target->is_idle) {
+		kthread_unpark(target);
+	} else if (_idle_kthreads != NULL && _num_spinning_kthreads == 0) {
+		kthread_unpark(_idle_kthreads);
+	}
+}
+
+
+
+
+/**
+ * Makes the given (current) `kthread` stop running `from` and start running
+ * `to`, where `NULL` stands for the `kthread`'s own `kthread_runner()` context.
+ * Progress on `from` is saved.
+ *
+ * Since every switch is a function call, the FP/SIMD registers are
+ * caller-saved and never need saving here. Only the control words (rounding
+ * modes, etc.) carry over, and they are only saved and restored for `uthread`s
+ * which have changed them from the defaults.
+ */
+void kthread_switch(kthread_t* kt, uthread_t* from, uthread_t* to)
+{
+	// A lazy `uthread` gets its stack from this `kthread`'s cache when it first runs.
+	if (to != NULL && to->is_lazy) {
+		uthread_materialize(to, kthread_take_stack(kt));
+	}
+
+	void** save_sp = (from != NULL) ? &(from->sp) : &(kt->sp);
+	void* load_sp = (to != NULL) ? to->sp : kt->sp;
+
+	if (kt->perf_fd >= 0) {
+		kthread_charge_perf_counters(kt, from);
+	}
+
+	// A `uthread` must not leave its `kthread` inside an RCU read-side
+	// critical section (see `uthread_rcu_read_lock()`).
+	assert(from == NULL || uthread_header(from)->rcu_nesting == 0);
+
+	bool from_has_fp_env = (from != NULL) && uthread_save_fp_env(from);
+	if (to != NULL && to->has_fp_env) {
+		uthread_load_fp_env(uthread_header(to));
+	} else if (from_has_fp_env) {
+		uthread_load_fp_env(NULL);
+	}
+	if (to != NULL) {
+		to->state = UTHREAD_RUNNING;
+		to->home = kt - _kthreads;
+		kt->run_start = cycle_count();
+		uthread_header(to)->slice_start = kt->run_start;
+		uthread_header(to)->num_switches++;
+	}
+
+	uthread_context_switch(save_sp, load_sp);
+}
+
+
+
+/**
+ * Completes a context switch onto the calling `kthread`. This must be called
+ * by whatever code first executes on a `kthread` after a `uthread` context has
+ * been switched to with `_mutex` locked. It cleans up after the `uthread`
+ * which was switched off of (see `kthread_clean_up_switch()`), and then
+ * unlocks `_mutex`.
+ */
+void kthread_finish_switch(kthread_t* kt)
+{
+	kthread_clean_up_switch(kt);
+	pthread_mutex_unlock(&_mutex);
+}
+
+
+
+/**
+ * Frees the `uthread` (if any) which exited to make way for a switch onto the
+ * given `kthread`, and releases the spin lock (if any) which the previous
+ * `uthread` held across the switch. `_mutex` must be held.
+ */
+void kthread_clean_up_switch(kthread_t* kt)
+{
+	assert(kt != NULL);
+
+	kt->num_schedules++;
+	kthread_rcu_quiescent(kt);
+	if (kt->zombie != NULL) {
+		uthread_destroy(kt->zombie, kt);
+		uthread_free(kt->zombie);
+		kt->zombie = NULL;
+	}
+
+	if (kt->switch_lock != NULL) {
+		spin_unlock(kt->switch_lock);
+		kt->switch_lock = NULL;
+	}
+}
+
+
+
+/**
+ * Free any uthread system resources. If this has already been called, then nothing
+ * is done.
+ */
+void uthread_system_shutdown()
+{
+	if (_shutdown != true)
+	{
+		pthread_mutex_lock(&_mutex);
+		_shutdown = true;
+		while (_idle_kthreads != NULL) {
+			kthread_unpark(_idle_kthreads);
+		}
+		pthread_mutex_unlock(&_mutex);
+
+		// Stop the monitor and the blocking-call pool. No calls can be queued,
+		// since no `uthread`s remain.
+		_monitor_futex = 1;
+		futex(&_monitor_futex, FUTEX_WAKE, 1);
+		pthread_join(_monitor, NULL);
+		watchdog_stop();
+
+		// Stop the RCU thread, which first runs the callbacks still pending.
+		__atomic_store_n(&_rcu_stopping, true, __ATOMIC_RELEASE);
+		__atomic_add_fetch(&_rcu_futex, 1, __ATOMIC_RELEASE);
+		futex(&_rcu_futex, FUTEX_WAKE, 1);
+		pthread_join(_rcu_thread, NULL);
+
+		spin_lock(&_blocking_lock);
+		_blocking_futex++;
+		futex(&_blocking_futex, FUTEX_WAKE, BLOCKING_POOL_SIZE);
+		spin_unlock(&_blocking_lock);
+		for (int idx = 0; idx < BLOCKING_POOL_SIZE; idx++) {
+			pthread_join(_blocking_pool[idx], NULL);
+		}
+
+		// The idle `kthread`s terminate once they see `_shutdown`, so wait for
+		// every `kthread` before freeing what they use.
+		// Every `kthread` stopped its own profiler timer when it terminated.
+		for (kthread_t* kt = _kthreads; kt < _kthreads + _num_kthread_slots; kt++) {
+			kthread_destroy(kt);
+		}
+		_profiler_period_ns = 0;
+		free(_kthreads);
+		_kthreads = NULL;
+		while (_uthread_slabs != NULL) {
+			uthread_t* next = _uthread_slabs->next;
+			free(_uthread_slabs);
+			_uthread_slabs = next;
+		}
+		_uthread_pool = NULL;
+
+
+		// Note that there is nothing to free from _system_initializer_context,
+		// because its stack was never allocated.
+	}
+	// Otherwise, this function was already called, so there's nothing to do.
+}
+
+
+
+/**
+ * Returns an uninitialized `uthread_t`. They are allocated `UTHREAD_SLAB_SIZE`
+ * at a time, without `malloc()`'s per-allocation overhead (which is most of
+ * the size of one), and reused once freed with `uthread_free()`, so that a
+ * lazy `uthread` costs little more than its control block.
+ */
+uthread_t* uthread_alloc()
+{
+	spin_lock(&_uthread_pool_lock);
+	if (_uthread_pool == NULL) {
+		uthread_t* slab = aligned_alloc(CACHE_LINE_SIZE, UTHREAD_SLAB_SIZE * sizeof(uthread_t));
+		assert(slab != NULL);
+		slab->next = _uthread_slabs;
+		_uthread_slabs = slab;
+		for (int i = UTHREAD_SLAB_SIZE - 1; i >= 1; i--) {
+			slab[i].next = _uthread_pool;
+			_uthread_pool = slab + i;
+		}
+	}
+	uthread_t* ut = _uthread_pool;
+	_uthread_pool = ut->next;
+	spin_unlock(&_uthread_pool_lock);
+	return ut;
+}
+
+
+
+/**
+ * Returns the given `uthread_t` (which must have been destroyed) to the pool
+ * which `uthread_alloc()` takes from.
+ */
+void uthread_free(uthread_t* ut)
+{
+	spin_lock(&_uthread_pool_lock);
+	ut->next = _uthread_pool;
+	_uthread_pool = ut;
+	spin_unlock(&_uthread_pool_lock);
+}
+
+
+
+/**
+ * Initializes `uthread`, such that it is ready to be run. When the `uthread` is
+ * started running on a `kthread`, it will start by running the given `run_func()`.
+ * Unlike a lazy `uthread`, it is given its stack immediately: from the calling
+ * `kthread`'s cache, or a new one if the caller is not a `kthread`.
+ */
+void uthread_init(uthread_t* uthread, void (*run_func)())
+{
+	uthread_init_lazy(uthread, run_func, NULL, false);
+
+	pthread_mutex_lock(&_mutex);
+	kthread_t* self = kthread_self();
+	void* stack = (self != NULL) ? kthread_take_stack(self) : NULL;
+	pthread_mutex_unlock(&_mutex);
+	if (stack == NULL) {
+		stack = aligned_alloc(UCONTEXT_STACK_SIZE, UCONTEXT_STACK_SIZE);
+		assert(stack != NULL);
+	}
+	uthread_materialize(uthread, stack);
+}
+
+
+
+/**
+ * Initializes `uthread` as a lazy `uthread`, which will run `run_func(arg)` if
+ * `has_arg`, or else `run_func()`. Only its control block is set up; it is
+ * given a stack by `kthread_switch()` when it first runs.
+ */
+void uthread_init_lazy(uthread_t* uthread, void (*run_func)(), void* arg, bool has_arg)
+{
+	assert(uthread != NULL);
+	assert(run_func != NULL);
+
+	uthread->lazy_func = run_func;
+	uthread->lazy_arg = arg;
+	uthread->is_lazy = true;
+	uthread->lazy_has_arg = has_arg;
+	uthread->state = UTHREAD_CREATED;
+	uthread->next = NULL;
+	uthread->home = -1;
+	uthread->affinity = 0;
+	uthread->has_fp_env = false;
+
+	// Initialize the running time.
+	struct timeval tv = { .tv_sec = 0, .tv_usec = 0 };
+	uthread->running_time = tv;
+}
+
+
+
+/**
+ * Gives the given lazy `uthread` the given stack (which must be
+ * `UCONTEXT_STACK_SIZE` bytes, and aligned to its size), and lays out its
+ * header and initial frame there, so that it can be switched to.
+ */
+void uthread_materialize(uthread_t* uthread, void* stack)
+{
+	assert(uthread->is_lazy);
+	assert(stack != NULL);
+
+	// Point the stack's header at `uthread`.
+	stack_header_t* header = stack;
+	header->uthread = uthread;
+	if (uthread->lazy_has_arg) {
+		header->run_func = uthread_exit;
+		header->run_arg_func = (void (*)(void*)) uthread->lazy_func;
+		header->arg = uthread->lazy_arg;
+	} else {
+		header->run_func = uthread->lazy_func;
+		header->run_arg_func = NULL;
+		header->arg = NULL;
+	}
+	header->slice_cycles = 0;
+	header->num_switches = 0;
+	header->rcu_nesting = 0;
+	header->arena = NULL;
+	header->arena_next = NULL;
+	header->arena_end = NULL;
+	memset(header->perf_counts, 0, sizeof(header->perf_counts));
+
+	// Initialize the `uthread`-specific data.
+	memset(header->specific, 0, sizeof(header->specific));
+	header->specific_overflow = NULL;
+
+	uthread->stack = stack;
+	uthread->is_lazy = false;
+	uthread_init_frame(uthread, stack + UCONTEXT_STACK_SIZE);
+}
+
+
+
+/**
+ * Lays out the given `uthread`'s stack just below `top` (which must be 16-byte
+ * aligned) as if `uthread_context_switch()` had been called from the very start
+ * of `uthread_start()`: the (zeroed) callee-saved registers, then the address
+ * to return to, then a null return address for `uthread_start()` itself, which
+ * ends the chain of frames. Without x86-64, the stack instead holds a context
+ * made by `makecontext()`, just below `top`, and is used below that.
+ */
+void uthread_init_frame(uthread_t* ut, void** top)
+{
+#if defined(__x86_64__)
+	top[-1] = NULL;
+	top[-2] = (void*) uthread_start;
+	memset(top - 8, 0, 6 * sizeof(void*));
+	ut->sp = top - 8;
+#else
+	uintptr_t ctx_addr = ((uintptr_t) top - sizeof(ucontext_t)) & ~((uintptr_t) 15);
+	ucontext_t* ctx = (ucontext_t*) ctx_addr;
+	char* stack_base = (char*) ut->stack + STACK_HEADER_SIZE;
+	getcontext(ctx);
+	ctx->uc_stack.ss_sp = stack_base;
+	ctx->uc_stack.ss_size = (char*) ctx - stack_base;
+	ctx->uc_link = NULL;
+	makecontext(ctx, uthread_start, 0);
+	ut->sp = ctx;
+#endif
+}
+
+
+
+/**
+ * Frees any resources used by the given `uthread_t`. Its stack and arena go to
+ * the caches of the given `kthread`, which must be the caller's, or are freed
+ * if it is `NULL`.
+ */
+void uthread_destroy(uthread_t* ut, kthread_t* kt)
+{
+	assert(ut != NULL);
+	if (ut->is_lazy) {
+		return;
+	}
+	free(uthread_header(ut)->specific_overflow);
+	arena_recycle(kt, uthread_header(ut));
+	kthread_release_stack(kt, ut->stack);
+}
+
+
+
+/**
+ * Returns the `uthread` which is running the calling code, which must be
+ * running on a `uthread` stack. This costs a mask of the stack pointer and a
+ * load, with no locking and no system call.
+ */
+uthread_t* uthread_current()
+{
+	return uthread_current_header()->uthread;
+}
+
+
+
+/**
+ * Returns the header of the stack of the `uthread` which is running the calling
+ * code, which must be running on a `uthread` stack.
+ */
+stack_header_t* uthread_current_header()
+{
+	uintptr_t sp = (uintptr_t) __builtin_frame_address(0);
+	return (stack_header_t*) (sp & ~((uintptr_t) UCONTEXT_STACK_SIZE - 1));
+}
+
+
+
+/**
+ * Calls the destructor of each key whose value is not `NULL` in the given
+ * `uthread`, after setting the value to `NULL`. As with `pthread`s, this is
+ * repeated (up to `UTHREAD_DESTRUCTOR_ITERATIONS` times) while destructors
+ * leave new non-`NULL` values behind.
+ */
+void uthread_run_destructors(uthread_t* ut)
+{
+	stack_header_t* header = uthread_header(ut);
+	unsigned int num_keys = __atomic_load_n(&_num_keys, __ATOMIC_ACQUIRE);
+	if (num_keys > UTHREAD_KEYS_MAX) {
+		num_keys = UTHREAD_KEYS_MAX;
+	}
+
+	bool called = true;
+	for (int iter = 0; iter < UTHREAD_DESTRUCTOR_ITERATIONS && called; iter++) {
+		called = false;
+		for (unsigned int key = 0; key < num_keys; key++) {
+			key_slot_t* slot;
+			if (key < UTHREAD_KEYS_INLINE) {
+				slot = header->specific + key;
+			} else if (header->specific_overflow != NULL) {
+				slot = header->specific_overflow + (key - UTHREAD_KEYS_INLINE);
+			} else {
+				break;
+			}
+
+			// A value set before its key was deleted is dropped.
+			void* value = slot->value;
+			if (value == NULL || slot->seq != __atomic_load_n(_key_seqs + key, __ATOMIC_ACQUIRE)) {
+				continue;
+			}
+			slot->value = NULL;
+			void (*destructor)(void*) = __atomic_load_n(_key_destructors + key, __ATOMIC_ACQUIRE);
+			if (destructor != NULL) {
+				destructor(value);
+				called = true;
+			}
+		}
+	}
+}
+
+
+
+/**
+ * This is the entry point of every `uthread` context. It is entered with
+ * `_mutex` locked, finishes the switch onto the current `kthread`, and then
+ * runs the `uthread`'s function.
+ */
+void uthread_start()
+{
+	kthread_t* self = kthread_self();
+	uthread_t* ut = self->running;
+	kthread_finish_switch(self);
+
+	stack_header_t* header = uthread_header(ut);
+	if (header->run_arg_func != NULL) {
+		header->run_arg_func(header->arg);
+	} else {
+		header->run_func();
+	}
+
+	// `run_func()` should have called this already.
+	uthread_exit();
+}
+
+
+
+/**
+ * This function is expected to be a `start_routine` for `pthread_create()`
+ *
+ * The function interprets the given void pointer as a pointer to a `kthread_t`.
+ * The `running` field of that `kthread_t` must already be set to the `uthread`
+ * that is to be started on the new `kthread`.
+ *
+ * When the `uthread` which the `kthread` is running exits or parks with no
+ * other `uthread` waiting to run, it switches back to this function's context
+ * (with `_mutex` locked), and the `kthread` idles until there is more work.
+ * It only terminates (by returning) when the system shuts down, or when it is
+ * surplus to the `kthread`s standing in for blocked ones.
+ */
+void* kthread_runner(void* ptr)
+{
+	kthread_t* kt = ptr;
+	assert(kt != NULL);
+
+	void* stack_lo;
+	void* stack_hi;
+	thread_stack_bounds(&stack_lo, &stack_hi);
+
+	pthread_mutex_lock(&_mutex);
+	assert(kt->running != NULL);
+	kthread_enter(kt, stack_lo, stack_hi);
+	kthread_run(kt);
+	kthread_leave(kt);
+	pthread_mutex_unlock(&_mutex);
+	return NULL;
+}
+
+
+
+/**
+ * Makes the calling thread the one running on the given `kthread` slot, whose
+ * `tid` must be clear. Its stack is `[stack_lo, stack_hi)`. `_mutex` must be
+ * held.
+ */
+void kthread_enter(kthread_t* kt, void* stack_lo, void* stack_hi)
+{
+	assert(kt->tid == 0);
+	kt->tid = gettid();
+	kt->stack_lo = stack_lo;
+	kt->stack_hi = stack_hi;
+}
+
+
+
+/**
+ * Makes the calling thread give up the given `kthread` slot, once `kthread_run()`
+ * has returned, and wakes `kthread_join()`. The thread must not touch the slot
+ * afterwards. `_mutex` must be held.
+ */
+void kthread_leave(kthread_t* kt)
+{
+	kt->stack_lo = NULL;
+	kt->stack_hi = NULL;
+	kt->tid = 0;
+	futex(&(kt->tid), FUTEX_WAKE, INT_MAX);
+}
+
+
+/**
+ * Runs `uthread`s on the given `kthread` (starting with `kt->running`, if it is
+ * not `NULL`), idling while there are none, until `kthread_should_stop()`. Then
+ * hands its waiting `uthread`s to the others, and gives up the slot. This is
+ * the body of `kthread_runner()` and `uthread_run_main()`. `_mutex` must be
+ * held.
+ */
+void kthread_run(kthread_t* kt)
+{
+	if (_profiler_period_ns != 0) {
+		kthread_start_profiler_timer(kt);
+	}
+	if (_perf_enabled) {
+		kthread_open_perf_counters(kt);
+	}
+
+	while (true)
+	{
+		if (kt->running == NULL && kthread_should_stop(kt)) {
+			break;
+		}
+
+		if (kt->running == NULL) {
+			kt->running = kthread_next_uthread(kt);
+		}
+
+		if (kt->running != NULL) {
+			// Switch to running the `uthread`.
+			kthread_update_timestamps(kt);
+			kthread_switch(kt, NULL, kt->running);
+			assert(kt->running == NULL);
+			kthread_clean_up_switch(kt);
+		} else {
+			kthread_idle(kt);
+		}
+	}
+
+	// Clean up `kthread`-associated system data structures. A surplus `kthread`
+	// may still have waiting `uthread`s, which go to the others.
+	kt->is_active = false;
+	kthread_rcu_offline(kt);
+	kthread_drain_inbox(kt);
+	while (HEAPsize(kt->waiting) > 0) {
+		uthread_t* ut = NULL;
+		HEAPextract(kt->waiting, (void **) &ut);
+		_num_waiting_uthreads--;
+		uthread_enqueue(ut);
+	}
+	while (kt->continuations != NULL) {
+		uthread_t* ut = kt->continuations;
+		kt->continuations = ut->next;
+		ut->next = NULL;
+		__atomic_fetch_sub(&_num_continuations, 1, __ATOMIC_RELAXED);
+		uthread_enqueue(ut);
+	}
+	kthread_stop_profiler_timer(kt);
+	kthread_close_perf_counters(kt);
+	if (kt->is_blocked) {
+		kt->is_blocked = false;
+		_num_blocked_kthreads--;
+	}
+	_num_kthreads--;
+}
+
+
+
+/**
+ * Returns whether the given `kthread`, which is between `uthread`s, should stop
+ * running them: when the system shuts down; for the main thread's `kthread`,
+ * once no `uthread`s remain; and for others, while a blocked `kthread` is
+ * running again, so that the extra `kthread`s terminate. `_mutex` must be held.
+ */
+bool kthread_should_stop(const kthread_t* kt)
+{
+	if (_shutdown) {
+		return true;
+	} else if (kt == _main_kthread) {
+		return __atomic_load_n(&_num_uthreads, __ATOMIC_SEQ_CST) == 0;
+	} else {
+		return _num_kthreads > _max_num_kthreads + _num_blocked_kthreads;
+	}
+}
+
+
+
+/**
+ * Makes the given `kthread` wait until there may be a `uthread` for it to run,
+ * the system shuts down, or the earliest deadline of a parked `uthread` has
+ * passed (in which case, it expires the waits whose deadlines have passed).
+ * It first spins (see `kthread_spin()`), and then parks on its own futex,
+ * until `kthread_unpark()`. `_mutex` must be held; it is released while
+ * waiting.
+ */
+void kthread_idle(kthread_t* kt)
+{
+	assert(kt->running == NULL);
+
+	// An idle `kthread` holds no references, so grace periods need not wait for it.
+	kthread_rcu_offline(kt);
+	kthread_spin(kt);
+	if (kthread_should_stop(kt) || kthread_next_heap(kt) != NULL
+	    || (_num_continuations > 0 && kthread_find_continuation(kt) != NULL)) {
+		return;
+	}
+
+	struct timespec timeout;
+	if (_timed_waiters != NULL) {
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		struct timespec earliest = _timed_waiters->deadline;
+		for (waiter_t* w = _timed_waiters; w != NULL; w = w->timed_next) {
+			if (w->deadline.tv_sec < earliest.tv_sec
+			    || (w->deadline.tv_sec == earliest.tv_sec && w->deadline.tv_nsec < earliest.tv_nsec)) {
+				earliest = w->deadline;
+			}
+		}
+		timeout.tv_sec = earliest.tv_sec - now.tv_sec;
+		timeout.tv_nsec = earliest.tv_nsec - now.tv_nsec;
+		if (timeout.tv_nsec < 0) {
+			timeout.tv_sec -= 1;
+			timeout.tv_nsec += 1000000000L;
+		}
+		if (timeout.tv_sec < 0) {
+			expire_timed_waiters();
+			return;
+		}
+	}
+
+	kt->park_futex = 0;
+	kt->is_idle = true;
+	kt->next_idle = _idle_kthreads;
+	_idle_kthreads = kt;
+	_num_idle_kthreads++;
+
+	// Pairs with the fence in `uthread_submit()`.
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&(kt->inbox), __ATOMIC_RELAXED) != NULL
+	    || __atomic_load_n(&_num_inbox_uthreads, __ATOMIC_RELAXED) > 0) {
+		kthread_unpark(kt);
+		return;
+	}
+
+	pthread_mutex_unlock(&_mutex);
+	futex_timed(&(kt->park_futex), FUTEX_WAIT, 0, (_timed_waiters != NULL) ? &timeout : NULL);
+	pthread_mutex_lock(&_mutex);
+
+	// If it was not unparked (e.g. it timed out), it takes itself off of the stack.
+	if (kt->is_idle) {
+		kthread_t** link = &_idle_kthreads;
+		while (*link != kt) {
+			link = &((*link)->next_idle);
+		}
+		*link = kt->next_idle;
+		kt->is_idle = false;
+		_num_idle_kthreads--;
+	}
+
+	if (_timed_waiters != NULL) {
+		expire_timed_waiters();
+	}
+}
+
+
+
+/**
+ * Polls for waiting `uthread`s without `_mutex`, for up to the given
+ * `kthread`'s current spin duration, and returns whether any were seen. The
+ * duration adapts between `_idle_spin_min_ns` and `_idle_spin_max_ns`: it
+ * doubles after a spin which found work, and halves after one which did not.
+ * `_mutex` must be held; it is released while spinning.
+ */
+bool kthread_spin(kthread_t* kt)
+{
+	if (_idle_spin_max_ns == 0) {
+		return false;
+	}
+	long spin_ns = kt->spin_ns;
+	spin_ns = (spin_ns < _idle_spin_min_ns) ? _idle_spin_min_ns : spin_ns;
+	spin_ns = (spin_ns > _idle_spin_max_ns) ? _idle_spin_max_ns : spin_ns;
+
+	// Continuations which it cannot steal (e.g. because of their affinity) are
+	// no reason to stop spinning, but new ones may be.
+	int num_unstealable = (kthread_find_continuation(kt) == NULL) ? _num_continuations : 0;
+
+	_num_spinning_kthreads++;
+	pthread_mutex_unlock(&_mutex);
+
+	struct timespec start, now;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	bool found = false;
+	for (unsigned long iter = 1; !found; iter++) {
+		found = __atomic_load_n(&_num_waiting_uthreads, __ATOMIC_RELAXED) > 0
+		        || __atomic_load_n(&_num_inbox_uthreads, __ATOMIC_RELAXED) > 0
+		        || __atomic_load_n(&_num_continuations, __ATOMIC_RELAXED) > num_unstealable
+		        || __atomic_load_n(&_shutdown, __ATOMIC_RELAXED)
+		        || (kt == _main_kthread && __atomic_load_n(&_num_uthreads, __ATOMIC_RELAXED) == 0);
+		cpu_relax();
+		if (iter % 64 == 0) {
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			long elapsed_ns = (now.tv_sec - start.tv_sec) * 1000000000L
+			                  + (now.tv_nsec - start.tv_nsec);
+			if (elapsed_ns >= spin_ns) {
+				break;
+			}
+		}
+	}
+
+	pthread_mutex_lock(&_mutex);
+	_num_spinning_kthreads--;
+
+	if (found) {
+		spin_ns = (spin_ns * 2 > _idle_spin_max_ns) ? _idle_spin_max_ns : spin_ns * 2;
+	} else {
+		spin_ns = (spin_ns / 2 < _idle_spin_min_ns) ? _idle_spin_min_ns : spin_ns / 2;
+	}
+	kt->spin_ns = spin_ns;
+	return found;
+}
+
+
+
+/**
+ * Wakes the given parked `kthread`. `_mutex` must be held.
+ */
+void kthread_unpark(kthread_t* kt)
+{
+	assert(kt->is_idle);
+
+	kthread_t** link = &_idle_kthreads;
+	while (*link != kt) {
+		link = &((*link)->next_idle);
+	}
+	*link = kt->next_idle;
+	kt->is_idle = false;
+	_num_idle_kthreads--;
+
+	kt->park_futex = 1;
+	futex(&(kt->park_futex), FUTEX_WAKE, 1);
+}
+
+
+
+/**
+ * Returns a pointer to the `kthread_t` that is executing the function. If the
+ * thread which is calling the function is not a `kthread` created by by this
+ * system, then `NULL` is returned.
+ */
+kthread_t* kthread_self()
+{
+	kthread_t* cur = _kthreads;
+	kthread_t* end = _kthreads + _num_kthread_slots;
+	int self_tid = gettid();
+	while (cur < end)
+	{
+		if (cur->tid == self_tid) {
+			assert(cur->running != NULL);  // TODO: make this more robust
+			return cur;
+		}
+		cur++;
+	}
+	return NULL;
+}
+
+
+
+/**
+ * Run the given user thread on the given kernel thread. The kernel thread must
+ * not already be active.
+ */
+void kthread_create(kthread_t* kt, uthread_t* ut)
+{
+	assert(kt->running == NULL);
+	kt->running = ut;
+	kt->is_active = true;
+
+	// Each `kthread` is a `pthread`, so that it has thread-local storage (and
+	// so `errno`, libc's malloc cache, etc.) of its own. It sets `kt->tid` once
+	// it holds `_mutex`, and clears it when it gives up the slot, so nothing
+	// needs to join it.
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	pthread_t thread;
+	int error = pthread_create(&thread, &attr, kthread_runner, kt);
+	assert(error == 0);
+	pthread_attr_destroy(&attr);
+}
+
+
+
+/**
+ * Updates the time info in both the given `kthread` and the given `uthread`
+ * by transfering the time which has elapsed since the timestamps of `kthread`
+ * were updated to the running time of `uthread`.
+ *
+ * This means that the `kthread` will be updated with new timestamps and that
+ * any time which has elapsed since the last timestamps will be added to the
+ * running time of the given `uthread`. Both user and system time are added.
+ *
+ * Note that the given `kt` is assumed to be the the same as would be returned
+ * by `kthread_self()`.
+ */
+void transfer_elapsed_time(kthread_t* kt, uthread_t* ut)
+{
+	assert(kt == kthread_self());
+
+	struct timeval tv;
+	struct timeval prev_cpu_timestamp = kt->cpu_timestamp;
+
+	kthread_update_timestamps(kt);
+
+	// Add the change to the CPU time to `running_time`.
+	timersub(&(kt->cpu_timestamp), &(prev_cpu_timestamp), &tv);
+	timeradd(&(ut->running_time), &tv, &(ut->running_time));
+}
+
+
+
+/* Define minor helper functions. ************************************************/
+
+/**
+ * Initializes the given memory as a `kthread`. Aquires any resources necessary.
+ */
+void kthread_init(kthread_t* kt) {
+	kt->tid = 0;
+	kt->running = NULL;
+	kt->zombie = NULL;
+	kt->switch_lock = NULL;
+	kt->num_schedules = 0;
+	kt->rcu_gp = RCU_OFFLINE;
+	kt->monitor_num_schedules = 0;
+	kt->is_blocked = false;
+	kt->is_active = false;
+	kt->is_idle = false;
+	kt->inbox = NULL;
+	kt->park_futex = 0;
+	kt->next_idle = NULL;
+	kt->continuations = NULL;
+	kt->spin_ns = DEFAULT_IDLE_SPIN_MAX_NS;
+	kt->waiting = HEAPinit(uthread_priority, NULL);
+	kt->stack_lo = NULL;
+	kt->stack_hi = NULL;
+	kt->has_profiler_timer = false;
+	kt->perf_fd = -1;
+	kt->perf_num_counters = 0;
+	kt->stack_cache = NULL;
+	kt->stack_cache_len = 0;
+	kt->arena_cache = NULL;
+	kt->arena_cache_len = 0;
+	kt->run_start = 0;
+	kt->watchdog_num_schedules = 0;
+	kt->watchdog_reported = false;
+}
+
+
+
+/**
+ * Frees any resources used by the given `kthread`.
+ */
+void kthread_destroy(kthread_t* kt) {
+	kthread_join(kt);
+	HEAPdestroy(kt->waiting);
+	while (kt->stack_cache != NULL) {
+		void* next = *(void**) kt->stack_cache;
+		free(kt->stack_cache);
+		kt->stack_cache = next;
+	}
+	while (kt->arena_cache != NULL) {
+		arena_chunk_t* next = kt->arena_cache->next;
+		free(kt->arena_cache);
+		kt->arena_cache = next;
+	}
+}
+
+
+
+/**
+ * Blocks until the thread (if any) which last used the given `kthread` slot has
+ * given it up (see `kthread_leave()`).
+ */
+void kthread_join(kthread_t* kt)
+{
+	int tid;
+	while ((tid = kt->tid) != 0) {
+		futex(&(kt->tid), FUTEX_WAIT, tid);
+	}
+}
+
+
+
+/**
+ * Returns a `uthread` stack from the given `kthread`'s cache, or a new one if
+ * the cache is empty. `_mutex` must be held.
+ */
+void* kthread_take_stack(kthread_t* kt)
+{
+	void* stack = kt->stack_cache;
+	if (stack != NULL) {
+		kt->stack_cache = *(void**) stack;
+		kt->stack_cache_len--;
+		return stack;
+	}
+	stack = aligned_alloc(UCONTEXT_STACK_SIZE, UCONTEXT_STACK_SIZE);
+	assert(stack != NULL);
+	return stack;
+}
+
+
+
+/**
+ * Puts the given `uthread` stack into the given `kthread`'s cache, unless the
+ * cache is full (or `kt` is `NULL`), in which case it is freed. `_mutex` must
+ * be held.
+ */
+void kthread_release_stack(kthread_t* kt, void* stack)
+{
+	if (kt != NULL && kt->stack_cache_len < STACK_CACHE_MAX) {
+		*(void**) stack = kt->stack_cache;
+		kt->stack_cache = stack;
+		kt->stack_cache_len++;
+	} else {
+		free(stack);
+	}
+}
+
+
+
+/**
+ * Returns the time on `CLOCK_MONOTONIC`, in nanoseconds.
+ */
+unsigned long monotonic_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+
+
+/**
+ * Measures how many `cycle_count()`s pass per nanosecond, by spinning for
+ * `CYCLE_CALIBRATION_NS`.
+ */
+double calibrate_cycles_per_ns()
+{
+	unsigned long start_ns = monotonic_ns();
+	unsigned long start_cycles = cycle_count();
+	unsigned long now_ns;
+	do {
+		now_ns = monotonic_ns();
+	} while (now_ns - start_ns < CYCLE_CALIBRATION_NS);
+	double cycles_per_ns = (double) (cycle_count() - start_cycles) / (now_ns - start_ns);
+	return (cycles_per_ns > 0.0) ? cycles_per_ns : 1.0;
+}
+
+
+
+/**
+ * Finds the bounds of the calling thread's stack, or `NULL`s if they are not
+ * known. This may allocate.
+ */
+void thread_stack_bounds(void** lo, void** hi)
+{
+	*lo = NULL;
+	*hi = NULL;
+	pthread_attr_t attr;
+	if (pthread_getattr_np(pthread_self(), &attr) == 0) {
+		size_t size;
+		if (pthread_attr_getstack(&attr, lo, &size) == 0) {
+			*hi = (char*) *lo + size;
+		}
+		pthread_attr_destroy(&attr);
+	}
+}
+
+
+
+/**
+ * Acquires a lock which is only ever held for a few instructions.
+ */
+void spin_lock(volatile int* lock)
+{
+	while (__atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE) != 0) {
+		while (__atomic_load_n(lock, __ATOMIC_RELAXED) != 0) {
+			sched_yield();  // The holder may have been preempted.
+		}
+	}
+}
+
+
+
+void spin_unlock(volatile int* lock)
+{
+	__atomic_store_n(lock, 0, __ATOMIC_RELEASE);
+}
+
+
+
+/**
+ * Returns a pointer to an unused slot in `_kthreads` (i.e. a `kthread_t*` which
+ * points to a `kthread_t` that is not running).
+ *
+ * If no such `kthread_t` slot exists (i.e. if `_num_kthread == _max_num_kthread`),
+ * then `NULL` is returned.
+ */
+kthread_t* find_inactive_kthread()
+{
+	kthread_t* kthread = NULL;
+	for (int idx = 0; idx < _num_kthread_slots; idx++) {
+		if (!_kthreads[idx].is_active) {
+			kthread = _kthreads + idx;
+			break;
+		}
+	}
+	return kthread;
+}
+
+
+
+/**
+ * Returns a pointer to an unused slot in `_kthreads` on which the given
+ * `uthread` prefers to run: the one which last ran it if that is unused,
+ * otherwise one within its affinity mask, otherwise any.
+ */
+kthread_t* find_inactive_kthread_for(const uthread_t* ut)
+{
+	if (ut->home >= 0 && !_kthreads[ut->home].is_active
+	    && uthread_may_run_on(ut, _kthreads + ut->home)) {
+		return _kthreads + ut->home;
+	}
+	for (int idx = 0; idx < _num_kthread_slots; idx++) {
+		if (!_kthreads[idx].is_active && uthread_may_run_on(ut, _kthreads + idx)) {
+			return _kthreads + idx;
+		}
+	}
+	return find_inactive_kthread();
+}
+
+
+
+/**
+ * Reads the CPU time of the calling thread into the given `kthread`'s timestamp.
+ * This uses `CLOCK_THREAD_CPUTIME_ID` rather than `getrusage(RUSAGE_THREAD)`,
+ * whose times only advance at scheduler ticks while a thread keeps running, so
+ * that a whole tick would be charged to whichever `uthread` happened to be
+ * running when it struck.
+ */
+void kthread_update_timestamps(kthread_t* kt)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	kt->cpu_timestamp.tv_sec = ts.tv_sec;
+	kt->cpu_timestamp.tv_usec = ts.tv_nsec / 1000;
+}
+
+
+
+/**
+ * Interprets `key1` and `key2` as pointers to `uthread_t` objects, and
+ * compares them. The comparison is based on the running time of the two records.
+ * In particular, given the two records, the record with the smaller running time will
+ * have the greater priority.
+ */
+int uthread_priority(const void* key1, const void* key2)
+{
+	const struct timeval tv1 = ((const uthread_t*) key1)->running_time;
+	const struct timeval tv2 = ((const uthread_t*) key2)->running_time;
+
+	if (timercmp(&tv1, &tv2, <))
+		return 1;
+	if (timercmp(&tv1, &tv2, ==))
+		return 0;
+	if (timercmp(&tv1, &tv2, >))
+		return -1;
+
+	assert(false);  // All possibilities should be covered by the conditions above.
+}
+
+
+
+/**
+ * This interprets the given pointer as a pointer to a `uthread_t`, then prints out
+ * some information about the `uthread_t` stored there.
+ *
+ * This function is meant to be used for debugging uses only, in particular, with
+ * the `HEAPprint()` function to print out the contents of a `kthread`'s heap.
+ */
+void uthread_print(const void* key)
+{
+	const uthread_t* ut = key;
+	const struct timeval running_time = ut->running_time;
+	printf("uthread %p: running_time = %d.%06d\n",
+			ut, running_time.tv_sec, running_time.tv_usec);
+}
+
+
+
+/**
+ * Returns the heap from which the given `kthread` should take its next
+ * `uthread` (after draining inboxes; see `kthread_drain_inboxes()`): its own,
+ * unless that is empty, in which case it steals from the
+ * fullest heap whose highest-priority `uthread` may run on it. Returns `NULL`
+ * if there is nothing for it to run. `_mutex` must be held.
+ */
+Heap kthread_next_heap(kthread_t* kt)
+{
+	kthread_drain_inboxes(kt);
+	if (HEAPsize(kt->waiting) > 0) {
+		return kt->waiting;
+	}
+	if (_num_waiting_uthreads == 0) {
+		return NULL;
+	}
+
+	Heap fullest = NULL;
+	for (kthread_t* other = _kthreads; other < _kthreads + _num_kthread_slots; other++) {
+		if (HEAPsize(other->waiting) > 0
+		    && (fullest == NULL || HEAPsize(other->waiting) > HEAPsize(fullest))
+		    && uthread_may_run_on(HEAPpeek(other->waiting), kt)) {
+			fullest = other->waiting;
+		}
+	}
+	return fullest;
+}
+
+
+
+/**
+ * Removes and returns the next `uthread` which the given `kthread` should run,
+ * or `NULL`. `_mutex` must be held.
+ *
+ * The newest continuation which it suspended in `uthread_spawn()` comes first,
+ * so that a parent resumes where its child left off, as it would after a call.
+ * Then come the heaps (see `kthread_next_heap()`), and then the continuations
+ * of other `kthread`s (see `kthread_steal_continuation()`).
+ */
+uthread_t* kthread_next_uthread(kthread_t* kt)
+{
+	uthread_t* ut = kt->continuations;
+	if (ut != NULL) {
+		kt->continuations = ut->next;
+		ut->next = NULL;
+		__atomic_fetch_sub(&_num_continuations, 1, __ATOMIC_RELAXED);
+		return ut;
+	}
+
+	Heap heap = kthread_next_heap(kt);
+	if (heap == NULL) {
+		return (_num_continuations > 0) ? kthread_steal_continuation(kt) : NULL;
+	}
+
+	HEAPextract(heap, (void **) &ut);
+	_num_waiting_uthreads--;
+	return ut;
+}
+
+
+
+/**
+ * Removes and returns the oldest continuation (see `uthread_spawn()`) of the
+ * `kthread` with the most of them which may run on the given `kthread`, or
+ * `NULL`. The oldest is the one nearest the root of its spawn tree, so it
+ * usually has the most work left to spawn. `_mutex` must be held.
+ */
+uthread_t* kthread_steal_continuation(kthread_t* kt)
+{
+	uthread_t** victim = kthread_find_continuation(kt);
+	if (victim == NULL) {
+		return NULL;
+	}
+
+	uthread_t* ut = *victim;
+	*victim = NULL;
+	__atomic_fetch_sub(&_num_continuations, 1, __ATOMIC_RELAXED);
+	return ut;
+}
+
+
+
+/**
+ * Returns the link to the continuation which `kthread_steal_continuation()`
+ * would steal for the given `kthread`, or `NULL` if there is none that it may
+ * run (e.g. because of their affinity). `_mutex` must be held.
+ */
+uthread_t** kthread_find_continuation(kthread_t* kt)
+{
+	uthread_t** victim = NULL;
+	int victim_len = 0;
+	for (kthread_t* other = _kthreads; other < _kthreads + _num_kthread_slots; other++) {
+		if (other == kt || other->continuations == NULL) {
+			continue;
+		}
+		int len = 1;
+		uthread_t** link = &(other->continuations);
+		while ((*link)->next != NULL) {
+			link = &((*link)->next);
+			len++;
+		}
+		if (len > victim_len && uthread_may_run_on(*link, kt)) {
+			victim = link;
+			victim_len = len;
+		}
+	}
+	return victim;
+}
+
+
+
+/**
+ * Returns whether the given `uthread`'s affinity mask allows it to run on the
+ * given `kthread`. The slots which are beyond the mask (i.e. the ones used for
+ * replacing blocked `kthread`s) may run any `uthread`.
+ */
+bool uthread_may_run_on(const uthread_t* ut, const kthread_t* kt)
+{
+	long idx = kt - _kthreads;
+	if (ut->affinity == 0 || idx >= _max_num_kthreads || idx >= UTHREAD_AFFINITY_BITS) {
+		return true;
+	}
+	return (ut->affinity & (1UL << idx)) != 0;
+}
+
+
+
+/**
+ * Returns a running `kthread` whose inbox the given `uthread` may be pushed
+ * into without `_mutex`: the one which last ran it, if possible, or otherwise
+ * the next allowed one, round-robin. Returns `NULL` if there is none.
+ */
+kthread_t* find_inbox_for(const uthread_t* ut)
+{
+	if (ut->home >= 0) {
+		kthread_t* home = _kthreads + ut->home;
+		if (__atomic_load_n(&(home->is_active), __ATOMIC_RELAXED) && uthread_may_run_on(ut, home)) {
+			return home;
+		}
+	}
+
+	unsigned int start = __atomic_fetch_add(&_next_inbox, 1, __ATOMIC_RELAXED);
+	for (int i = 0; i < _num_kthread_slots; i++) {
+		kthread_t* kt = _kthreads + (start + i) % _num_kthread_slots;
+		if (__atomic_load_n(&(kt->is_active), __ATOMIC_RELAXED) && uthread_may_run_on(ut, kt)) {
+			return kt;
+		}
+	}
+	return NULL;
+}
+
+
+
+/**
+ * Pushes the given ready `uthread` into the given `kthread`'s inbox. The inbox
+ * is a lock-free stack, which any thread may push into, and which is only
+ * drained (all at once) under `_mutex`.
+ */
+void kthread_push_inbox(kthread_t* kt, uthread_t* ut)
+{
+	__atomic_fetch_add(&_num_inbox_uthreads, 1, __ATOMIC_RELAXED);
+	uthread_t* head = __atomic_load_n(&(kt->inbox), __ATOMIC_RELAXED);
+	do {
+		ut->next = head;
+	} while (!__atomic_compare_exchange_n(&(kt->inbox), &head, ut, true,
+	                                      __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+
+
+/**
+ * Moves every `uthread` in the given `kthread`'s inbox into its heap, waking
+ * it if it is parked. If it has terminated, they are enqueued elsewhere
+ * instead. `_mutex` must be held.
+ */
+void kthread_drain_inbox(kthread_t* kt)
+{
+	uthread_t* ut = __atomic_exchange_n(&(kt->inbox), NULL, __ATOMIC_ACQUIRE);
+	int num_drained = 0;
+	while (ut != NULL) {
+		uthread_t* next = ut->next;
+		ut->next = NULL;
+		if (kt->is_active) {
+			HEAPinsert(kt->waiting, (const void *) ut);
+			_num_waiting_uthreads++;
+		} else {
+			uthread_enqueue(ut);
+		}
+		num_drained++;
+		ut = next;
+	}
+	__atomic_fetch_sub(&_num_inbox_uthreads, num_drained, __ATOMIC_RELAXED);
+
+	if (num_drained > 0 && kt->is_idle) {
+		kthread_unpark(kt);
+	}
+}
+
+
+
+/**
+ * Drains the given `kthread`'s inbox, and, if that leaves it with nothing to
+ * run, every other `kthread`'s inbox too (so that it can steal from them).
+ * `_mutex` must be held.
+ */
+void kthread_drain_inboxes(kthread_t* kt)
+{
+	if (__atomic_load_n(&(kt->inbox), __ATOMIC_RELAXED) != NULL) {
+		kthread_drain_inbox(kt);
+	}
+	if (HEAPsize(kt->waiting) == 0 && __atomic_load_n(&_num_inbox_uthreads, __ATOMIC_RELAXED) > 0) {
+		for (kthread_t* other = _kthreads; other < _kthreads + _num_kthread_slots; other++) {
+			if (__atomic_load_n(&(other->inbox), __ATOMIC_RELAXED) != NULL) {
+				kthread_drain_inbox(other);
+			}
+		}
+	}
+}
+
+
+
+/* Define sampling profiler helper functions. ************************************/
+
+/**
+ * Starts a timer which sends `PROFILER_SIGNAL` to the given `kthread` every
+ * `_profiler_period_ns` of CPU time that it consumes. The `kthread` must be
+ * running, and `_mutex` must be held.
+ */
+void kthread_start_profiler_timer(kthread_t* kt)
+{
+	assert(kt->tid != 0);
+	if (kt->has_profiler_timer) {
+		return;
+	}
+
+	// This is the CPU-time clock of the thread `kt->tid` (see `clock_getcpuclockid()`),
+	// so that the timer can also be started by a different thread.
+	clockid_t clock = ((~(clockid_t) kt->tid) << 3) | 6;
+
+	struct sigevent sev;
+	memset(&sev, 0, sizeof(sev));
+	sev.sigev_notify = SIGEV_THREAD_ID;
+	sev.sigev_signo = PROFILER_SIGNAL;
+	sev.sigev_notify_thread_id = kt->tid;
+	if (timer_create(clock, &sev, &(kt->profiler_timer)) != 0) {
+		return;
+	}
+
+	struct itimerspec its;
+	its.it_interval.tv_sec = _profiler_period_ns / 1000000000L;
+	its.it_interval.tv_nsec = _profiler_period_ns % 1000000000L;
+	its.it_value = its.it_interval;
+	timer_settime(kt->profiler_timer, 0, &its, NULL);
+	kt->has_profiler_timer = true;
+}
+
+
+
+/**
+ * Deletes the profiler timer of the given `kthread`, if it has one. `_mutex`
+ * must be held.
+ */
+void kthread_stop_profiler_timer(kthread_t* kt)
+{
+	if (kt->has_profiler_timer) {
+		timer_delete(kt->profiler_timer);
+		kt->has_profiler_timer = false;
+	}
+}
+
+
+
+/**
+ * Handles `PROFILER_SIGNAL` on a `kthread`. This records the id of the `uthread`
+ * which is running on the `kthread` and the interrupted call stack (walked via
+ * frame pointers) into the `kthread`'s own sample buffer.
+ */
+void profiler_signal_handler(int sig, siginfo_t* info, void* ucontext)
+{
+	(void) sig;
+	(void) info;
+
+	// Find the interrupted `kthread` without `kthread_self()`, which insists
+	// on a running `uthread`.
+	int self_tid = gettid();
+	kthread_t* kt = _kthreads;
+	if (kt == NULL || _profiler_buffers == NULL) {
+		return;
+	}
+	while (kt < _kthreads + _num_kthread_slots && kt->tid != self_tid) {
+		kt++;
+	}
+	if (kt == _kthreads + _num_kthread_slots) {
+		return;
+	}
+
+	profiler_buffer_t* buf = _profiler_buffers + (kt - _kthreads);
+	if (buf->num_samples == PROFILER_MAX_SAMPLES) {
+		buf->num_dropped_samples++;
+		return;
+	}
+
+	profiler_sample_t* sample = buf->samples + buf->num_samples;
+	uthread_t* running = kt->running;
+	sample->uthread_id = (running != NULL) ? running->id : 0;
+	sample->depth = walk_stack(kt, running, ucontext, sample->pcs, PROFILER_MAX_DEPTH);
+
+	buf->num_samples++;
+}
+
+
+
+/**
+ * Walks the call stack which the given `kthread` (running `running`, if not
+ * `NULL`) was interrupted in, as described by the signal handler's `ucontext`,
+ * via frame pointers. Stores up to `max_depth` code addresses (innermost first)
+ * in `pcs`, and returns how many.
+ *
+ * Frames are only followed while they lie on the stack which was interrupted,
+ * so code built without frame pointers just yields truncated stacks.
+ */
+int walk_stack(const kthread_t* kt, const uthread_t* running, const void* ucontext,
+               void** pcs, int max_depth)
+{
+	int depth = 0;
+
+#if defined(__x86_64__)
+	const greg_t* gregs = ((const ucontext_t*) ucontext)->uc_mcontext.gregs;
+	uintptr_t sp = gregs[REG_RSP];
+	uintptr_t* fp = (uintptr_t*) gregs[REG_RBP];
+	pcs[depth++] = (void*) gregs[REG_RIP];
+
+	// Find the bounds of the interrupted stack.
+	uintptr_t lo = (uintptr_t) kt->stack_lo;
+	uintptr_t hi = (uintptr_t) kt->stack_hi;
+	if (running != NULL && !running->is_lazy) {
+		uintptr_t ut_lo = (uintptr_t) running->stack + STACK_HEADER_SIZE;
+		uintptr_t ut_hi = (uintptr_t) running->stack + UCONTEXT_STACK_SIZE;
+		if (ut_lo <= sp && sp < ut_hi) {
+			lo = ut_lo;
+			hi = ut_hi;
+		}
+	}
+
+	// Each frame holds the caller's frame pointer, followed by the return
+	// address. The outermost frame's caller is the context's entry trampoline,
+	// whose frame pointer is not on the stack; it is left out.
+	while (depth < max_depth
+	       && lo <= (uintptr_t) fp && (uintptr_t) (fp + 2) <= hi
+	       && ((uintptr_t) fp & (sizeof(uintptr_t) - 1)) == 0)
+	{
+		void* ret = (void*) fp[1];
+		uintptr_t* caller_fp = (uintptr_t*) fp[0];
+		if (ret == NULL || caller_fp <= fp || (uintptr_t) caller_fp >= hi) {
+			break;  // Frames must move towards the bottom of the stack.
+		}
+		pcs[depth++] = ret;
+		fp = caller_fp;
+	}
+#else
+	(void) kt;
+	(void) running;
+	(void) ucontext;
+	(void) pcs;
+	(void) max_depth;
+#endif
+
+	return depth;
+}
+
+
+
+/**
+ * Compares two `profiler_sample_t*`s (given by reference, as by `qsort()`) by
+ * `uthread` id, then by stack.
+ */
+int profiler_sample_cmp(const void* sample1, const void* sample2)
+{
+	const profiler_sample_t* s1 = *(profiler_sample_t* const*) sample1;
+	const profiler_sample_t* s2 = *(profiler_sample_t* const*) sample2;
+
+	if (s1->uthread_id != s2->uthread_id) {
+		return (s1->uthread_id < s2->uthread_id) ? -1 : 1;
+	}
+	if (s1->depth != s2->depth) {
+		return (s1->depth < s2->depth) ? -1 : 1;
+	}
+	return memcmp(s1->pcs, s2->pcs, s1->depth * sizeof(void*));
+}
+
+
+
+/**
+ * Prints the name of the function containing the given code address, or the
+ * address itself if the function cannot be named (e.g. a `static` function,
+ * or an executable not linked with `-rdynamic`).
+ */
+void profiler_print_frame(FILE* out, void* pc)
+{
+	Dl_info info;
+	if (dladdr(pc, &info) != 0 && info.dli_sname != NULL) {
+		fprintf(out, "%s", info.dli_sname);
+	} else {
+		fprintf(out, "%p", pc);
+	}
+}
+
+
+
+/**
+ * Compares two `folded_stack_t`s by their lines.
+ */
+int folded_stack_cmp(const void* stack1, const void* stack2)
+{
+	return strcmp(((const folded_stack_t*) stack1)->line,
+	              ((const folded_stack_t*) stack2)->line);
+}
+
+
+
+/* Define watchdog helper functions. *********************************************/
+
+/**
+ * The body of the watchdog thread. A few times per threshold, it looks at how
+ * long ago each `kthread` last entered the scheduler (see `kthread_switch()`).
+ * The `uthread` on a `kthread` which has not done so for longer than the
+ * threshold is reported (once per such stretch) to the callback, with a stack
+ * trace taken by the `kthread` itself.
+ */
+void* watchdog_runner(void* ignored)
+{
+	long period_ns = _watchdog_threshold_ns / 4;
+	period_ns = (period_ns < WATCHDOG_MIN_PERIOD_NS) ? WATCHDOG_MIN_PERIOD_NS : period_ns;
+	const struct timespec period = { period_ns / 1000000000L, period_ns % 1000000000L };
+
+	pthread_mutex_lock(&_mutex);
+	int num_slots = _num_kthread_slots;
+	pthread_mutex_unlock(&_mutex);
+	uthread_watchdog_report_t* reports = malloc(num_slots * sizeof(uthread_watchdog_report_t));
+	int* tids = malloc(num_slots * sizeof(int));
+	assert(reports != NULL && tids != NULL);
+
+	while (_watchdog_futex == 0)
+	{
+		futex_timed(&_watchdog_futex, FUTEX_WAIT, 0, &period);
+
+		int num_reports = 0;
+		pthread_mutex_lock(&_mutex);
+		unsigned long now = cycle_count();
+		for (int idx = 0; idx < num_slots && _kthreads != NULL; idx++) {
+			kthread_t* kt = _kthreads + idx;
+			if (kt->running == NULL || kt->num_schedules != kt->watchdog_num_schedules) {
+				kt->watchdog_num_schedules = kt->num_schedules;
+				kt->watchdog_reported = false;
+			}
+			if (kt->running == NULL) {
+				continue;
+			}
+			long running_ns = (now - kt->run_start) / _cycles_per_ns;
+			if (!kt->watchdog_reported && running_ns >= _watchdog_threshold_ns) {
+				kt->watchdog_reported = true;
+				uthread_watchdog_report_t* report = reports + num_reports;
+				report->uthread_id = kt->running->id;
+				report->running_ns = running_ns;
+				report->kthread = idx;
+				report->is_blocked = kt->is_blocked;
+				report->depth = 0;
+				report->pcs = NULL;
+				tids[num_reports++] = kt->tid;
+			}
+		}
+		pthread_mutex_unlock(&_mutex);
+
+		// The callback runs without `_mutex`, so that it may take its time.
+		for (int i = 0; i < num_reports; i++) {
+			// The signal would interrupt (with `EINTR`) some blocking system
+			// calls, so a `kthread` which is in one is left alone.
+			_watchdog_stack.done = 0;
+			if (!reports[i].is_blocked && !thread_is_blocked(tids[i])) {
+				watchdog_take_stack(tids[i], &_watchdog_stack);
+			}
+			if (_watchdog_stack.done && _watchdog_stack.uthread_id == reports[i].uthread_id) {
+				reports[i].depth = _watchdog_stack.depth;
+				reports[i].pcs = _watchdog_stack.pcs;
+			}
+			_watchdog_callback(reports + i, _watchdog_ctx);
+		}
+	}
+
+	free(reports);
+	free(tids);
+	return ignored;
+}
+
+
+
+/**
+ * Asks the `kthread` with the given id to walk its own stack into `stack` (in
+ * `watchdog_signal_handler()`), and waits up to `WATCHDOG_STACK_TIMEOUT_NS` for
+ * it. `stack->done` tells whether it did.
+ */
+void watchdog_take_stack(int tid, watchdog_stack_t* stack)
+{
+	stack->done = 0;
+	stack->depth = 0;
+	__atomic_store_n(&(stack->tid), tid, __ATOMIC_SEQ_CST);
+	if (syscall(SYS_tgkill, getpid(), tid, WATCHDOG_SIGNAL) == 0) {
+		struct timespec deadline, now;
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_nsec += WATCHDOG_STACK_TIMEOUT_NS;
+		if (deadline.tv_nsec >= 1000000000L) {
+			deadline.tv_sec += 1;
+			deadline.tv_nsec -= 1000000000L;
+		}
+		while (__atomic_load_n(&(stack->done), __ATOMIC_ACQUIRE) == 0) {
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			struct timespec timeout = { deadline.tv_sec - now.tv_sec, deadline.tv_nsec - now.tv_nsec };
+			if (timeout.tv_nsec < 0) {
+				timeout.tv_sec -= 1;
+				timeout.tv_nsec += 1000000000L;
+			}
+			if (timeout.tv_sec < 0) {
+				break;
+			}
+			futex_timed(&(stack->done), FUTEX_WAIT, 0, &timeout);
+		}
+	}
+
+	// A late handler must not write into the next request.
+	__atomic_store_n(&(stack->tid), 0, __ATOMIC_SEQ_CST);
+}
+
+
+
+/**
+ * Handles `WATCHDOG_SIGNAL` on a `kthread`, by walking the interrupted stack
+ * into `_watchdog_stack`, if the watchdog asked this `kthread` for it. Any
+ * other signal goes to the handler which the application had installed (if
+ * any), though without its `sa_mask` or other flags.
+ */
+void watchdog_signal_handler(int sig, siginfo_t* info, void* ucontext)
+{
+	int self_tid = gettid();
+	if (info->si_code != SI_TKILL || info->si_pid != getpid()
+	    || __atomic_load_n(&(_watchdog_stack.tid), __ATOMIC_ACQUIRE) != self_tid || _kthreads == NULL) {
+		if (_watchdog_old_action.sa_flags & SA_SIGINFO) {
+			_watchdog_old_action.sa_sigaction(sig, info, ucontext);
+		} else if (_watchdog_old_action.sa_handler != SIG_DFL && _watchdog_old_action.sa_handler != SIG_IGN) {
+			_watchdog_old_action.sa_handler(sig);
+		}
+		return;
+	}
+	kthread_t* kt = _kthreads;
+	while (kt < _kthreads + _num_kthread_slots && kt->tid != self_tid) {
+		kt++;
+	}
+	if (kt == _kthreads + _num_kthread_slots) {
+		return;
+	}
+
+	uthread_t* running = kt->running;
+	_watchdog_stack.uthread_id = (running != NULL) ? running->id : 0;
+	_watchdog_stack.depth = walk_stack(kt, running, ucontext, _watchdog_stack.pcs, PROFILER_MAX_DEPTH);
+	__atomic_store_n(&(_watchdog_stack.done), 1, __ATOMIC_RELEASE);
+	futex(&(_watchdog_stack.done), FUTEX_WAKE, 1);
+}
+
+
+
+/**
+ * The default watchdog callback, which prints the report to `stderr`.
+ */
+void watchdog_print(const uthread_watchdog_report_t* report, void* ignored)
+{
+	(void) ignored;
+
+	flockfile(stderr);
+	fprintf(stderr, "uthread-%lu has run for %ld ms without yielding (kthread %d%s)\n",
+	        report->uthread_id, report->running_ns / 1000000, report->kthread,
+	        report->is_blocked ? ", blocked in a system call" : "");
+	for (int i = 0; i < report->depth; i++) {
+		fprintf(stderr, "    at ");
+		profiler_print_frame(stderr, report->pcs[i]);
+		fprintf(stderr, "\n");
+	}
+	funlockfile(stderr);
+}
+
+
+
+/**
+ * Stops the watchdog thread, if it is running, and gives `WATCHDOG_SIGNAL` back
+ * to the application's handler (unless it has since installed another).
+ */
+void watchdog_stop()
+{
+	pthread_mutex_lock(&_watchdog_mutex);
+	if (_watchdog_running) {
+		_watchdog_futex = 1;
+		futex(&_watchdog_futex, FUTEX_WAKE, 1);
+		pthread_join(_watchdog, NULL);
+		_watchdog_running = false;
+
+		struct sigaction cur;
+		sigaction(WATCHDOG_SIGNAL, NULL, &cur);
+		if ((cur.sa_flags & SA_SIGINFO) && cur.sa_sigaction == watchdog_signal_handler) {
+			sigaction(WATCHDOG_SIGNAL, &_watchdog_old_action, NULL);
+		}
+	}
+	pthread_mutex_unlock(&_watchdog_mutex);
+}
+
+
+
+/* Define hardware counter helper functions. *************************************/
+
+/**
+ * Opens the available hardware counters for the given `kthread`, as one group,
+ * so that they can all be read at once. Does nothing if that fails. `_mutex`
+ * must be held.
+ */
+void kthread_open_perf_counters(kthread_t* kt)
+{
+	assert(kt->tid != 0);
+	if (kt->perf_fd >= 0) {
+		return;
+	}
+
+	for (int idx = 0; idx < NUM_PERF_COUNTERS; idx++) {
+		if ((_perf_available & (1 << idx)) == 0) {
+			continue;
+		}
+		struct perf_event_attr attr;
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = PERF_TYPE_HARDWARE;
+		attr.config = _perf_configs[idx];
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		attr.read_format = PERF_FORMAT_GROUP;
+		int fd = perf_event_open(&attr, kt->tid, -1, kt->perf_fd);
+		if (fd < 0) {
+			continue;  // This one is left out of the group.
+		}
+		if (kt->perf_fd < 0) {
+			kt->perf_fd = fd;
+		}
+		kt->perf_counters[kt->perf_num_counters++] = idx;
+	}
+
+	if (kt->perf_fd >= 0 && !kthread_read_perf_counters(kt, kt->perf_last)) {
+		kthread_close_perf_counters(kt);
+	}
+}
+
+
+
+/**
+ * Closes the given `kthread`'s hardware counters, if it has any. (Closing the
+ * group's leader closes the whole group.) `_mutex` must be held.
+ */
+void kthread_close_perf_counters(kthread_t* kt)
+{
+	if (kt->perf_fd >= 0) {
+		close(kt->perf_fd);
+		kt->perf_fd = -1;
+		kt->perf_num_counters = 0;
+	}
+}
+
+
+
+/**
+ * Reads the current values of the given `kthread`'s group of hardware counters
+ * (in group order) into `values`. Returns whether that worked.
+ */
+bool kthread_read_perf_counters(kthread_t* kt, unsigned long long* values)
+{
+	// With `PERF_FORMAT_GROUP`, the number of counters comes first.
+	unsigned long long buf[1 + NUM_PERF_COUNTERS];
+	ssize_t len = read(kt->perf_fd, buf, sizeof(buf));
+	if (len < (ssize_t) sizeof(unsigned long long) || (int) buf[0] != kt->perf_num_counters) {
+		return false;
+	}
+	memcpy(values, buf + 1, kt->perf_num_counters * sizeof(unsigned long long));
+	return true;
+}
+
+
+
+/**
+ * Adds what the given `kthread`'s hardware counters have counted since they
+ * were last read to the totals of `ut` (unless it is `NULL`, e.g. when the
+ * `kthread` was between `uthread`s). `_mutex` must be held.
+ */
+void kthread_charge_perf_counters(kthread_t* kt, uthread_t* ut)
+{
+	unsigned long long values[NUM_PERF_COUNTERS];
+	if (!kthread_read_perf_counters(kt, values)) {
+		return;
+	}
+	for (int i = 0; i < kt->perf_num_counters; i++) {
+		if (ut != NULL) {
+			uthread_header(ut)->perf_counts[kt->perf_counters[i]] += values[i] - kt->perf_last[i];
+		}
+		kt->perf_last[i] = values[i];
+	}
+}
+
+
+
+/**
+ * Calls the `perf_event_open()` system call, which glibc has no wrapper for.
+ */
+int perf_event_open(struct perf_event_attr* attr, pid_t pid, int cpu, int group_fd)
+{
+	return syscall(SYS_perf_event_open, attr, pid, cpu, group_fd, 0UL);
+}
+
+
+
+/* Define fork-join helper functions. ********************************************/
+
+/**
+ * Runs the given job over `[begin, end)` and returns once every iteration is
+ * done. One worker is the calling thread; the others are helper `uthread`s,
+ * one for each other `kthread` which could run them. The workers are left in
+ * `job->workers`, which the caller must free.
+ */
+void parallel_run(parallel_job_t* job, long begin, long end)
+{
+	if (end <= begin) {
+		job->num_workers = 0;
+		job->workers = NULL;
+		return;
+	}
+
+	pthread_mutex_lock(&_mutex);
+	assert(_kthreads != NULL);  // The system must be initialized.
+	bool caller_is_uthread = (kthread_self() != NULL);
+	pthread_mutex_unlock(&_mutex);
+
+	// A `uthread` caller already occupies one of the `kthread`s.
+	long n = end - begin;
+	int num_workers = caller_is_uthread ? _max_num_kthreads : _max_num_kthreads + 1;
+	if (job->grain <= 0) {
+		job->grain = n / (num_workers * PARALLEL_CHUNKS_PER_WORKER);
+		job->grain = (job->grain > 0) ? job->grain : 1;
+	}
+	long num_chunks = (n + job->grain - 1) / job->grain;
+	num_workers = (num_chunks < num_workers) ? num_chunks : num_workers;
+
+	job->num_workers = num_workers;
+	job->workers = aligned_alloc(CACHE_LINE_SIZE, num_workers * sizeof(parallel_worker_t));
+	assert(job->workers != NULL);
+
+	// Split the range evenly (in whole chunks) between the workers. Afterwards,
+	// idle workers recursively split the remaining ranges of the others.
+	for (int w = 0; w < num_workers; w++) {
+		parallel_worker_t* worker = job->workers + w;
+		worker->lock = 0;
+		worker->lo = begin + (num_chunks * w / num_workers) * job->grain;
+		worker->hi = begin + (num_chunks * (w + 1) / num_workers) * job->grain;
+		worker->hi = (worker->hi < end) ? worker->hi : end;
+		worker->job = job;
+		worker->partial = (job->partials != NULL) ? job->partials + w * job->partial_stride : NULL;
+	}
 
-	// Try using clone instead:
-	void *child_stack;
-	child_stack = kt->stack;
-	child_stack += CLONE_STACK_SIZE - 1;
-	int pid = clone(kthread_runner, child_stack, CLONE_VM|CLONE_FILES, kt);
-	assert(pid > 0);
-	return pid;
+	job->num_running_helpers = num_workers - 1;
+	for (int w = 1; w < num_workers; w++) {
+		if (uthread_create_arg(parallel_helper, job->workers + w) != 0) {
+			__atomic_fetch_sub(&(job->num_running_helpers), 1, __ATOMIC_RELEASE);
+		}
+	}
+
+	// The caller is worker 0. Once there is nothing left to claim or steal, it
+	// waits for the helpers, which may still be running their last chunks.
+	parallel_work(job->workers);
+	int num_running;
+	while ((num_running = __atomic_load_n(&(job->num_running_helpers), __ATOMIC_ACQUIRE)) > 0) {
+		uthread_wait(&(job->num_running_helpers), num_running, NULL);
+	}
 }
 
 
 
 /**
- * Updates the time info in both the given `kthread` and the given `uthread`
- * by transfering the time which has elapsed since the timestamps of `kthread`
- * were updated to the running time of `uthread`.
- *
- * This means that the `kthread` will be updated with new timestamps and that
- * any time which has elapsed since the last timestamps will be added to the
- * running time of the given `uthread`. Both the elapsed `utime` and the elapsed
- * `stime` are added.
- *
- * Note that the given `kt` is assumed to be the the same as would be returned
- * by `kthread_self()`.
+ * The function run by each helper `uthread` of a parallel job.
  */
-void transfer_elapsed_time(kthread_t* kt, uthread_t* ut)
+void parallel_helper(void* worker)
 {
-	assert(kt == kthread_self());
+	parallel_worker_t* self = worker;
+	parallel_job_t* job = self->job;
+	parallel_work(self);
+	if (__atomic_sub_fetch(&(job->num_running_helpers), 1, __ATOMIC_RELEASE) == 0) {
+		uthread_wake(&(job->num_running_helpers), 1);
+	}
+	uthread_exit();
+}
 
-	struct timeval tv;
-	struct timeval prev_utime_timestamp = kt->utime_timestamp;
-	struct timeval prev_stime_timestamp = kt->stime_timestamp;
 
-	kthread_update_timestamps(kt);
 
-	// Add the change to `utime` to `running_time`.
-	timersub(&(kt->utime_timestamp), &(prev_utime_timestamp), &tv);
-	timeradd(&(ut->running_time), &tv, &(ut->running_time));
+/**
+ * Claims and runs chunks of the given worker's own range, and steals from the
+ * other workers when it runs out, until there is no work left to steal.
+ */
+void parallel_work(parallel_worker_t* self)
+{
+	parallel_job_t* job = self->job;
+	do {
+		while (true) {
+			spin_lock(&(self->lock));
+			long chunk_begin = self->lo;
+			long chunk_end = (self->hi - self->lo > job->grain) ? self->lo + job->grain : self->hi;
+			self->lo = chunk_end;
+			spin_unlock(&(self->lock));
+
+			if (chunk_begin == chunk_end) {
+				break;
+			}
+			if (job->reduce_body != NULL) {
+				job->reduce_body(chunk_begin, chunk_end, self->partial, job->ctx);
+			} else {
+				job->for_body(chunk_begin, chunk_end, job->ctx);
+			}
+		}
+	} while (parallel_steal(self));
+}
 
-	// Add the change to `stime` to `running_time`.
-	timersub(&(kt->stime_timestamp), &(prev_stime_timestamp), &tv);
-	timeradd(&(ut->running_time), &tv, &(ut->running_time));
+
+
+/**
+ * Moves the upper half (in whole chunks) of the largest remaining range of any
+ * other worker into the given worker's (empty) range. Returns false if there
+ * was nothing to steal.
+ */
+bool parallel_steal(parallel_worker_t* self)
+{
+	parallel_job_t* job = self->job;
+
+	while (true) {
+		// Choose the victim with the most unclaimed work.
+		parallel_worker_t* victim = NULL;
+		long most = 0;
+		for (int w = 0; w < job->num_workers; w++) {
+			parallel_worker_t* worker = job->workers + w;
+			long remaining = __atomic_load_n(&(worker->hi), __ATOMIC_RELAXED)
+			               - __atomic_load_n(&(worker->lo), __ATOMIC_RELAXED);
+			if (worker != self && remaining > most) {
+				victim = worker;
+				most = remaining;
+			}
+		}
+		if (victim == NULL) {
+			return false;
+		}
+
+		spin_lock(&(victim->lock));
+		long remaining = victim->hi - victim->lo;
+		if (remaining <= 0) {
+			spin_unlock(&(victim->lock));
+			continue;  // Someone else got there first; look again.
+		}
+		long num_chunks = (remaining + job->grain - 1) / job->grain;
+		long stolen_lo = victim->lo + (num_chunks / 2) * job->grain;
+		long stolen_hi = victim->hi;
+		victim->hi = stolen_lo;
+		spin_unlock(&(victim->lock));
+
+		spin_lock(&(self->lock));
+		self->lo = stolen_lo;
+		self->hi = stolen_hi;
+		spin_unlock(&(self->lock));
+		return true;
+	}
 }
 
 
 
-/* Define minor helper functions. ************************************************/
+/* Define RCU helper functions. **************************************************/
 
 /**
- * Initializes the given memory as a `kthread`. Aquires any resources necessary.
+ * Reports that the given `kthread`, which must be the caller's, is in a
+ * quiescent state: the `uthread`s which it ran before now hold no references.
+ * This is also how a `kthread` comes back from being offline, so the fence
+ * keeps the loads of whatever it runs next from being done before the report.
  */
-void kthread_init(kthread_t* kt) {
-	kt->running = NULL;
-	kt->stack = (void *)malloc(CLONE_STACK_SIZE);
+void kthread_rcu_quiescent(kthread_t* kt)
+{
+	unsigned long gp = __atomic_load_n(&_rcu_gp, __ATOMIC_RELAXED);
+	__atomic_store_n(&(kt->rcu_gp), gp, __ATOMIC_RELEASE);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
 }
 
 
 
 /**
- * Frees any resources used by the given `kthread`.
+ * Takes the given `kthread`, which must be the caller's (and must not be
+ * running a `uthread`), out of consideration for grace periods, until its next
+ * `kthread_rcu_quiescent()`.
  */
-void kthread_destroy(kthread_t* kt) {
-	free(kt->stack);
+void kthread_rcu_offline(kthread_t* kt)
+{
+	__atomic_store_n(&(kt->rcu_gp), RCU_OFFLINE, __ATOMIC_RELEASE);
 }
 
 
 
 /**
- * Returns a pointer to an unused slot in `_kthreads` (i.e. a `kthread_t*` which
- * points to a `kthread_t` that is not running).
- *
- * If no such `kthread_t` slot exists (i.e. if `_num_kthread == _max_num_kthread`),
- * then `NULL` is returned.
+ * Starts a new grace period, and waits until every `kthread` has been in a
+ * quiescent state since (or offline). The caller's own `kthread`, if it is
+ * one, already is, since the caller is not a reader. A `uthread` is parked
+ * between checks, and other threads sleep; either way, the checks back off
+ * from `RCU_POLL_MIN_NS` to `RCU_POLL_MAX_NS` apart.
  */
-kthread_t* find_inactive_kthread()
+void rcu_wait_for_readers()
 {
-	kthread_t* kthread = NULL;
-	for (int idx = 0; idx < _max_num_kthreads; idx++) {
-		if (_kthreads[idx].running == NULL) {
-			kthread = _kthreads + idx;
-			break;
+	kthread_t* self = kthread_self();
+	unsigned long gp = __atomic_add_fetch(&_rcu_gp, 1, __ATOMIC_SEQ_CST);
+	long poll_ns = RCU_POLL_MIN_NS;
+	int never_woken = 0;
+
+	for (kthread_t* kt = _kthreads; kt < _kthreads + _num_kthread_slots; kt++) {
+		while (kt != self && __atomic_load_n(&(kt->rcu_gp), __ATOMIC_ACQUIRE) < gp) {
+			struct timespec timeout = { 0, poll_ns };
+			if (self != NULL) {
+				uthread_wait(&never_woken, 0, &timeout);
+			} else {
+				nanosleep(&timeout, NULL);
+			}
+			poll_ns = (poll_ns * 2 > RCU_POLL_MAX_NS) ? RCU_POLL_MAX_NS : poll_ns * 2;
 		}
 	}
-	return kthread;
+
+	// Pairs with the fence in `kthread_rcu_quiescent()`.
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+
+
+/**
+ * The body of the thread which runs the callbacks of `uthread_call_rcu()`.
+ * Once a callback is pending, it waits `RCU_BATCH_PERIOD_NS` (or until
+ * `RCU_BATCH_SIZE` are pending) for more, and then waits for one grace period
+ * for the whole batch, and runs them in the order that they were deferred.
+ * It runs whatever is still pending before it stops.
+ */
+void* rcu_runner(void* ignored)
+{
+	const struct timespec period = { 0, RCU_BATCH_PERIOD_NS };
+
+	while (true)
+	{
+		int seq = __atomic_load_n(&_rcu_futex, __ATOMIC_ACQUIRE);
+		bool stopping = __atomic_load_n(&_rcu_stopping, __ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&_rcu_pending, __ATOMIC_ACQUIRE) == NULL) {
+			if (stopping) {
+				break;
+			}
+			futex(&_rcu_futex, FUTEX_WAIT, seq);
+			continue;
+		}
+		if (!stopping && __atomic_load_n(&_rcu_num_pending, __ATOMIC_RELAXED) < RCU_BATCH_SIZE) {
+			futex_timed(&_rcu_futex, FUTEX_WAIT, seq, &period);
+		}
+
+		// Take the batch, reversing it into the order that it was deferred in.
+		uthread_rcu_head_t* head = __atomic_exchange_n(&_rcu_pending, NULL, __ATOMIC_ACQUIRE);
+		uthread_rcu_head_t* batch = NULL;
+		int num_taken = 0;
+		while (head != NULL) {
+			uthread_rcu_head_t* next = head->next;
+			head->next = batch;
+			batch = head;
+			head = next;
+			num_taken++;
+		}
+		__atomic_sub_fetch(&_rcu_num_pending, num_taken, __ATOMIC_RELAXED);
+
+		rcu_wait_for_readers();
+		while (batch != NULL) {
+			uthread_rcu_head_t* next = batch->next;
+			batch->func(batch);
+			batch = next;
+		}
+	}
+
+	return ignored;
 }
 
 
 
+/* Define arena helper functions. ************************************************/
+
 /**
- * Saves the current `rusage` information of the calling thread to the given memory
- * location.
+ * Allocates `size` bytes (a multiple of `ARENA_ALIGN`) for the given `uthread`
+ * stack header's arena, which has too little room left in its current chunk.
+ * A big allocation gets a chunk of its own, and leaves the current chunk to be
+ * bump-allocated from. Otherwise, a new chunk is taken from the cache of the
+ * calling `kthread` (which is the only one that touches it), or allocated.
+ * Returns `NULL`, leaving the arena as it was, if the allocation fails.
  */
-void get_thread_rusage(struct rusage* rv)
+void* arena_alloc_slow(stack_header_t* header, size_t size)
 {
-	const int RUSAGE_THREAD = 1;   // TODO: Fix this hack!
-	getrusage(RUSAGE_THREAD, rv);  // Thread-specific rusage only available on linux.
+	arena_chunk_t* chunk;
+	if (size > (ARENA_CHUNK_SIZE - sizeof(arena_chunk_t)) / 4) {
+		chunk = malloc(sizeof(arena_chunk_t) + size);
+		if (chunk == NULL) {
+			return NULL;
+		}
+		chunk->size = sizeof(arena_chunk_t) + size;
+		chunk->next = header->arena;
+		header->arena = chunk;
+		return chunk + 1;
+	}
+
+	kthread_t* kt = _kthreads + header->uthread->home;
+	if (kt->arena_cache != NULL) {
+		chunk = kt->arena_cache;
+		kt->arena_cache = chunk->next;
+		kt->arena_cache_len--;
+	} else {
+		chunk = aligned_alloc(ARENA_ALIGN, ARENA_CHUNK_SIZE);
+		if (chunk == NULL) {
+			return NULL;
+		}
+		chunk->size = ARENA_CHUNK_SIZE;
+	}
+	chunk->next = header->arena;
+	header->arena = chunk;
+	header->arena_next = (char*) (chunk + 1) + size;
+	header->arena_end = (char*) chunk + ARENA_CHUNK_SIZE;
+	return chunk + 1;
 }
 
 
 
-void kthread_update_timestamps(kthread_t* kt)
+/**
+ * Empties the arena of the given `uthread` stack header. Its chunks go to the
+ * cache of the given `kthread` (which must be the caller's), up to
+ * `ARENA_CACHE_MAX` chunks, and the rest are freed. If `kt` is `NULL`, they
+ * are all freed.
+ */
+void arena_recycle(kthread_t* kt, stack_header_t* header)
 {
-	struct rusage ru;
-	get_thread_rusage(&ru);
-	kt->utime_timestamp = ru.ru_utime;
-	kt->stime_timestamp = ru.ru_stime;
+	arena_chunk_t* chunk = header->arena;
+	while (chunk != NULL) {
+		arena_chunk_t* next = chunk->next;
+		if (kt != NULL && chunk->size == ARENA_CHUNK_SIZE && kt->arena_cache_len < ARENA_CACHE_MAX) {
+			chunk->next = kt->arena_cache;
+			kt->arena_cache = chunk;
+			kt->arena_cache_len++;
+		} else {
+			free(chunk);
+		}
+		chunk = next;
+	}
+	header->arena = NULL;
+	header->arena_next = NULL;
+	header->arena_end = NULL;
 }
 
 
 
+/* Define wait-on-address helper functions. **************************************/
+
 /**
- * Interprets `key1` and `key2` as pointers to `uthread_t` objects, and
- * compares them. The comparison is based on the running time of the two records.
- * In particular, given the two records, the record with the smaller running time will
- * have the greater priority.
+ * Returns the bucket of `_wait_table` for the given address.
  */
-int uthread_priority(const void* key1, const void* key2)
+wait_bucket_t* wait_bucket(const volatile int* addr)
 {
-	const struct timeval tv1 = ((const uthread_t*) key1)->running_time;
-	const struct timeval tv2 = ((const uthread_t*) key2)->running_time;
+	uintptr_t hash = (uintptr_t) addr;
+	hash ^= hash >> 17;
+	hash *= 0x9e3779b97f4a7c15ULL;
+	return _wait_table + ((hash >> 32) & (WAIT_TABLE_SIZE - 1));
+}
 
-	if (timercmp(&tv1, &tv2, <))
-		return 1;
-	if (timercmp(&tv1, &tv2, ==))
-		return 0;
-	if (timercmp(&tv1, &tv2, >))
-		return -1;
 
-	assert(false);  // All possibilities should be covered by the conditions above.
+
+/**
+ * Unlinks the given waiter from the given bucket. The bucket must be locked.
+ */
+void wait_bucket_remove(wait_bucket_t* bucket, waiter_t* w)
+{
+	if (w->prev != NULL) {
+		w->prev->next = w->next;
+	} else {
+		bucket->head = w->next;
+	}
+	if (w->next != NULL) {
+		w->next->prev = w->prev;
+	} else {
+		bucket->tail = w->prev;
+	}
 }
 
 
 
 /**
- * This interprets the given pointer as a pointer to a `uthread_t`, then prints out
- * some information about the `uthread_t` stored there.
+ * Unlinks the given waiter from `_timed_waiters`. `_mutex` must be held.
+ */
+void timed_waiters_remove(waiter_t* w)
+{
+	if (w->timed_prev != NULL) {
+		w->timed_prev->timed_next = w->timed_next;
+	} else {
+		_timed_waiters = w->timed_next;
+	}
+	if (w->timed_next != NULL) {
+		w->timed_next->timed_prev = w->timed_prev;
+	}
+}
+
+
+
+/**
+ * Makes ready every parked `uthread` whose deadline has passed, unless it has
+ * already been claimed by a waker. `_mutex` must be held.
  *
- * This function is meant to be used for debugging uses only, in particular, with
- * the `HEAPprint()` function to print out the contents of `_waiting_uthreads`.
+ * The bucket locks cannot be taken here (they are taken before `_mutex`), so
+ * each timed-out waiter is left in its bucket and removes itself once it runs.
  */
-void uthread_print(const void* key)
+void expire_timed_waiters()
 {
-	const uthread_t* ut = key;
-	const struct timeval running_time = ut->running_time;
-	printf("uthread %p: running_time = %d.%06d\n",
-			ut, running_time.tv_sec, running_time.tv_usec);
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	waiter_t* w = _timed_waiters;
+	while (w != NULL) {
+		waiter_t* next = w->timed_next;
+		bool expired = (w->deadline.tv_sec < now.tv_sec)
+		    || (w->deadline.tv_sec == now.tv_sec && w->deadline.tv_nsec <= now.tv_nsec);
+		if (expired && __sync_bool_compare_and_swap(&(w->state), WAITER_PARKED, WAITER_TIMED_OUT)) {
+			timed_waiters_remove(w);
+			uthread_make_ready(w->uthread);
+		}
+		w = next;
+	}
 }
 
 
 
 /**
- * Returns true if and only if there is a `uthread` in `_waiting_uthreads` whose
- * priority is higher than the the priority of the given `uthread`.
+ * Implements `uthread_wait()` for a thread which is not a `uthread`, by
+ * blocking the whole thread in the kernel.
  */
-bool waiting_uthread_has_priority_over(uthread_t* ut)
+int thread_wait(const volatile int* addr, int expected, const struct timespec* timeout)
 {
-	if (HEAPsize(_waiting_uthreads) > 0) {
-		const uthread_t* highest_priority_waiting = HEAPpeek(_waiting_uthreads);
-		return uthread_priority(ut, highest_priority_waiting) < 0;
+	wait_bucket_t* bucket = wait_bucket(addr);
+	__atomic_fetch_add(&(bucket->num_thread_waiters), 1, __ATOMIC_SEQ_CST);
+	int rv = futex_timed(addr, FUTEX_WAIT, expected, timeout);
+	int err = errno;
+	__atomic_fetch_sub(&(bucket->num_thread_waiters), 1, __ATOMIC_SEQ_CST);
+
+	if (rv == 0) {
+		return UTHREAD_WAIT_WOKEN;
+	} else if (err == ETIMEDOUT) {
+		return UTHREAD_WAIT_TIMED_OUT;
+	} else if (err == EAGAIN) {
+		return UTHREAD_WAIT_CHANGED;
 	} else {
+		return UTHREAD_WAIT_WOKEN;  // Interrupted: a spurious wake-up.
+	}
+}
+
+
+
+/* Define blocking-call helper functions. ****************************************/
+
+/**
+ * The body of each thread in the blocking-call pool. It runs queued calls in
+ * FIFO order, and wakes each caller once its call returns.
+ */
+void* blocking_pool_runner(void* ignored)
+{
+	spin_lock(&_blocking_lock);
+	while (true)
+	{
+		if (_blocking_head == NULL) {
+			if (_shutdown) {
+				break;
+			}
+			int seq = _blocking_futex;
+			_num_idle_blocking_threads++;
+			spin_unlock(&_blocking_lock);
+			futex(&_blocking_futex, FUTEX_WAIT, seq);
+			spin_lock(&_blocking_lock);
+			_num_idle_blocking_threads--;
+			continue;
+		}
+
+		blocking_call_t* call = _blocking_head;
+		_blocking_head = call->next;
+		if (_blocking_head == NULL) {
+			_blocking_tail = NULL;
+		}
+		spin_unlock(&_blocking_lock);
+
+		errno = 0;
+		call->result = call->func(call->arg);
+		call->error = errno;
+		__atomic_store_n(&(call->done), 1, __ATOMIC_RELEASE);
+		uthread_wake(&(call->done), 1);
+
+		spin_lock(&_blocking_lock);
+	}
+	spin_unlock(&_blocking_lock);
+
+	return ignored;
+}
+
+
+
+/**
+ * Runs the given system call on the blocking-call pool, and returns its result
+ * as `syscall()` would.
+ */
+long blocking_syscall(long number, long arg0, long arg1, long arg2, long arg3)
+{
+	blocking_syscall_t call = {
+		.number = number,
+		.args = { arg0, arg1, arg2, arg3 },
+	};
+	return (long) uthread_blocking(blocking_syscall_run, &call);
+}
+
+
+
+/**
+ * Runs a `blocking_syscall_t` (on the blocking-call pool).
+ */
+void* blocking_syscall_run(void* call)
+{
+	blocking_syscall_t* sc = call;
+	return (void*) syscall(sc->number, sc->args[0], sc->args[1], sc->args[2], sc->args[3]);
+}
+
+
+
+/**
+ * Runs a `blocking_getaddrinfo_t` (on the blocking-call pool).
+ */
+void* blocking_getaddrinfo_run(void* call)
+{
+	blocking_getaddrinfo_t* gai = call;
+	return (void*) (intptr_t) getaddrinfo(gai->node, gai->service, gai->hints, gai->res);
+}
+
+
+
+/**
+ * The body of the monitor thread. Every `MONITOR_PERIOD_NS`, it looks for
+ * `kthread`s which have been running the same `uthread` since the last check,
+ * but are sleeping in the kernel, i.e. which are stuck in a blocking system
+ * call that did not go through `uthread_blocking()`. Each one is temporarily
+ * replaced with a new `kthread`, so that ready `uthread`s keep running on as
+ * many `kthread`s as usual.
+ */
+void* monitor_runner(void* ignored)
+{
+	const struct timespec period = { 0, MONITOR_PERIOD_NS };
+	int* tids = malloc(_num_kthread_slots * sizeof(int));
+	assert(tids != NULL);
+
+	while (_monitor_futex == 0)
+	{
+		futex_timed(&_monitor_futex, FUTEX_WAIT, 0, &period);
+
+		// Pick out the `kthread`s which have not entered the scheduler since the last check.
+		pthread_mutex_lock(&_mutex);
+		for (int idx = 0; idx < _num_kthread_slots; idx++) {
+			kthread_t* kt = _kthreads + idx;
+			bool has_scheduled = (kt->num_schedules != kt->monitor_num_schedules);
+			tids[idx] = (kt->running != NULL && !has_scheduled) ? kt->tid : 0;
+			kt->monitor_num_schedules = kt->num_schedules;
+		}
+		pthread_mutex_unlock(&_mutex);
+
+		// Look up their states without `_mutex`, so that `kthread`s waiting
+		// for it are not held up.
+		for (int idx = 0; idx < _num_kthread_slots; idx++) {
+			if (tids[idx] != 0 && !thread_is_blocked(tids[idx])) {
+				tids[idx] = 0;
+			}
+		}
+
+		pthread_mutex_lock(&_mutex);
+		for (int idx = 0; idx < _num_kthread_slots; idx++) {
+			kthread_t* kt = _kthreads + idx;
+			bool is_stuck = (tids[idx] != 0 && tids[idx] == kt->tid && kt->running != NULL
+			                 && kt->num_schedules == kt->monitor_num_schedules);
+			if (is_stuck && !kt->is_blocked) {
+				kt->is_blocked = true;
+				_num_blocked_kthreads++;
+			} else if (!is_stuck && kt->is_blocked) {
+				kt->is_blocked = false;
+				_num_blocked_kthreads--;
+			}
+		}
+		kthread_replace_blocked();
+		pthread_mutex_unlock(&_mutex);
+	}
+
+	free(tids);
+	return ignored;
+}
+
+
+
+/**
+ * Returns whether the thread with the given ID is sleeping in a system call,
+ * according to `/proc`. Waiting for `_mutex` does not count.
+ */
+bool thread_is_blocked(int tid)
+{
+	char path[64];
+	char buf[512];
+
+	// The state follows the command name, which is in parentheses.
+	snprintf(path, sizeof(path), "/proc/self/task/%d/stat", tid);
+	if (read_file(path, buf, sizeof(buf)) <= 0) {
+		return false;
+	}
+	char* end_of_comm = strrchr(buf, ')');
+	if (end_of_comm == NULL || end_of_comm[1] == '\0') {
+		return false;
+	}
+	char state = end_of_comm[2];
+	if (state != 'S' && state != 'D') {
+		return false;
+	}
+
+	// The system call number and its arguments (or "running").
+	snprintf(path, sizeof(path), "/proc/self/task/%d/syscall", tid);
+	if (read_file(path, buf, sizeof(buf)) <= 0) {
 		return false;
 	}
+	long number;
+	unsigned long arg0;
+	if (sscanf(buf, "%ld %lx", &number, &arg0) != 2) {
+		return false;
+	}
+	return !(number == SYS_futex && arg0 == (uintptr_t) &_mutex);
+}
+
+
+
+/**
+ * Reads up to `size - 1` bytes of the given file into `buf`, and terminates
+ * them. Returns the number of bytes read, or -1.
+ */
+ssize_t read_file(const char* path, char* buf, size_t size)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		return -1;
+	}
+	ssize_t len = read(fd, buf, size - 1);
+	close(fd);
+	if (len >= 0) {
+		buf[len] = '\0';
+	}
+	return len;
+}
+
+
+
+/**
+ * Starts new `kthread`s for waiting `uthread`s, while there are fewer running
+ * than the maximum plus the number of blocked `kthread`s. `_mutex` must be held.
+ */
+void kthread_replace_blocked()
+{
+	while (_num_idle_kthreads == 0
+	       && _num_kthreads < _max_num_kthreads + _num_blocked_kthreads
+	       && _num_waiting_uthreads + _num_continuations
+	          + __atomic_load_n(&_num_inbox_uthreads, __ATOMIC_RELAXED) > 0)
+	{
+		kthread_t* kthread = find_inactive_kthread();
+		if (kthread == NULL) {
+			break;
+		}
+
+		uthread_t* ut = kthread_next_uthread(kthread);
+		if (ut == NULL) {
+			break;
+		}
+		kthread_create(kthread, ut);
+		_num_kthreads += 1;
+	}
+}
+
+
+
+/* Define context-switch helper functions. ***************************************/
+
+/**
+ * Saves the callee-saved registers of the calling context on its stack, stores
+ * its stack pointer in `*save_sp`, and then resumes the context whose stack
+ * pointer is `load_sp` (which was saved the same way). Other architectures
+ * fall back to `swapcontext()`, which is much slower, since it also saves the
+ * signal mask (with a system call); there, the saved "stack pointer" is that
+ * of a `ucontext_t` in the saved context's own frame.
+ */
+#if defined(__x86_64__)
+__asm__(
+	".text\n"
+	".globl uthread_context_switch\n"
+	".type uthread_context_switch, @function\n"
+	"uthread_context_switch:\n"
+	"	pushq %rbp\n"
+	"	pushq %rbx\n"
+	"	pushq %r12\n"
+	"	pushq %r13\n"
+	"	pushq %r14\n"
+	"	pushq %r15\n"
+	"	movq %rsp, (%rdi)\n"
+	"	movq %rsi, %rsp\n"
+	"	popq %r15\n"
+	"	popq %r14\n"
+	"	popq %r13\n"
+	"	popq %r12\n"
+	"	popq %rbx\n"
+	"	popq %rbp\n"
+	"	ret\n"
+	".size uthread_context_switch, .-uthread_context_switch\n"
+);
+#else
+void uthread_context_switch(void** save_sp, void* load_sp)
+{
+	ucontext_t ctx;
+	*save_sp = &ctx;
+	swapcontext(&ctx, load_sp);
+}
+#endif
+
+
+
+/**
+ * Saves the FP control words of the calling (running) `uthread` in its stack
+ * header if they are not the defaults, and returns whether they were saved.
+ * Without x86-64, only the rounding mode is saved.
+ */
+bool uthread_save_fp_env(uthread_t* ut)
+{
+#if defined(__x86_64__)
+	unsigned int mxcsr;
+	unsigned short fpu_cw;
+	__asm__ volatile ("stmxcsr %0" : "=m" (mxcsr));
+	__asm__ volatile ("fnstcw %0" : "=m" (fpu_cw));
+
+	ut->has_fp_env = ((mxcsr & ~MXCSR_FLAGS) != DEFAULT_MXCSR || fpu_cw != DEFAULT_FPU_CW);
+	if (ut->has_fp_env) {
+		uthread_header(ut)->mxcsr = mxcsr;
+		uthread_header(ut)->fpu_cw = fpu_cw;
+	}
+#else
+	int rounding = fegetround();
+	ut->has_fp_env = (rounding != FE_TONEAREST);
+	if (ut->has_fp_env) {
+		uthread_header(ut)->fp_rounding = rounding;
+	}
+#endif
+	return ut->has_fp_env;
+}
+
+
+
+/**
+ * Loads the FP control words saved in the given stack header (see
+ * `uthread_save_fp_env()`) into the calling thread, or the defaults if it is
+ * `NULL`.
+ */
+void uthread_load_fp_env(const stack_header_t* header)
+{
+#if defined(__x86_64__)
+	unsigned int mxcsr = (header != NULL) ? header->mxcsr : DEFAULT_MXCSR;
+	unsigned short fpu_cw = (header != NULL) ? header->fpu_cw : DEFAULT_FPU_CW;
+	__asm__ volatile ("ldmxcsr %0" : : "m" (mxcsr));
+	__asm__ volatile ("fldcw %0" : : "m" (fpu_cw));
+#else
+	fesetround((header != NULL) ? header->fp_rounding : FE_TONEAREST);
+#endif
 }
@@ -1,6 +1,15 @@
 #ifndef _UTHREAD_H
 #define _UTHREAD_H
 
+#include <stdio.h>
+#include <stddef.h>
+#include <time.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 /**
  * A poorly-named alias for `uthread_system_init()`. (See the documentation for
  * that function.)
@@ -12,6 +21,11 @@ void system_init(int max_number_of_klt);
  * Initializes the `uthread` system. This can only be called once during an
  * executable's lifetime. The system will only make a number of kthreads up to
  * the given maximum.
+ *
+ * Each `kthread` is a thread of its own, with its own thread-local storage
+ * (such as `errno`). A `uthread` sees that of whichever `kthread` is running
+ * it, which may change whenever it yields, waits, or blocks, so it must not
+ * keep the address of a thread-local variable across those.
  */
 void uthread_system_init(int max_num_kthreads);
 
@@ -29,6 +43,58 @@ void uthread_system_init(int max_num_kthreads);
 int uthread_create(void (*func)());
 
 
+/**
+ * This is like `uthread_create()`, except that the new `uthread` runs
+ * `func(arg)`. If `func()` returns, the `uthread` exits as if it had called
+ * `uthread_exit()`.
+ */
+int uthread_create_arg(void (*func)(void*), void* arg);
+
+
+/**
+ * This is like `uthread_create_arg()`, except that the new `uthread` runs
+ * first: the calling `uthread` switches straight to it, and is left for its
+ * `kthread` to resume once the new `uthread` exits or parks. Meanwhile, an
+ * idle `kthread` may steal the caller and resume it first. (A `uthread_yield()`
+ * by the new `uthread` does not resume the caller.)
+ *
+ * This suits divide-and-conquer code, which spawns many `uthread`s that each
+ * spawn more: a `kthread` works depth-first down the tree of spawns, and only
+ * holds the callers along its current path, rather than a queue of every
+ * `uthread` which has been spawned but not yet run. Idle `kthread`s steal the
+ * caller nearest the root, which has the most work left to spawn.
+ *
+ * When it is not called by a `uthread`, this is just `uthread_create_arg()`.
+ */
+int uthread_spawn(void (*func)(void*), void* arg);
+
+
+/**
+ * The most bytes which `uthread_prepare_arg()` can reserve.
+ */
+#define UTHREAD_INLINE_ARG_MAX  256
+
+
+/**
+ * This makes a `uthread` like `uthread_create_arg()`, but in two steps, so that
+ * the argument can be stored in the new `uthread`'s own stack rather than in a
+ * separate allocation. This reserves `size` bytes (at most
+ * `UTHREAD_INLINE_ARG_MAX`) at the top of the new `uthread`'s stack, and
+ * returns a pointer to them, aligned to a cache line. The caller fills them in
+ * and then passes the pointer to `uthread_start_prepared()`, which schedules
+ * the `uthread` to run `func(arg)`. The bytes are freed with the stack when the
+ * `uthread` exits. (`uthread.hpp` uses this to store C++ closures.)
+ */
+void* uthread_prepare_arg(void (*func)(void*), size_t size);
+
+
+/**
+ * Schedules the `uthread` prepared by `uthread_prepare_arg()`, given the
+ * pointer which it returned. Returns like `uthread_create()`.
+ */
+int uthread_start_prepared(void* arg);
+
+
 /**
  * This is the key to cooperative threading in the system. It must only be
  * called by threads created with `uthread_create(). By calling this, a
@@ -55,4 +121,432 @@ void uthread_yield();
  */
 void uthread_exit();
 
+/**
+ * This is like `uthread_exit()` called by a thread which is not a `kthread`
+ * (e.g. the main thread), except that instead of just blocking until all
+ * `uthread`s have exited, the calling thread joins the system as one of its
+ * `kthread`s, and runs `uthread`s until none remain. It counts towards the
+ * maximum number of `kthread`s, so `kthread`s beyond that stop as soon as they
+ * are between `uthread`s. Then it shuts the system down and returns.
+ */
+void uthread_run_main();
+
+
+/**
+ * A handle on a `uthread`, which is only valid until the `uthread` exits.
+ */
+typedef struct uthread_control_block* uthread_handle_t;
+
+
+/**
+ * Returns a handle on the calling `uthread`, or `NULL` if the caller is not a
+ * `uthread`.
+ */
+uthread_handle_t uthread_self();
+
+
+/**
+ * The number of `kthread`s which an affinity mask can name.
+ */
+#define UTHREAD_AFFINITY_BITS   64
+
+
+/**
+ * Hints that the given `uthread` should only run on the `kthread`s in
+ * `kthread_mask`, where bit `i` stands for the `i`-th of the (at most
+ * `max_num_kthreads`) `kthread`s. A mask of zero (the default) allows every
+ * `kthread`. It takes effect the next time that the `uthread` is switched to
+ * or from. The mask is a hint: the `uthread` runs on other `kthread`s when
+ * none of those in its mask are running, and `kthread`s which stand in for
+ * blocked ones (see `uthread_blocking()`) may run any `uthread`.
+ *
+ * Returns -1 (and changes nothing) if the mask names none of the `kthread`s,
+ * or 0 otherwise.
+ */
+int uthread_set_affinity(uthread_handle_t handle, unsigned long kthread_mask);
+
+
+/**
+ * Each `kthread` has its own queue of waiting `uthread`s, and a `uthread` which
+ * becomes ready (e.g. after yielding) goes back to the queue of the `kthread`
+ * which last ran it, to keep its working set in that core's cache. It only
+ * migrates to the least-loaded (allowed) `kthread` if its own `kthread`'s
+ * queue holds more than `margin` more `uthread`s than that one's. A `kthread`
+ * with an empty queue steals from the fullest. The default margin is 2.
+ */
+void uthread_set_migration_margin(int margin);
+
+
+/**
+ * A `kthread` with no `uthread` to run first polls for work for a while, and
+ * then parks until it is woken for new work. Each `kthread` adapts how long it
+ * polls between `min_ns` and `max_ns`: longer after polling finds work, shorter
+ * after it does not. Longer spins burn more CPU time but pick up new work with
+ * less latency. A `max_ns` of zero disables spinning. The defaults are 1us and
+ * 50us.
+ */
+void uthread_set_idle_spin(long min_ns, long max_ns);
+
+
+/**
+ * A cheap yield point for long-running loops. It reads the cycle counter, and
+ * only calls `uthread_yield()` once the calling `uthread` has run for its time
+ * slice since it was last switched to (or last yielded here), and only if some
+ * `uthread` is waiting to run. Otherwise, it just returns, which costs little
+ * more than reading the cycle counter. It must only be called by `uthread`s.
+ */
+void uthread_maybe_yield();
+
+
+/**
+ * Sets the time slice which `uthread_maybe_yield()` lets each `uthread` run
+ * for, unless it has its own (see `uthread_set_slice()`). The default is 1ms.
+ */
+void uthread_set_default_slice(long slice_ns);
+
+
+/**
+ * Sets the time slice of the given `uthread` (see `uthread_maybe_yield()`). A
+ * `slice_ns` of zero goes back to the default slice.
+ */
+void uthread_set_slice(uthread_handle_t handle, long slice_ns);
+
+
+/**
+ * The results of `uthread_wait()`.
+ */
+#define UTHREAD_WAIT_WOKEN      0
+#define UTHREAD_WAIT_CHANGED    1
+#define UTHREAD_WAIT_TIMED_OUT  2
+
+
+/**
+ * Parks the calling `uthread` until another thread calls `uthread_wake()` on
+ * `addr`, but only if `*addr` still equals `expected` (which is checked
+ * atomically with respect to `uthread_wake()`). If `timeout` is not `NULL`,
+ * the wait ends after (at least) that long. This is the `uthread` equivalent
+ * of a futex wait, meant for building custom synchronization.
+ *
+ * While parked, the `uthread` does not occupy a `kthread`; the `kthread` runs
+ * other `uthread`s instead. When called by a thread which is not a `uthread`
+ * (e.g. the main thread), this blocks that whole thread instead.
+ *
+ * Returns `UTHREAD_WAIT_WOKEN` once woken, `UTHREAD_WAIT_CHANGED` immediately
+ * if `*addr != expected`, or `UTHREAD_WAIT_TIMED_OUT`. As with futexes, the
+ * caller should re-check the condition it is waiting for in any case.
+ */
+int uthread_wait(const volatile int* addr, int expected, const struct timespec* timeout);
+
+
+/**
+ * Wakes up to `n` of the `uthread`s (or other threads) waiting on `addr` in
+ * `uthread_wait()`, in the order that they started waiting, and returns how
+ * many were woken. Woken `uthread`s are made ready to run: an idle `kthread`
+ * is woken to run one if there is one; otherwise a new `kthread` is only
+ * started if fewer than the maximum number are running.
+ *
+ * The caller must change `*addr` before calling this. Any thread may call this.
+ */
+int uthread_wake(const volatile int* addr, int n);
+
+
+/**
+ * Calls `func(arg)` on one of a small pool of helper threads, and parks the
+ * calling `uthread` until it returns, so that blocking work (file I/O, `fsync()`,
+ * DNS resolution, etc.) never holds up the `uthread`s waiting to run on the
+ * caller's `kthread`. Returns what `func` returned, and sets `errno` to what it
+ * was when `func` returned. When called by a thread which is not a `uthread`,
+ * this just calls `func(arg)`.
+ *
+ * Blocking calls which do not go through this are caught by a monitor, which
+ * temporarily adds a `kthread` to stand in for each one stuck in the kernel.
+ */
+void* uthread_blocking(void* (*func)(void*), void* arg);
+
+
+/**
+ * Versions of the common blocking file system calls (and `getaddrinfo()`),
+ * which run through `uthread_blocking()`. `uthread_open()` always takes a
+ * `mode`, which is ignored unless a file is created.
+ */
+ssize_t uthread_read(int fd, void* buf, size_t count);
+ssize_t uthread_write(int fd, const void* buf, size_t count);
+ssize_t uthread_pread(int fd, void* buf, size_t count, off_t offset);
+ssize_t uthread_pwrite(int fd, const void* buf, size_t count, off_t offset);
+int uthread_open(const char* path, int flags, mode_t mode);
+int uthread_close(int fd);
+int uthread_fsync(int fd);
+int uthread_fdatasync(int fd);
+
+struct addrinfo;
+int uthread_getaddrinfo(const char* node, const char* service,
+                        const struct addrinfo* hints, struct addrinfo** res);
+
+
+/**
+ * Calls `body(chunk_begin, chunk_end, ctx)` over chunks which together cover
+ * the iterations `[begin, end)` exactly once, in parallel, and returns once all
+ * of them are done. Each chunk holds `grain` iterations (except maybe the
+ * last); if `grain` is not positive, one is chosen from the range's size.
+ *
+ * The calling thread runs chunks itself, alongside helper `uthread`s for the
+ * other `kthread`s. The range is initially split evenly between them; a worker
+ * which runs out of chunks steals the upper half of the largest remaining
+ * range, so the split recursively adapts to uneven chunk costs. Claiming a
+ * chunk only takes an uncontended lock of the worker's own range.
+ *
+ * This can be called by a `uthread` (even one inside another parallel loop) or
+ * by a thread which is not a `uthread`, once the system is initialized.
+ */
+void uthread_parallel_for(long begin, long end, long grain,
+                          void (*body)(long begin, long end, void* ctx), void* ctx);
+
+
+/**
+ * This is like `uthread_parallel_for()`, except that each worker accumulates
+ * into its own partial result of `result_size` bytes by calling
+ * `body(chunk_begin, chunk_end, partial, ctx)`. Each partial starts as a copy
+ * of `*result`, which must hold the identity value. Once all iterations are
+ * done, each partial is folded into `*result` by `combine(result, partial, ctx)`.
+ */
+void uthread_parallel_reduce(long begin, long end, long grain,
+                             void* result, size_t result_size,
+                             void (*body)(long begin, long end, void* partial, void* ctx),
+                             void (*combine)(void* result, const void* partial, void* ctx),
+                             void* ctx);
+
+
+/**
+ * Quiescent-state-based RCU, for reclaiming memory which lock-free readers may
+ * still be using. A `kthread` is in a quiescent state (holding no references
+ * to protected data) whenever it enters the scheduler, and while it is idle, so
+ * a grace period ends once every `kthread` has done so.
+ *
+ * A read-side critical section is marked by `uthread_rcu_read_lock()` and
+ * `uthread_rcu_read_unlock()`, which only count the nesting in the calling
+ * `uthread`, with no atomic operations or fences. Only `uthread`s can be
+ * readers, and they must not yield, wait, block in `uthread_blocking()`, or
+ * exit inside one (`uthread_maybe_yield()` does nothing inside one). A reader
+ * which runs for long delays every grace period.
+ */
+void uthread_rcu_read_lock();
+void uthread_rcu_read_unlock();
+
+
+/**
+ * A callback deferred by `uthread_call_rcu()`, usually embedded in the object
+ * which it frees.
+ */
+typedef struct uthread_rcu_head {
+	struct uthread_rcu_head* next;
+	void (*func)(struct uthread_rcu_head* head);
+} uthread_rcu_head_t;
+
+
+/**
+ * Calls `func(head)` once a grace period has passed, i.e. once no reader can
+ * still hold a reference which it took before this call. Callbacks are
+ * batched, so that one grace period serves many, and run on a helper thread
+ * (not a `uthread`). Any thread may call this, without blocking.
+ */
+void uthread_call_rcu(uthread_rcu_head_t* head, void (*func)(uthread_rcu_head_t* head));
+
+
+/**
+ * Waits for a grace period to pass. A `uthread` which calls this is parked
+ * while it waits, and must not be in a read-side critical section. Any thread
+ * may call this once the system is initialized.
+ */
+void uthread_synchronize_rcu();
+
+
+/**
+ * Allocates `size` bytes (aligned to 16) from the calling `uthread`'s arena.
+ * They cannot be freed individually; the whole arena is freed when the
+ * `uthread` exits (after its key destructors, which may still use it). This is
+ * usually just a pointer bump, with no locking. The arena grows by 16KB
+ * chunks, which are recycled through a cache in each `kthread`. Only a
+ * `uthread` can call this. Returns `NULL` if the memory cannot be allocated.
+ */
+void* uthread_arena_alloc(size_t size);
+
+
+/**
+ * The maximum number of keys which can be made with `uthread_key_create()`.
+ * The values of the first few keys are stored inline in each `uthread`; the
+ * others are stored in an array allocated on a `uthread`'s first use of one.
+ */
+#define UTHREAD_KEYS_MAX 64
+
+typedef unsigned int uthread_key_t;
+
+
+/**
+ * Makes a new key for `uthread`-specific data, and stores it in `*key`. Every
+ * `uthread` has its own value for each key, initially `NULL`. Because many
+ * `uthread`s share each `kthread`, `pthread`-specific data cannot be used for
+ * this.
+ *
+ * When a `uthread` calls `uthread_exit()`, the `destructor` (if not `NULL`) is
+ * called with the `uthread`'s value of the key, if that value is not `NULL`.
+ *
+ * Returns 0 on success, or -1 if `UTHREAD_KEYS_MAX` keys already exist.
+ */
+int uthread_key_create(uthread_key_t* key, void (*destructor)(void*));
+
+
+/**
+ * Deletes a key made by `uthread_key_create()`, so that it can be reused by a
+ * later `uthread_key_create()`. Like `pthread_key_delete()`, this does not call
+ * the key's destructor: every `uthread`'s value for the key is just dropped,
+ * and a key which reuses it starts out `NULL` in every `uthread`. Returns 0 on
+ * success, or -1 if the key does not exist.
+ */
+int uthread_key_delete(uthread_key_t key);
+
+
+/**
+ * Returns the calling `uthread`'s value for the given key. This is only a few
+ * loads from the calling `uthread`'s own memory, without any locking, so it
+ * must only be called by `uthread`s.
+ */
+void* uthread_getspecific(uthread_key_t key);
+
+
+/**
+ * Sets the calling `uthread`'s value for the given key. This must only be
+ * called by `uthread`s. Returns 0 on success, or -1 if memory for the value
+ * could not be allocated.
+ */
+int uthread_setspecific(uthread_key_t key, const void* value);
+
+
+/**
+ * Starts the sampling profiler. Every `kthread` (including ones started later)
+ * is interrupted with `SIGPROF` about `frequency` times per second of CPU time
+ * which it consumes. Each sample records the id of the `uthread` running on the
+ * `kthread` and its call stack, found by walking frame pointers. (So build with
+ * `-fno-omit-frame-pointer` when optimizing, and link with `-rdynamic` to get
+ * function names.)
+ *
+ * The system must have been initialized. Returns 0 on success, or -1 if the
+ * profiler could not be started (e.g. if it is already running).
+ */
+int uthread_profiler_start(int frequency);
+
+
+/**
+ * Stops the sampling profiler. Samples are kept until the profiler is started
+ * again.
+ */
+void uthread_profiler_stop();
+
+
+/**
+ * Writes the samples taken by the (stopped) profiler to `out` as folded stacks,
+ * i.e. one line per distinct stack, in the format read by `flamegraph.pl`:
+ *
+ *     uthread-7;main_loop;handle_request;parse 42
+ *
+ * The root frame names the `uthread` which was running (or `kthread` if the
+ * `kthread` was between `uthread`s), and the count is the number of samples.
+ *
+ * The profiler is stopped implicitly when the main thread's `uthread_exit()`
+ * returns, and the samples can still be dumped after that.
+ */
+void uthread_profiler_dump(FILE* out);
+
+
+/**
+ * What `uthread_get_stats()` reports about a `uthread`. The hardware counts
+ * cover only user-space execution, while the `uthread` ran with the counters
+ * started (see `uthread_perf_counters_start()`). Each is -1 if that counter is
+ * not available.
+ */
+typedef struct {
+	unsigned long id;  // As used by the profiler.
+	long running_ns;  // The CPU time which it has used (as of its last switch).
+	unsigned long num_switches;  // Times it has been switched to.
+	long long instructions;
+	long long cycles;
+	long long llc_misses;  // Usually last-level cache misses.
+	long long branch_misses;
+} uthread_stats_t;
+
+
+/**
+ * Starts counting hardware events on every `kthread` (including ones started
+ * later), with `perf_event_open()`. At every context switch, what was counted
+ * since the last one is added to the totals of the `uthread` which was switched
+ * off of. This costs a system call per switch, so it is off by default.
+ *
+ * Counters which cannot be opened (e.g. because `perf_event_paranoid` forbids
+ * them, or because there is no such hardware event) are left out. The system
+ * must have been initialized. Returns 0 on success (or if counting already
+ * started), or -1 if no counter could be opened.
+ */
+int uthread_perf_counters_start();
+
+
+/**
+ * Stops counting hardware events. The totals so far are kept.
+ */
+void uthread_perf_counters_stop();
+
+
+/**
+ * Fills in `*stats` for the given `uthread`. For the calling `uthread`, the
+ * hardware counts are up to date; for others, they are as of the last time
+ * they were switched off of.
+ */
+void uthread_get_stats(uthread_handle_t handle, uthread_stats_t* stats);
+
+
+/**
+ * What the watchdog reports about a `uthread` which has run for too long
+ * without entering the scheduler (e.g. by yielding).
+ */
+typedef struct {
+	unsigned long uthread_id;  // As used by the profiler.
+	long running_ns;  // How long it has run since it last entered the scheduler.
+	int kthread;  // The index of the `kthread` slot running it.
+	int is_blocked;  // Whether it is stuck in a blocking system call.
+	int depth;  // The number of frames in `pcs` (0 if no stack trace was taken).
+	void* const* pcs;  // Code addresses, innermost first.
+} uthread_watchdog_report_t;
+
+
+/**
+ * Starts the watchdog: a thread which notices any `uthread` that has been
+ * running for more than `threshold_ns` without entering the scheduler, and
+ * which so starves the `uthread`s waiting for its `kthread`. Each such stretch
+ * is reported once, by calling `callback(report, ctx)` on the watchdog thread.
+ * The report (including its stack trace, which is taken by walking frame
+ * pointers as the profiler does) is only valid during the call. A `NULL`
+ * `callback` prints the reports to `stderr`. The callback must not stop the
+ * watchdog.
+ *
+ * The watchdog looks about four times per threshold (but at most every 1ms),
+ * so a report comes up to a quarter of the threshold late. Stack traces are
+ * taken by interrupting the `kthread` with `SIGURG`. A handler which the
+ * application had installed for `SIGURG` is still called for every other
+ * `SIGURG`, and is reinstalled when the watchdog stops. The system must have
+ * been initialized. Returns 0 on success, or -1 if the watchdog is already
+ * running.
+ */
+int uthread_watchdog_start(long threshold_ns,
+                           void (*callback)(const uthread_watchdog_report_t* report, void* ctx),
+                           void* ctx);
+
+
+/**
+ * Stops the watchdog, if it is running. It is also stopped when the system
+ * shuts down.
+ */
+void uthread_watchdog_stop();
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif  /* _UTHREAD_H */
@@ -0,0 +1,377 @@
+#ifndef _UTHREAD_HPP
+#define _UTHREAD_HPP
+
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+#include "uthread.h"
+
+/**
+ * A header-only C++ (17) layer over the `uthread` C API. See `uthread.h` for
+ * the system itself, which must still be initialized (`uthread_system_init()`)
+ * and shut down (`uthread_exit()` from the main thread) through the C API.
+ */
+namespace uthread {
+
+namespace detail {
+
+/**
+ * The states of a `task`'s shared state, which is waited on with
+ * `uthread_wait()`.
+ */
+enum : int { RUNNING = 0, DONE = 1, RELEASED = 2 };
+
+
+/**
+ * Where a `uthread` leaves its result (a value or an exception) for `join()`.
+ */
+template <typename T>
+struct result
+{
+	static_assert(!std::is_rvalue_reference_v<T>,
+	              "a spawned function cannot return an rvalue reference");
+
+	alignas(T) unsigned char value[sizeof(T)];
+	bool has_value = false;
+	std::exception_ptr error;
+
+	template <typename F>
+	void run(F& func)
+	{
+		try {
+			::new (static_cast<void*>(value)) T(std::invoke(std::move(func)));
+			has_value = true;
+		} catch (...) {
+			error = std::current_exception();
+		}
+	}
+
+	T take()
+	{
+		if (error) {
+			std::rethrow_exception(std::move(error));
+		}
+		T* ptr = std::launder(reinterpret_cast<T*>(value));
+		T taken(std::move(*ptr));
+		ptr->~T();
+		has_value = false;
+		return taken;
+	}
+
+	~result()
+	{
+		if (has_value) {
+			std::launder(reinterpret_cast<T*>(value))->~T();
+		}
+	}
+};
+
+/**
+ * A reference result only keeps a pointer to the referred-to object, which
+ * must outlive the `join()`.
+ */
+template <typename T>
+struct result<T&>
+{
+	T* value = nullptr;
+	std::exception_ptr error;
+
+	template <typename F>
+	void run(F& func)
+	{
+		try {
+			value = std::addressof(std::invoke(std::move(func)));
+		} catch (...) {
+			error = std::current_exception();
+		}
+	}
+
+	T& take()
+	{
+		if (error) {
+			std::rethrow_exception(std::move(error));
+		}
+		return *value;
+	}
+};
+
+template <>
+struct result<void>
+{
+	std::exception_ptr error;
+
+	template <typename F>
+	void run(F& func)
+	{
+		try {
+			std::invoke(std::move(func));
+		} catch (...) {
+			error = std::current_exception();
+		}
+	}
+
+	void take()
+	{
+		if (error) {
+			std::rethrow_exception(std::move(error));
+		}
+	}
+};
+
+
+/**
+ * The part of a spawned `uthread`'s state which its `task` uses. `state` is
+ * only accessed atomically.
+ */
+template <typename T>
+struct shared
+{
+	int state = RUNNING;
+	result<T> res;
+};
+
+
+/**
+ * All of a spawned `uthread`'s state: its `shared` state, and its function,
+ * which is destroyed as soon as it has been called.
+ */
+template <typename F, typename T>
+struct frame : shared<T>
+{
+	alignas(F) unsigned char func[sizeof(F)];
+
+	template <typename G>
+	explicit frame(G&& g)
+	{
+		::new (static_cast<void*>(func)) F(std::forward<G>(g));
+	}
+
+	/**
+	 * Runs in the `uthread`. Once the result is stored, it waits until the
+	 * `task` has taken it (or was detached), since the frame may be in the
+	 * `uthread`'s stack.
+	 */
+	void run()
+	{
+		F* ptr = std::launder(reinterpret_cast<F*>(func));
+		this->res.run(*ptr);
+		ptr->~F();
+
+		if (__atomic_exchange_n(&this->state, DONE, __ATOMIC_ACQ_REL) != RELEASED) {
+			uthread_wake(&this->state, 1);
+			while (__atomic_load_n(&this->state, __ATOMIC_ACQUIRE) != RELEASED) {
+				uthread_wait(&this->state, DONE, nullptr);
+			}
+		}
+	}
+
+	/**
+	 * The `uthread` function of a frame stored inline in the stack.
+	 */
+	static void run_inline(void* arg)
+	{
+		frame* self = static_cast<frame*>(arg);
+		self->run();
+		self->~frame();
+	}
+
+	/**
+	 * The `uthread` function of a frame which was too big (or too strictly
+	 * aligned) to store inline, or whose function may throw while moved. Only
+	 * a pointer to it is stored inline.
+	 */
+	static void run_boxed(void* arg)
+	{
+		frame* self = *static_cast<frame**>(arg);
+		self->run();
+		delete self;
+	}
+};
+
+}  // namespace detail
+
+
+
+/**
+ * The result of `spawn()`: a handle on a `uthread` which can be joined to get
+ * what its function returned (or threw). A `task` which is destroyed (or
+ * assigned to) without being joined detaches its `uthread`, whose result is
+ * then discarded.
+ */
+template <typename T>
+class task
+{
+public:
+	task() noexcept = default;
+
+	explicit task(detail::shared<T>* shared) noexcept : _shared(shared) {}
+
+	task(task&& other) noexcept : _shared(std::exchange(other._shared, nullptr)) {}
+
+	task& operator=(task&& other) noexcept
+	{
+		if (this != &other) {
+			detach();
+			_shared = std::exchange(other._shared, nullptr);
+		}
+		return *this;
+	}
+
+	task(const task&) = delete;
+	task& operator=(const task&) = delete;
+
+	~task() { detach(); }
+
+	/**
+	 * Returns whether this `task` still refers to a `uthread`.
+	 */
+	bool joinable() const noexcept { return _shared != nullptr; }
+
+	/**
+	 * Waits for the `uthread` to finish (parking the caller, if it is a
+	 * `uthread`), and then returns what its function returned, or rethrows
+	 * what it threw. The `task` is not joinable afterwards.
+	 */
+	T join()
+	{
+		detail::shared<T>* shared = std::exchange(_shared, nullptr);
+		while (__atomic_load_n(&shared->state, __ATOMIC_ACQUIRE) == detail::RUNNING) {
+			uthread_wait(&shared->state, detail::RUNNING, nullptr);
+		}
+
+		// Releasing the `uthread` lets it free the shared state, so the result
+		// is moved out first.
+		struct releaser {
+			detail::shared<T>* shared;
+			~releaser()
+			{
+				__atomic_store_n(&shared->state, detail::RELEASED, __ATOMIC_RELEASE);
+				uthread_wake(&shared->state, 1);
+			}
+		} release{shared};
+		return shared->res.take();
+	}
+
+	/**
+	 * Lets the `uthread` run on without being joined.
+	 */
+	void detach() noexcept
+	{
+		if (_shared != nullptr) {
+			detail::shared<T>* shared = std::exchange(_shared, nullptr);
+			if (__atomic_exchange_n(&shared->state, detail::RELEASED, __ATOMIC_ACQ_REL) == detail::DONE) {
+				uthread_wake(&shared->state, 1);
+			}
+		}
+	}
+
+private:
+	detail::shared<T>* _shared = nullptr;
+};
+
+
+
+/**
+ * Creates a `uthread` which runs (a copy of) `func`, and returns a `task` for
+ * joining it. The function object and the `task`'s shared state are stored in
+ * the top of the new `uthread`'s stack (see `uthread_prepare_arg()`), so this
+ * makes no allocations besides the `uthread` itself when they fit in
+ * `UTHREAD_INLINE_ARG_MAX` bytes. Bigger ones are allocated separately.
+ */
+template <typename F>
+auto spawn(F&& func) -> task<std::invoke_result_t<std::decay_t<F>>>
+{
+	using T = std::invoke_result_t<std::decay_t<F>>;
+	using frame_t = detail::frame<std::decay_t<F>, T>;
+
+	constexpr bool fits_inline = sizeof(frame_t) <= UTHREAD_INLINE_ARG_MAX
+	                             && alignof(frame_t) <= 64
+	                             && std::is_nothrow_constructible_v<std::decay_t<F>, F&&>;
+
+	frame_t* frame;
+	void* arg;
+	if constexpr (fits_inline) {
+		arg = uthread_prepare_arg(frame_t::run_inline, sizeof(frame_t));
+		frame = ::new (arg) frame_t(std::forward<F>(func));
+	} else {
+		frame = new frame_t(std::forward<F>(func));
+		arg = uthread_prepare_arg(frame_t::run_boxed, sizeof(frame_t*));
+		::new (arg) frame_t*(frame);
+	}
+	uthread_start_prepared(arg);
+	return task<T>(frame);
+}
+
+
+
+/**
+ * A mutual exclusion lock which parks a `uthread` which has to wait for it
+ * (with `uthread_wait()`), rather than blocking its `kthread`. It can also be
+ * used by threads which are not `uthread`s. Use it through `lock_guard` or
+ * `unique_lock`.
+ */
+class mutex
+{
+public:
+	mutex() noexcept = default;
+	mutex(const mutex&) = delete;
+	mutex& operator=(const mutex&) = delete;
+
+	void lock() noexcept
+	{
+		// The state is 0 if unlocked, 1 if locked, or 2 if locked with (maybe)
+		// some waiters, as in Drepper's "Futexes Are Tricky".
+		int c = 0;
+		if (__atomic_compare_exchange_n(&_state, &c, 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+			return;
+		}
+		if (c != 2) {
+			c = __atomic_exchange_n(&_state, 2, __ATOMIC_ACQUIRE);
+		}
+		while (c != 0) {
+			uthread_wait(&_state, 2, nullptr);
+			c = __atomic_exchange_n(&_state, 2, __ATOMIC_ACQUIRE);
+		}
+	}
+
+	bool try_lock() noexcept
+	{
+		int c = 0;
+		return __atomic_compare_exchange_n(&_state, &c, 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+	}
+
+	void unlock() noexcept
+	{
+		if (__atomic_exchange_n(&_state, 0, __ATOMIC_RELEASE) == 2) {
+			uthread_wake(&_state, 1);
+		}
+	}
+
+private:
+	int _state = 0;
+};
+
+using lock_guard = std::lock_guard<mutex>;
+using unique_lock = std::unique_lock<mutex>;
+
+
+
+/**
+ * See `uthread_yield()`.
+ */
+inline void yield() { uthread_yield(); }
+
+
+/**
+ * See `uthread_maybe_yield()`.
+ */
+inline void maybe_yield() { uthread_maybe_yield(); }
+
+}  // namespace uthread
+
+#endif  /* _UTHREAD_HPP */